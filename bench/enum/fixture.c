@@ -0,0 +1,351 @@
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#include "fixture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+
+#define MAX_INTERFACES      32
+#define HIDDEV_MAJOR        180
+#define HIDDEV_MINOR        96
+
+typedef struct fixture_writer {
+    const usb_fixture   *fx;
+    FILE                *dump;
+    char                devices[256];   /* sys/bus/usb/devices */
+    char                sys[224];
+    char                dev[224];
+    int                 bus;
+    int                 fanout;         /* ports of every hub but the root hubs */
+    int                 left;           /* devices still to plug into the bus */
+    int                 devnum;
+    int                 minor;
+    int                 written;
+    int                 nodes;
+} fixture_writer;
+
+extern const char* usb_fixture_path(const char* dir,const char* name,char* path,int size)
+{
+    snprintf(path,size,"%s/%s",dir,name);
+    return path;
+}
+
+static void make_dirs(const char* path)
+{
+    char buf[1024],*p;
+
+    snprintf(buf,sizeof(buf),"%s",path);
+    for(p=buf+1;*p;p++){
+        if(*p == '/'){
+            *p = 0;
+            mkdir(buf,0755);
+            *p = '/';
+        }
+    }
+    mkdir(buf,0755);
+}
+
+static void write_file(const char* dir,const char* name,const void* data,size_t len)
+{
+    char path[1024];
+    FILE* f;
+
+    snprintf(path,sizeof(path),"%s/%s",dir,name);
+    f = fopen(path,"w");
+    if(f){
+        fwrite(data,1,len,f);
+        fclose(f);
+    }
+}
+
+static void write_attr(const char* dir,const char* name,const char* value)
+{
+    char buf[256];
+
+    write_file(dir,name,buf,snprintf(buf,sizeof(buf),"%s\n",value));
+}
+
+static void write_int(const char* dir,const char* name,int value)
+{
+    char buf[32];
+
+    snprintf(buf,sizeof(buf),"%d",value);
+    write_attr(dir,name,buf);
+}
+
+/**********************descriptors****************************************/
+
+static size_t hub_descriptors(unsigned char* d,int root)
+{
+    static const unsigned char hub[] = {
+        18,1, 0x00,0x02, 0x09,0x00,0x01, 64, 0x6b,0x1d, 0x02,0x00, 0x19,0x04, 3,2,1, 1,
+        9,2, 25,0, 1,1,0,0xe0,0,
+        9,4, 0,0,1,0x09,0x00,0x00,0,
+        7,5, 0x81,0x03,4,0,12
+    };
+
+    memcpy(d,hub,sizeof(hub));
+    if(!root){
+        /* an external hub of a common make, bus powered */
+        d[8] = 0xe3;d[9] = 0x05;
+        d[10] = 0x08;d[11] = 0x06;
+        d[12] = 0x90;d[13] = 0x60;
+        d[25] = 0xa0;d[26] = 50;
+        d[40] = 1;
+    }
+    return sizeof(hub);
+}
+
+/* the even interfaces are hid, the odd ones belong to the vendor */
+static size_t device_descriptors(unsigned char* d,int product,int interfaces)
+{
+    size_t len = 0,total;
+    int i,ep;
+
+    static const unsigned char device[] = {
+        18,1, 0x00,0x02, 0x00,0x00,0x00, 64, 0xb4,0x04, 0x00,0x00, 0x00,0x01, 1,2,3, 1
+    };
+
+    memcpy(d,device,sizeof(device));
+    d[10] = product&0xff;
+    d[11] = (product>>8)&0xff;
+    len += sizeof(device);
+
+    total = 9+interfaces*(9+7+7);
+    d[len++] = 9;d[len++] = 2;
+    d[len++] = total&0xff;d[len++] = (total>>8)&0xff;
+    d[len++] = interfaces;d[len++] = 1;d[len++] = 0;d[len++] = 0xa0;d[len++] = 50;
+
+    for(i=0;i<interfaces;i++){
+        ep = i%15+1;
+        d[len++] = 9;d[len++] = 4;
+        d[len++] = i;d[len++] = 0;d[len++] = 2;
+        d[len++] = i%2?0xff:0x03;d[len++] = 0;d[len++] = 0;d[len++] = 0;
+        d[len++] = 7;d[len++] = 5;d[len++] = 0x80|ep;d[len++] = 0x03;d[len++] = 64;d[len++] = 0;d[len++] = 10;
+        d[len++] = 7;d[len++] = 5;d[len++] = ep;d[len++] = i%2?0x02:0x03;d[len++] = 64;d[len++] = 0;d[len++] = i%2?0:10;
+    }
+    return len;
+}
+
+/**********************devices****************************************/
+
+/* an interface directory, reachable from bus/usb/devices as in sysfs */
+static void write_interface(fixture_writer* w,const char* devdir,const char* name,
+                            const char* iface,const char* driver)
+{
+    char dir[512],link[1024],path[1024],buf[128];
+
+    snprintf(dir,sizeof(dir),"%s/%s",devdir,iface);
+    mkdir(dir,0755);
+    snprintf(link,sizeof(link),"%s/%s",w->devices,iface);
+    snprintf(path,sizeof(path),"%s/%s",name,iface);
+    symlink(path,link);
+    if(!driver)
+        return;
+
+    snprintf(link,sizeof(link),"%s/driver",dir);
+    snprintf(path,sizeof(path),"../../../bus/usb/drivers/%s",driver);
+    symlink(path,link);
+    if(strcmp(driver,"usbhid") != 0)
+        return;
+
+    /* the node hiddev makes, with the links udev and the kernel add */
+    snprintf(path,sizeof(path),"%s/usbmisc/hiddev%d",dir,w->minor);
+    make_dirs(path);
+    snprintf(buf,sizeof(buf),"%d:%d",HIDDEV_MAJOR,HIDDEV_MINOR+w->minor);
+    write_attr(path,"dev",buf);
+
+    snprintf(path,sizeof(path),"%s/dev/char/%d:%d",w->sys,HIDDEV_MAJOR,HIDDEV_MINOR+w->minor);
+    make_dirs(path);
+    snprintf(buf,sizeof(buf),"MAJOR=%d\nMINOR=%d\nDEVNAME=usb/hiddev%d",
+             HIDDEV_MAJOR,HIDDEV_MINOR+w->minor,w->minor);
+    write_attr(path,"uevent",buf);
+
+    snprintf(path,sizeof(path),"%s/usb/hiddev%d",w->dev,w->minor);
+    if(mknod(path,S_IFCHR|0600,makedev(HIDDEV_MAJOR,HIDDEV_MINOR+w->minor)) == 0)
+        w->nodes++;
+    snprintf(link,sizeof(link),"%s/char/%d:%d",w->dev,HIDDEV_MAJOR,HIDDEV_MINOR+w->minor);
+    snprintf(path,sizeof(path),"../usb/hiddev%d",w->minor);
+    symlink(path,link);
+
+    w->minor++;
+}
+
+/*
+ * One device in both forms. name is its sysfs name, ports the part after
+ * the bus; level 0 is a root hub.
+ */
+static int write_device(fixture_writer* w,int level,int parent,int port,int cnt,const char* ports,int hub)
+{
+    unsigned char desc[18+9+MAX_INTERFACES*23];
+    char name[64],dir[512],iface[96],buf[64],serial[32];
+    int devnum = w->devnum++,product = w->written;
+    int maxchild = hub?(level || w->fx->depth?w->fanout:w->fx->per_bus):0;
+    int i;
+    size_t len;
+    FILE* f = w->dump;
+
+    if(level)
+        snprintf(name,sizeof(name),"%d-%s",w->bus,ports);
+    else
+        snprintf(name,sizeof(name),"usb%d",w->bus);
+    snprintf(dir,sizeof(dir),"%s/%s",w->devices,name);
+    mkdir(dir,0755);
+
+    fprintf(f,"\nT:  Bus=%02d Lev=%02d Prnt=%02d Port=%02d Cnt=%02d Dev#=%3d Spd=%-4s MxCh=%2d\n",
+            w->bus,level,parent,port,cnt,devnum,hub?"480":"12",maxchild);
+    if(!level)
+        fprintf(f,"B:  Alloc=  0/800 us ( 0%%), #Int=  1, #Iso=  0\n");
+
+    if(hub){
+        len = hub_descriptors(desc,!level);
+        fprintf(f,"D:  Ver= 2.00 Cls=09(hub  ) Sub=00 Prot=01 MxPS=64 #Cfgs=  1\n");
+        if(level){
+            fprintf(f,"P:  Vendor=05e3 ProdID=0608 Rev=60.90\n");
+            fprintf(f,"S:  Product=USB2.0 Hub\n");
+            fprintf(f,"C:* #Ifs= 1 Cfg#= 1 Atr=a0 MxPwr=100mA\n");
+            fprintf(f,"I:* If#= 0 Alt= 0 #EPs= 1 Cls=09(hub  ) Sub=00 Prot=00 Driver=hub\n");
+            fprintf(f,"E:  Ad=81(I) Atr=03(Int.) MxPS=   1 Ivl=256ms\n");
+            write_attr(dir,"product","USB2.0 Hub");
+            snprintf(iface,sizeof(iface),"%s:1.0",name);
+        }else{
+            snprintf(serial,sizeof(serial),"0000:00:%02x.0",w->bus);
+            fprintf(f,"P:  Vendor=1d6b ProdID=0002 Rev= 4.19\n");
+            fprintf(f,"S:  Manufacturer=Linux 4.19.0 ehci_hcd\n");
+            fprintf(f,"S:  Product=EHCI Host Controller\n");
+            fprintf(f,"S:  SerialNumber=%s\n",serial);
+            fprintf(f,"C:* #Ifs= 1 Cfg#= 1 Atr=e0 MxPwr=  0mA\n");
+            fprintf(f,"I:* If#= 0 Alt= 0 #EPs= 1 Cls=09(hub  ) Sub=00 Prot=00 Driver=hub\n");
+            fprintf(f,"E:  Ad=81(I) Atr=03(Int.) MxPS=   4 Ivl=256ms\n");
+            write_attr(dir,"manufacturer","Linux 4.19.0 ehci_hcd");
+            write_attr(dir,"product","EHCI Host Controller");
+            write_attr(dir,"serial",serial);
+            /* root hub interfaces are named after port 0 */
+            snprintf(iface,sizeof(iface),"%d-0:1.0",w->bus);
+        }
+        write_interface(w,dir,name,iface,"hub");
+    }else{
+        len = device_descriptors(desc,product,w->fx->interfaces);
+        snprintf(buf,sizeof(buf),"Synthetic HID %d",product);
+        snprintf(serial,sizeof(serial),"%08d",product);
+        fprintf(f,"D:  Ver= 2.00 Cls=00(>ifc ) Sub=00 Prot=00 MxPS=64 #Cfgs=  1\n");
+        fprintf(f,"P:  Vendor=04b4 ProdID=%04x Rev= 1.00\n",product&0xffff);
+        fprintf(f,"S:  Manufacturer=Synthetic Devices Inc.\n");
+        fprintf(f,"S:  Product=%s\n",buf);
+        fprintf(f,"S:  SerialNumber=%s\n",serial);
+        fprintf(f,"C:* #Ifs=%2d Cfg#= 1 Atr=a0 MxPwr=100mA\n",w->fx->interfaces);
+        for(i=0;i<w->fx->interfaces;i++){
+            fprintf(f,"I:* If#=%2d Alt= 0 #EPs= 2 Cls=%s Sub=00 Prot=00 Driver=%s\n",
+                    i,i%2?"ff(vend.)":"03(HID  )",i%2?"(none)":"usbhid");
+            fprintf(f,"E:  Ad=%02x(I) Atr=03(Int.) MxPS=  64 Ivl=10ms\n",0x80|(i%15+1));
+            fprintf(f,"E:  Ad=%02x(O) Atr=%s MxPS=  64 Ivl=%s\n",i%15+1,
+                    i%2?"02(Bulk)":"03(Int.)",i%2?"0ms":"10ms");
+            snprintf(iface,sizeof(iface),"%s:1.%d",name,i);
+            write_interface(w,dir,name,iface,i%2?NULL:"usbhid");
+        }
+        write_attr(dir,"manufacturer","Synthetic Devices Inc.");
+        write_attr(dir,"product",buf);
+        write_attr(dir,"serial",serial);
+    }
+
+    write_file(dir,"descriptors",desc,len);
+    write_int(dir,"devnum",devnum);
+    write_attr(dir,"speed",hub?"480":"12");
+    write_attr(dir,"bConfigurationValue","1");
+    write_int(dir,"maxchild",maxchild);
+
+    w->written++;
+    return devnum;
+}
+
+/* fill the ports of a hub, depth first as the kernel lists them */
+static void write_ports(fixture_writer* w,int level,int parent,const char* ports,int nports)
+{
+    char path[64];
+    int port,devnum;
+
+    for(port=0;port<nports && w->left>0;port++){
+        if(level)
+            snprintf(path,sizeof(path),"%s.%d",ports,port+1);
+        else
+            snprintf(path,sizeof(path),"%d",port+1);
+        if(level < w->fx->depth){
+            devnum = write_device(w,level+1,parent,port,port+1,path,1);
+            write_ports(w,level+1,devnum,path,w->fanout);
+        }else{
+            write_device(w,level+1,parent,port,port+1,path,0);
+            w->left--;
+        }
+    }
+}
+
+extern int usb_fixture_write(const usb_fixture* fx,const char* dir,int* nodes)
+{
+    usb_fixture def = *fx;
+    fixture_writer w;
+    char path[1024];
+    int left,n;
+
+    if(def.per_bus <= 0)
+        def.per_bus = USB_FIXTURE_PER_BUS;
+    if(def.depth < 0)
+        def.depth = 0;
+    if(def.depth > USB_FIXTURE_MAX_DEPTH)
+        def.depth = USB_FIXTURE_MAX_DEPTH;
+    if(def.interfaces < 1)
+        def.interfaces = 1;
+    if(def.interfaces > MAX_INTERFACES)
+        def.interfaces = MAX_INTERFACES;
+
+    memset(&w,0,sizeof(w));
+    w.fx = &def;
+    snprintf(w.sys,sizeof(w.sys),"%s/sys",dir);
+    snprintf(w.dev,sizeof(w.dev),"%s/dev",dir);
+    snprintf(w.devices,sizeof(w.devices),"%s/bus/usb/devices",w.sys);
+    make_dirs(w.devices);
+    snprintf(path,sizeof(path),"%s/usb",w.dev);
+    make_dirs(path);
+    snprintf(path,sizeof(path),"%s/char",w.dev);
+    make_dirs(path);
+
+    w.dump = fopen(usb_fixture_path(dir,"devices",path,sizeof(path)),"w");
+    if(!w.dump)
+        return -1;
+
+    /* the fewest ports that reach per_bus devices through depth tiers */
+    for(w.fanout=2;;w.fanout++){
+        for(left=def.per_bus,n=0;n<def.depth && left>1;n++)
+            left = (left+w.fanout-1)/w.fanout;
+        if(left <= w.fanout || def.depth == 0)
+            break;
+    }
+
+    for(left=def.devices,w.bus=1;left>0;w.bus++){
+        w.left = left>def.per_bus?def.per_bus:left;
+        left -= w.left;
+        w.devnum = 1;
+        write_device(&w,0,0,0,0,NULL,1);
+        /* below the root hub the fanout of the tiers takes over */
+        write_ports(&w,0,1,NULL,def.depth?w.fanout:def.per_bus);
+    }
+    fclose(w.dump);
+
+    if(nodes)
+        *nodes = w.nodes;
+    return w.written;
+}
+
+static int remove_entry(const char* path,const struct stat* st,int flag,struct FTW* ftw)
+{
+    return remove(path);
+}
+
+extern void usb_fixture_remove(const char* dir)
+{
+    nftw(dir,remove_entry,16,FTW_DEPTH|FTW_PHYS);
+}
@@ -0,0 +1,28 @@
+#ifndef FIXTURE_H
+#define FIXTURE_H
+
+/*
+ * Synthetic usb trees: a dump in the format of /proc/bus/usb/devices and
+ * the same devices as sysfs and /dev would show them, written to
+ * dir/devices, dir/sys and dir/dev.
+ */
+typedef struct usb_fixture {
+    int     devices;        /* devices other than hubs */
+    int     depth;          /* tiers of hubs between the root hubs and them, up to 5 */
+    int     interfaces;     /* per device, the even ones are hid with a node */
+    int     per_bus;        /* devices other than hubs on one bus */
+} usb_fixture;
+
+#define USB_FIXTURE_PER_BUS     64
+#define USB_FIXTURE_MAX_DEPTH   5
+
+/* the fixture file under dir, like "devices" or "sys" */
+extern const char* usb_fixture_path(const char* dir,const char* name,char* path,int size);
+/*
+ * all devices written, hubs included, or -1; the nodes under dev are
+ * only made when mknod is allowed, *nodes tells how many were
+ */
+extern int usb_fixture_write(const usb_fixture* fx,const char* dir,int* nodes);
+extern void usb_fixture_remove(const char* dir);
+
+#endif // FIXTURE_H
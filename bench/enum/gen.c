@@ -0,0 +1,41 @@
+#include "fixture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOG(fmt,...)          do{fprintf(stdout,fmt"\n",##__VA_ARGS__);}while(0)
+
+static void usage(const char* name)
+{
+    LOG("usage: %s [-n devices] [-d depth] [-i interfaces] [-b per bus] dir",name);
+    LOG("writes dir/devices, dir/sys and dir/dev");
+}
+
+int main(int argc,char** argv)
+{
+    usb_fixture fx = {1000,1,2,USB_FIXTURE_PER_BUS};
+    int opt,written,nodes = 0;
+
+    while((opt = getopt(argc,argv,"n:d:i:b:h")) != -1){
+        switch(opt){
+        case 'n': fx.devices = atoi(optarg); break;
+        case 'd': fx.depth = atoi(optarg); break;
+        case 'i': fx.interfaces = atoi(optarg); break;
+        case 'b': fx.per_bus = atoi(optarg); break;
+        default: usage(argv[0]); return opt=='h'?0:-1;
+        }
+    }
+    if(optind >= argc){
+        usage(argv[0]);
+        return -1;
+    }
+
+    written = usb_fixture_write(&fx,argv[optind],&nodes);
+    if(written < 0){
+        LOG("write %s failed!",argv[optind]);
+        return -1;
+    }
+    LOG("%d devices, %d with hubs, %d nodes in %s",fx.devices,written,nodes,argv[optind]);
+    return 0;
+}
@@ -0,0 +1,349 @@
+#define _XOPEN_SOURCE 700
+#include "../../src/usbview.h"
+#include "../../src/usbapi.h"
+#include "../../src/usbscan.h"
+#include "../../src/usbtable.h"
+#include "fixture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG(fmt,...)          do{fprintf(stdout,fmt"\n",##__VA_ARGS__);}while(0)
+
+/**********************allocations****************************************/
+
+/*
+ * Every allocation of the process goes through these, the ones libc makes
+ * for the library included, and lands in the allocator of glibc.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n,size_t size);
+extern void *__libc_realloc(void* p,size_t size);
+extern void __libc_free(void* p);
+
+static unsigned long alloc_calls = 0;
+static unsigned long alloc_bytes = 0;
+
+#define COUNT(size)     do{__atomic_add_fetch(&alloc_calls,1,__ATOMIC_RELAXED);     \
+                           __atomic_add_fetch(&alloc_bytes,size,__ATOMIC_RELAXED);}while(0)
+
+void *malloc(size_t size)
+{
+    COUNT(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n,size_t size)
+{
+    COUNT(n*size);
+    return __libc_calloc(n,size);
+}
+
+void *realloc(void* p,size_t size)
+{
+    COUNT(size);
+    return __libc_realloc(p,size);
+}
+
+void free(void* p)
+{
+    __libc_free(p);
+}
+
+/**********************timings****************************************/
+
+typedef struct bench_op {
+    const char      *name;
+    double          *times;         /* ms of every loop */
+    unsigned long   calls;          /* allocations over all loops */
+    unsigned long   bytes;
+} bench_op;
+
+typedef struct bench_mark {
+    double          start;
+    unsigned long   calls;
+    unsigned long   bytes;
+} bench_mark;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static void bench_begin(bench_mark* mark)
+{
+    mark->calls = __atomic_load_n(&alloc_calls,__ATOMIC_RELAXED);
+    mark->bytes = __atomic_load_n(&alloc_bytes,__ATOMIC_RELAXED);
+    mark->start = now();
+}
+
+static void bench_end(bench_op* op,int loop,bench_mark* mark)
+{
+    op->times[loop] = (now()-mark->start)*1000;
+    op->calls += __atomic_load_n(&alloc_calls,__ATOMIC_RELAXED)-mark->calls;
+    op->bytes += __atomic_load_n(&alloc_bytes,__ATOMIC_RELAXED)-mark->bytes;
+}
+
+static int cmp_double(const void* a,const void* b)
+{
+    double x = *(const double*)a,y = *(const double*)b;
+    return x<y?-1:x>y;
+}
+
+/* nearest rank */
+static double percentile(const double* sorted,int n,int p)
+{
+    int rank = (n*p+99)/100;
+    return sorted[rank>0?rank-1:0];
+}
+
+static void report(bench_op* op,int loops)
+{
+    qsort(op->times,loops,sizeof(double),cmp_double);
+    LOG("%-26s %9.3f %9.3f %9.3f %9.3f %9.3f %10lu %10.1f",op->name,
+        op->times[0],percentile(op->times,loops,50),percentile(op->times,loops,90),
+        percentile(op->times,loops,99),op->times[loops-1],
+        op->calls/loops,op->bytes/1024.0/loops);
+}
+
+/**********************enumerations****************************************/
+
+enum {
+    OP_GET,OP_GET_FREE,OP_TABLE,OP_RULES_TREE,OP_RULES_TABLE,
+    OP_VISIT,OP_OPEN_MISS,OP_API,OP_API_FREE,OP_FILE,OP_FILE_FREE,OP_VISIT_FILE,OP_NUM
+};
+
+/* a vendor no fixture has, usbapi_open_vid_pid looks at every device for it */
+#define MISS_VENDOR     0xffff
+
+static int count_devices(const usb_device_info* info)
+{
+    int n = 0;
+
+    for(;info;info=info->next)
+        n++;
+    return n;
+}
+
+/* devices and interfaces, as a visitor sees them */
+static int visit_device(void* ctx,const usb_device_info* device)
+{
+    ((int*)ctx)[0]++;
+    return USB_VISIT_CONTINUE;
+}
+
+static int visit_interface(void* ctx,const usb_device_info* device,const usb_device_config* config,
+                           const usb_device_interface* interface)
+{
+    ((int*)ctx)[1]++;
+    return USB_VISIT_CONTINUE;
+}
+
+static const usb_visitor count_visitor = {visit_device,NULL,visit_interface,NULL,USB_ENUM_INTERFACES};
+
+static int count_api(const usbapi_device_info* info)
+{
+    int n = 0;
+
+    for(;info;info=info->next)
+        n++;
+    return n;
+}
+
+/**********************rules****************************************/
+
+#define RULE_VENDOR     0x04b4
+#define RULE_HID        3
+#define RULE_HUB        9
+
+/* the rows a rule found, for the table to have somewhere to write */
+static uint32_t rule_rows[1<<16];
+
+/* hid interfaces, the devices of a vendor, hubs, usbhid and what is behind the first device */
+static unsigned long rules_tree(const usb_device_info* root)
+{
+    const usb_device_info *info,*p;
+    const char* hid = usb_find_string(root,"usbhid");
+    unsigned long found = 0;
+    int i,j;
+
+    for(info=root;info;info=info->next){
+        found += info->idVendor == RULE_VENDOR;
+        found += info->bDeviceClass == RULE_HUB;
+        for(p=info->parent;p && p!=root;p=p->parent);
+        found += p && p==root;
+        for(i=0;info->config && i<info->bNumConfigurations && info->config[i];i++){
+            const usb_device_config* config = info->config[i];
+            for(j=0;config->interfaces && j<config->bNumInterfaces && config->interfaces[j];j++){
+                found += config->interfaces[j]->bInterfaceClass == RULE_HID;
+                found += hid && config->interfaces[j]->driver == hid;
+            }
+        }
+    }
+    return found;
+}
+
+static unsigned long rules_table(const usb_table* table,const usb_device_info* root)
+{
+    usb_table_match vendor = USB_TABLE_MATCH_ANY,hub = USB_TABLE_MATCH_ANY,hid = USB_TABLE_MATCH_ANY;
+    const char* driver = usb_find_string(root,"usbhid");
+    const uint32_t max = sizeof(rule_rows)/sizeof(rule_rows[0]);
+    unsigned long found = 0;
+
+    vendor.vendor_id = RULE_VENDOR;
+    hub.class_code = RULE_HUB;
+    hid.class_code = RULE_HID;
+    found += usb_table_match_devices(table,&vendor,rule_rows,max);
+    found += usb_table_match_devices(table,&hub,rule_rows,max);
+    if(table->ndevices)
+        found += usb_table_devices_under(table,0,rule_rows,max);
+    found += usb_table_match_interfaces(table,&hid,rule_rows,max);
+    if(driver)
+        found += usb_table_interfaces_by_driver(table,driver,rule_rows,max);
+    return found;
+}
+
+/**********************runs****************************************/
+
+static int run(const usb_fixture* fx,int loops)
+{
+    char dir[] = "/tmp/usbview-enum-XXXXXX";
+    char sys[sizeof(dir)+16],dev[sizeof(dir)+16],dump[sizeof(dir)+16];
+    bench_op ops[OP_NUM] = {
+        {"get_usb_devices"},{"  free_usb_devices"},
+        {"usb_table_build"},{"  rules, tree walk"},{"  rules, table"},
+        {"usb_enumerate_visit"},{"usbapi_open_vid_pid, miss"},
+        {"usbapi_enumerate"},{"  usbapi_free_enumeration"},
+        {"get_usb_devices_file"},{"  free_usb_devices"},{"usb_enumerate_visit_file"},
+    };
+    bench_mark mark;
+    usb_device_info* info;
+    usb_table* table;
+    unsigned long rules[2] = {0};
+    usbapi_device_info* devs;
+    int written,nodes,found[3] = {0},visited[2][2],i;
+
+    if(!mkdtemp(dir)){
+        LOG("create %s failed!",dir);
+        return -1;
+    }
+    written = usb_fixture_write(fx,dir,&nodes);
+    if(written < 0){
+        LOG("write %s failed!",dir);
+        usb_fixture_remove(dir);
+        return -1;
+    }
+    usb_fixture_path(dir,"sys",sys,sizeof(sys));
+    usb_fixture_path(dir,"dev",dev,sizeof(dev));
+    usb_fixture_path(dir,"devices",dump,sizeof(dump));
+    usb_set_default_roots(sys,dev);
+
+    for(i=0;i<OP_NUM;i++)
+        ops[i].times = (double*)calloc(loops,sizeof(double));
+
+    for(i=0;i<loops;i++){
+        bench_begin(&mark);
+        info = get_usb_devices();
+        bench_end(&ops[OP_GET],i,&mark);
+        found[0] = count_devices(info);
+
+        bench_begin(&mark);
+        table = usb_table_build(info);
+        bench_end(&ops[OP_TABLE],i,&mark);
+        bench_begin(&mark);
+        rules[0] = rules_tree(info);
+        bench_end(&ops[OP_RULES_TREE],i,&mark);
+        bench_begin(&mark);
+        rules[1] = table?rules_table(table,info):0;
+        bench_end(&ops[OP_RULES_TABLE],i,&mark);
+        usb_table_free(table);
+
+        bench_begin(&mark);
+        free_usb_devices(info);
+        bench_end(&ops[OP_GET_FREE],i,&mark);
+
+        memset(visited,0,sizeof(visited));
+        bench_begin(&mark);
+        usb_enumerate_visit(&count_visitor,visited[0]);
+        bench_end(&ops[OP_VISIT],i,&mark);
+        bench_begin(&mark);
+        usbapi_open_vid_pid(MISS_VENDOR,0);
+        bench_end(&ops[OP_OPEN_MISS],i,&mark);
+
+        bench_begin(&mark);
+        devs = usbapi_enumerate(0,0);
+        bench_end(&ops[OP_API],i,&mark);
+        found[1] = count_api(devs);
+        bench_begin(&mark);
+        usbapi_free_enumeration(devs);
+        bench_end(&ops[OP_API_FREE],i,&mark);
+
+        bench_begin(&mark);
+        info = get_usb_devices_file(dump);
+        bench_end(&ops[OP_FILE],i,&mark);
+        found[2] = count_devices(info);
+        bench_begin(&mark);
+        free_usb_devices(info);
+        bench_end(&ops[OP_FILE_FREE],i,&mark);
+        bench_begin(&mark);
+        usb_enumerate_visit_file(dump,&count_visitor,visited[1]);
+        bench_end(&ops[OP_VISIT_FILE],i,&mark);
+    }
+
+    LOG("");
+    LOG("devices=%d (%d with hubs) depth=%d interfaces=%d loops=%d nodes=%d",
+        fx->devices,written,fx->depth,fx->interfaces,loops,nodes);
+    LOG("found: sysfs %d, usbapi %d interfaces, dump %d",found[0],found[1],found[2]);
+    LOG("rules: tree walk %lu, table %lu%s",rules[0],rules[1],rules[0]!=rules[1]?" MISMATCH":"");
+    LOG("visited: sysfs %d devices %d interfaces, dump %d devices %d interfaces",
+        visited[0][0],visited[0][1],visited[1][0],visited[1][1]);
+    LOG("%-26s %9s %9s %9s %9s %9s %10s %10s","ms","min","p50","p90","p99","max","allocs/op","KiB/op");
+    for(i=0;i<OP_NUM;i++){
+        report(&ops[i],loops);
+        free(ops[i].times);
+    }
+
+    usb_set_default_roots(NULL,NULL);
+    usb_fixture_remove(dir);
+    return 0;
+}
+
+static void usage(const char* name)
+{
+    LOG("usage: %s [-l loops] [-d depth] [-i interfaces] [-b per bus] [devices ...]",name);
+    LOG("devices default to 10 1000 10000, loops to 20000/devices within 20 and 1000");
+}
+
+int main(int argc,char** argv)
+{
+    static const int counts[] = {10,1000,10000};
+    usb_fixture fx = {0,1,2,USB_FIXTURE_PER_BUS};
+    int opt,loops = 0,num,i,n;
+
+    while((opt = getopt(argc,argv,"l:d:i:b:h")) != -1){
+        switch(opt){
+        case 'l': loops = atoi(optarg); break;
+        case 'd': fx.depth = atoi(optarg); break;
+        case 'i': fx.interfaces = atoi(optarg); break;
+        case 'b': fx.per_bus = atoi(optarg); break;
+        default: usage(argv[0]); return opt=='h'?0:-1;
+        }
+    }
+
+    LOG("scan kernel: %s",usb_scan_kernel());
+    num = optind<argc?argc-optind:(int)(sizeof(counts)/sizeof(counts[0]));
+    for(i=0;i<num;i++){
+        fx.devices = optind<argc?atoi(argv[optind+i]):counts[i];
+        if(fx.devices <= 0)
+            continue;
+        /* enough loops for a p99 on small trees, without waiting on big ones */
+        n = loops>0?loops:20000/fx.devices;
+        if(run(&fx,n<20?20:n>1000?1000:n))
+            return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,130 @@
+#define _XOPEN_SOURCE 700
+#include "../../src/usbview.h"
+#include "../../src/usbimage.h"
+#include "fixture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG(fmt,...)          do{fprintf(stdout,fmt"\n",##__VA_ARGS__);}while(0)
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+/* the lines of the dump, what the text parser goes through */
+static long count_lines(const char* file)
+{
+    FILE* f = fopen(file,"r");
+    long lines = 0;
+    int c;
+
+    if(!f)
+        return 0;
+    while((c = getc(f)) != EOF)
+        lines += c == '\n';
+    fclose(f);
+    return lines;
+}
+
+int main(int argc,char** argv)
+{
+    char dir[] = "/tmp/usbview-bench-XXXXXX";
+    char file[sizeof(dir)+16],root[sizeof(dir)+16],dev[sizeof(dir)+16];
+    char image[sizeof(file)+8];
+    char path[sizeof(root)+64];
+    unsigned char desc[256];
+    /* the trees of enum-bench: hubs one tier deep, two interfaces a device */
+    usb_fixture fx = {1000,1,2,USB_FIXTURE_PER_BUS};
+    int devices = fx.devices = argc>1?atoi(argv[1]):1000;
+    int loops = argc>2?atoi(argv[2]):50;
+    int workers = argc>3?atoi(argv[3]):0;
+    long lines;
+    double start,elapsed;
+    int i;
+    unsigned int n,found;
+    FILE* f;
+    usb_image* img;
+    usb_device_info* info;
+
+    if(!mkdtemp(dir)){
+        LOG("create %s failed!",dir);
+        return -1;
+    }
+    if(usb_fixture_write(&fx,dir,NULL) < 0){
+        LOG("write %s failed!",dir);
+        usb_fixture_remove(dir);
+        return -1;
+    }
+    usb_fixture_path(dir,"devices",file,sizeof(file));
+    usb_fixture_path(dir,"sys",root,sizeof(root));
+    usb_fixture_path(dir,"dev",dev,sizeof(dev));
+    lines = count_lines(file);
+
+    start = now();
+    for(i=0;i<loops;i++){
+        usb_device_info* info = get_usb_devices_file(file);
+        free_usb_devices(info);
+    }
+    elapsed = now()-start;
+
+    LOG("devices=%d lines=%ld loops=%d",devices,lines,loops);
+    LOG("text:  %.3f ms/parse, %.0f lines/sec",elapsed*1000/loops,lines*loops/elapsed);
+
+    start = now();
+    for(i=0;i<loops;i++){
+        usb_device_info* info = get_usb_devices_sysfs(root,dev);
+        free_usb_devices(info);
+    }
+    elapsed = now()-start;
+    LOG("sysfs: %.3f ms/enumeration",elapsed*1000/loops);
+
+    start = now();
+    for(i=0;i<loops;i++){
+        usb_device_info* info = get_usb_devices_parallel(root,dev,workers);
+        free_usb_devices(info);
+    }
+    elapsed = now()-start;
+    LOG("sysfs, %d workers: %.3f ms/enumeration",workers,elapsed*1000/loops);
+
+    /* what a process that maps a saved image pays to see every device */
+    snprintf(image,sizeof(image),"%s.img",file);
+    info = get_usb_devices_file(file);
+    if(usb_image_save(info,image) == 0){
+        found = 0;
+        start = now();
+        for(i=0;i<loops;i++){
+            img = usb_image_load(image);
+            for(n=0;n<usb_image_num_devices(img);n++)
+                found += usb_image_device_at(img,n)->idProduct != 0;
+            usb_image_close(img);
+        }
+        elapsed = now()-start;
+        LOG("image: %.3f ms/load and walk (%u)",elapsed*1000/loops,found/loops);
+        unlink(image);
+    }
+    free_usb_devices(info);
+
+    /* the binary descriptors of one device, the first behind the hub of bus 1, with nothing else read */
+    snprintf(path,sizeof(path),"%s/bus/usb/devices/1-1.1/descriptors",root);
+    f = fopen(path,"rb");
+    if(f){
+        size_t len = fread(desc,1,sizeof(desc),f);
+        fclose(f);
+        start = now();
+        for(i=0;i<loops;i++){
+            for(n=0;n<(unsigned int)devices;n++)
+                free_usb_devices(get_usb_device_descriptors(desc,len,12));
+        }
+        elapsed = now()-start;
+        LOG("descriptors: %.3f ms/%d devices",elapsed*1000/loops,devices);
+    }
+
+    usb_fixture_remove(dir);
+    return 0;
+}
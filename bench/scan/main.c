@@ -0,0 +1,183 @@
+#include "../../src/usbview.h"
+#include "../../src/usbscan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG(fmt,...)          do{fprintf(stdout,fmt"\n",##__VA_ARGS__);}while(0)
+
+#define LINES_PER_DEVICE    14
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+#define DEVICES_PER_BUS     120
+
+/* about lines of a usb/devices dump, devices of one interrupt and one bulk interface */
+static char* make_dump(long lines,size_t* plen)
+{
+    size_t size = lines*80+USB_SCAN_PADDING+1,len = 0;
+    long devices = lines/LINES_PER_DEVICE;
+    char *buf = malloc(size);
+    int bus,i,n;
+
+    if(!buf)
+        return NULL;
+    for(bus=1;devices>0;bus++){
+        n = devices>DEVICES_PER_BUS?DEVICES_PER_BUS:devices;
+        len += snprintf(buf+len,size-len,
+            "T:  Bus=%02d Lev=00 Prnt=00 Port=00 Cnt=00 Dev#=  1 Spd=480  MxCh=%2d\n"
+            "D:  Ver= 2.00 Cls=09(hub  ) Sub=00 Prot=01 MxPS=64 #Cfgs=  1\n"
+            "P:  Vendor=1d6b ProdID=0002 Rev= 4.19\n"
+            "C:* #Ifs= 1 Cfg#= 1 Atr=e0 MxPwr=  0mA\n"
+            "I:* If#= 0 Alt= 0 #EPs= 1 Cls=09(hub  ) Sub=00 Prot=00 Driver=hub\n"
+            "E:  Ad=81(I) Atr=03(Int.) MxPS=   4 Ivl=256ms\n",
+            bus,n);
+        for(i=0;i<n;i++){
+            len += snprintf(buf+len,size-len,
+                "\nT:  Bus=%02d Lev=01 Prnt=01 Port=%02d Cnt=%02d Dev#=%3d Spd=12   MxCh= 0\n"
+                "D:  Ver= 2.00 Cls=00(>ifc ) Sub=00 Prot=00 MxPS=64 #Cfgs=  1\n"
+                "P:  Vendor=04b4 ProdID=%04x Rev= 1.00\n"
+                "S:  Manufacturer=Synthetic Devices Inc.\n"
+                "S:  Product=Synthetic HID %d\n"
+                "S:  SerialNumber=%08d\n"
+                "C:* #Ifs= 2 Cfg#= 1 Atr=a0 MxPwr=100mA\n"
+                "I:* If#= 0 Alt= 0 #EPs= 2 Cls=03(HID  ) Sub=01 Prot=01 Driver=(none)\n"
+                "E:  Ad=81(I) Atr=03(Int.) MxPS=  64 Ivl=10ms\n"
+                "E:  Ad=02(O) Atr=03(Int.) MxPS=  64 Ivl=10ms\n"
+                "I:* If#= 1 Alt= 0 #EPs= 2 Cls=07(print) Sub=01 Prot=02 Driver=(none)\n"
+                "E:  Ad=83(I) Atr=02(Bulk) MxPS= 512 Ivl=0ms\n"
+                "E:  Ad=04(O) Atr=02(Bulk) MxPS= 512 Ivl=0ms\n",
+                bus,i,i+1,i+2,i,i,bus*1000+i);
+        }
+        len += snprintf(buf+len,size-len,"\n");
+        devices -= n;
+    }
+    memset(buf+len,0,USB_SCAN_PADDING+1);
+    *plen = len;
+    return buf;
+}
+
+/* lines split and the '=' of each found, what the parser does before the fields */
+static long scan_dump(char* copy,const char* dump,size_t len)
+{
+    unsigned short pos[32];
+    char *line,*eol,*end = copy+len;
+    size_t n;
+    long found = 0;
+
+    memcpy(copy,dump,len+USB_SCAN_PADDING+1);
+    for(line=copy;line<end;line=eol+1){
+        eol = (char*)usb_scan_line(line,end);
+        *eol = 0x00;
+        found += usb_scan_fields(line,pos,32,&n);
+    }
+    return found;
+}
+
+/* the same with the C library */
+static long scan_dump_libc(char* copy,const char* dump,size_t len)
+{
+    char *line,*eol,*end = copy+len;
+    const char *p;
+    long found = 0;
+
+    memcpy(copy,dump,len+USB_SCAN_PADDING+1);
+    for(line=copy;line<end;line=eol+1){
+        eol = memchr(line,'\n',end-line);
+        if(!eol)
+            eol = end;
+        *eol = 0x00;
+        for(p=strchr(line,'=');p;p=strchr(p+1,'='))
+            found++;
+    }
+    return found;
+}
+
+int main(int argc,char** argv)
+{
+    static const char* kernels[] = {"scalar","sse2","avx2"};
+    static const char* numbers[] = {"04b4","  64"," 512","81(I)","  1","03(Int.)","ffff","  0"};
+    char file[] = "/tmp/usbview-scan-XXXXXX";
+    long lines = argc>1?atol(argv[1]):50000;
+    int loops = argc>2?atoi(argv[2]):50;
+    double start,elapsed;
+    char *dump,*copy,padded[8][16];
+    size_t len;
+    long found = 0,sum = 0;
+    int fd,i,k,n,v;
+    FILE *f;
+
+    dump = make_dump(lines,&len);
+    copy = dump?malloc(len+USB_SCAN_PADDING+1):NULL;
+    if(!copy){
+        LOG("no memory!");
+        return -1;
+    }
+    LOG("lines=%ld bytes=%zu loops=%d default=%s",lines,len,loops,usb_scan_kernel());
+
+    fd = mkstemp(file);
+    if(fd>=0 && (f = fdopen(fd,"w"))){
+        fwrite(dump,1,len,f);
+        fclose(f);
+    }
+
+    start = now();
+    for(i=0;i<loops;i++)
+        found = scan_dump_libc(copy,dump,len);
+    elapsed = now()-start;
+    LOG("libc:   scan %.3f ms (%ld '=')",elapsed*1000/loops,found);
+
+    for(k=0;k<(int)(sizeof(kernels)/sizeof(kernels[0]));k++){
+        if(usb_scan_use(kernels[k])){
+            LOG("%-7s not supported",kernels[k]);
+            continue;
+        }
+        start = now();
+        for(i=0;i<loops;i++)
+            found = scan_dump(copy,dump,len);
+        elapsed = now()-start;
+        LOG("%-7s scan %.3f ms (%ld '=')",kernels[k],elapsed*1000/loops,found);
+
+        if(fd>=0){
+            start = now();
+            for(i=0;i<loops;i++)
+                free_usb_devices(get_usb_devices_file(file));
+            elapsed = now()-start;
+            LOG("%-7s parse %.3f ms",kernels[k],elapsed*1000/loops);
+        }
+    }
+
+    /* the words the decoder sees, padded as the parser buffer is */
+    memset(padded,0,sizeof(padded));
+    for(i=0;i<8;i++)
+        strcpy(padded[i],numbers[i]);
+    start = now();
+    for(i=0;i<loops*100000;i++){
+        n = i&7;
+        usb_scan_int(padded[n],n==0||n==3||n==5||n==6?16:10,&v);
+        sum += v;
+    }
+    elapsed = now()-start;
+    LOG("words:  usb_scan_int %.2f ns (%ld)",elapsed*1e9/(loops*100000.0),sum);
+    sum = 0;
+    start = now();
+    for(i=0;i<loops*100000;i++){
+        n = i&7;
+        sum += strtol(padded[n],NULL,n==0||n==3||n==5||n==6?16:10);
+    }
+    elapsed = now()-start;
+    LOG("words:  strtol %.2f ns (%ld)",elapsed*1e9/(loops*100000.0),sum);
+
+    if(fd>=0)
+        unlink(file);
+    free(copy);
+    free(dump);
+    return 0;
+}
@@ -22,6 +22,7 @@ struct sockaddr_nl snl;
 
 linux_plugin_cb plugin_cb = NULL;
 linux_plugout_cb plugout_cb = NULL;
+linux_bind_cb bind_cb = NULL;
 
 
 static void *linux_netlink_event_thread_main(void *arg);
@@ -79,7 +80,7 @@ err_close_pipe:
 }
 
 
-int linux_netlink_start_event_monitor(linux_plugin_cb in_cb,linux_plugout_cb out_cb)
+int linux_netlink_start_event_monitor(linux_plugin_cb in_cb,linux_plugout_cb out_cb,linux_bind_cb change_cb)
 {
     int socktype = SOCK_RAW;
     int ret;
@@ -132,6 +133,11 @@ int linux_netlink_start_event_monitor(linux_plugin_cb in_cb,linux_plugout_cb out
         goto close_netlink;
     }
 
+    /* set before the thread runs, so that no event is missed */
+    plugin_cb = in_cb;
+    plugout_cb = out_cb;
+    bind_cb = change_cb;
+
     ret = pthread_create(&libusb_linux_event_thread, NULL,
                          linux_netlink_event_thread_main, NULL);
     if (0 != ret) {
@@ -139,13 +145,13 @@ int linux_netlink_start_event_monitor(linux_plugin_cb in_cb,linux_plugout_cb out
         close(netlink_control_pipe[1]);
         close(linux_netlink_socket);
         linux_netlink_socket = -1;
+        plugin_cb = NULL;
+        plugout_cb = NULL;
+        bind_cb = NULL;
         LOGE("Netlink","create thread failed!");
         return -1;
     }
 
-    plugin_cb = in_cb;
-    plugout_cb = out_cb;
-
     LOGD("Netlink","start...");
 
     return 0;
@@ -185,6 +191,7 @@ int linux_netlink_stop_event_monitor(void)
     netlink_control_pipe[1] = -1;
     plugin_cb = NULL;
     plugout_cb = NULL;
+    bind_cb = NULL;
 
     LOGD("Netlink","stop ok");
     return 0;
@@ -205,16 +212,36 @@ static const char *netlink_message_parse (const char *buffer, size_t len, const
     return NULL;
 }
 
-/* parse parts of netlink message common to both libudev and the kernel */
-static int linux_netlink_parse(char *buffer, size_t len, int *detached, const char **sys_name,
-                   uint8_t *busnum, uint8_t *devaddr) {
+/* the last component of DEVPATH, "1-1.2" or "1-1.2:1.0" */
+static const char *netlink_message_sys_name (const char *buffer, size_t len)
+{
     const char *tmp;
     int i;
 
+    tmp = netlink_message_parse(buffer, len, "DEVPATH");
+    if (NULL == tmp) {
+        return NULL;
+    }
+
+    for (i = strlen(tmp) - 1 ; i > 0 ; --i) {
+        if ('/' ==tmp[i]) {
+            return tmp + i + 1;
+        }
+    }
+
+    return NULL;
+}
+
+/* parse parts of netlink message common to both libudev and the kernel */
+static int linux_netlink_parse(char *buffer, size_t len, int *detached, int *bound,
+                   const char **sys_name, uint8_t *busnum, uint8_t *devaddr) {
+    const char *tmp;
+
     errno = 0;
 
     *sys_name = NULL;
     *detached = 0;
+    *bound    = 0;
     *busnum   = 0;
     *devaddr  = 0;
 
@@ -225,6 +252,8 @@ static int linux_netlink_parse(char *buffer, size_t len, int *detached, const ch
         *detached = 1;
     } else if (0 == strcmp(tmp, "add")) {
         *detached = 0;
+    } else if (0 == strcmp(tmp, "bind") || 0 == strcmp(tmp, "unbind")) {
+        *bound = 1;
     }else{
 //        LOGD("Netlink","unknown device action %s", tmp);
         return -1;
@@ -237,6 +266,12 @@ static int linux_netlink_parse(char *buffer, size_t len, int *detached, const ch
         return -1;
     }
 
+    /* drivers are bound to interfaces too, which have no numbers */
+    if (*bound) {
+        *sys_name = netlink_message_sys_name(buffer, len);
+        return *sys_name ? 0 : -1;
+    }
+
     tmp = netlink_message_parse(buffer, len, "BUSNUM");
     if (NULL == tmp) {
         /* no bus number. try "DEVICE" */
@@ -284,18 +319,11 @@ static int linux_netlink_parse(char *buffer, size_t len, int *detached, const ch
         return -1;
     }
 
-    tmp = netlink_message_parse(buffer, len, "DEVPATH");
-    if (NULL == tmp) {
+    *sys_name = netlink_message_sys_name(buffer, len);
+    if (NULL == *sys_name) {
         return -1;
     }
 
-    for (i = strlen(tmp) - 1 ; i ; --i) {
-        if ('/' ==tmp[i]) {
-            *sys_name = tmp + i + 1;
-            break;
-        }
-    }
-
     /* found a usb device */
     return 0;
 }
@@ -313,7 +341,7 @@ static int linux_netlink_read_message(void)
         .msg_namelen=sizeof(snl) };
     const char *sys_name = NULL;
     uint8_t busnum, devaddr;
-    int detached, r;
+    int detached, bound, r;
     size_t len;
 
     /* read netlink message */
@@ -327,11 +355,18 @@ static int linux_netlink_read_message(void)
 
     /* TODO -- authenticate this message is from the kernel or udevd */
 
-    r = linux_netlink_parse(buffer, len, &detached, &sys_name,
+    r = linux_netlink_parse(buffer, len, &detached, &bound, &sys_name,
                 &busnum, &devaddr);
     if (r)
         return r;
 
+    if (bound) {
+        LOGD("Netlink","hotplug found driver change of %s", sys_name);
+        if (bind_cb)
+            bind_cb(sys_name);
+        return 0;
+    }
+
     LOGD("Netlink","hotplug found device busnum: %hhu, devaddr: %hhu, sys_name: %s, removed: %s",
          busnum, devaddr, sys_name, detached ? "yes" : "no");
 
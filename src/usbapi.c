@@ -1,7 +1,12 @@
 #include "usbapi.h"
+#include "usbindex.h"
+#include "usbarena.h"
+#include "usbintern.h"
 
 #if defined OS_LINUX
 #include "linux_netlink.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #endif
 
 #define TAG "usbapi"
@@ -13,27 +18,140 @@
 #endif
 
 
+/* hotplug changes applied to the device tree before it is built again */
+#define USBAPI_MAX_PATCHES  256
+
 typedef struct {
     os_mutex_t mutex;
-    int max;
     int num;
-    usbapi_device **devices;
+    /* (busnum,devnum) -> open devices, chained by index_next */
+    usb_index index;
+    /* device tree kept up to date by hotplug between usbapi_init and usbapi_exit */
+    int inits;
+    int live;                   /* devices is maintained, even when empty */
+    int patches;
+    int stale;                  /* devices is read again on its next use */
+    usb_device_info *devices;
+    /* bumped on every hotplug event, and when the monitor starts or stops */
+    unsigned long generation;
+    /* snapshot of the current generation, holds a reference */
+    struct usbapi_snapshot *snapshot;
+    /* starts and stops the hotplug monitor, never taken on its thread */
+    os_mutex_t monitor_mutex;
+    int monitoring;
 }usbapi_context_t;
 
 static usbapi_context_t context =
 {
-    .max=0,
     .num=-1,
-    .devices=NULL
 };
 
-/* Linked List of input reports received from the device. */
-struct input_report {
-    char* data;
-    size_t len;
-    struct input_report *next;
+#ifdef OS_LINUX
+/*
+ * Threads shared by the devices opened after usbapi_set_reactor, instead of
+ * a thread and a pipe each, from that call until usbapi_set_reactor(0) or
+ * usbapi_exit and the close of the last device they read. The devices are in one epoll set with
+ * EPOLLONESHOT, so a device is only read by the thread that got its event
+ * until that one arms it again; an eventfd wakes the threads to stop, or
+ * to go on with devices that stalled on a full queue and were kicked.
+ * The epoll data of a device is the index of its entry and a generation.
+ * Entries live as long as the threads do, so an event taken just before
+ * its device went finds the entry with another generation.
+ */
+#define USBAPI_REACTOR_MAX_THREADS  16
+#define USBAPI_REACTOR_CHUNK        64
+#define USBAPI_REACTOR_MAX_CHUNKS   1024
+#define USBAPI_REACTOR_EVENTS       16
+#define USBAPI_REACTOR_READS        8       /* of a device for one event */
+#define USBAPI_REACTOR_CONTROL      (~(uint64_t)0)
+
+struct usbapi_reactor_entry {
+    os_mutex_t mutex;           /* held while the device is read */
+    struct usbapi_device *dev;  /* NULL when free */
+    uint32_t index;
+    uint32_t gen;
+    uint32_t kick_gen;
+    int kicked;                 /* in the kick list */
+    struct usbapi_reactor_entry *next;  /* in the free list */
+    struct usbapi_reactor_entry *kick_next;
 };
 
+static struct {
+    /* starts and stops the threads, never taken on them */
+    os_mutex_t start_mutex;
+    int threads;                /* as usbapi_set_reactor asked, 0 for a thread a device */
+    int running;
+    int users;                  /* devices read by the threads */
+    int stopping;
+    int epfd;
+    int control;                /* the eventfd */
+    os_thread_t thread[USBAPI_REACTOR_MAX_THREADS];
+    /* the entries and the lists */
+    os_mutex_t mutex;
+    struct usbapi_reactor_entry *chunks[USBAPI_REACTOR_MAX_CHUNKS];
+    int nchunks;
+    struct usbapi_reactor_entry *free;
+    struct usbapi_reactor_entry *kicks;
+} reactor = {
+    .epfd = -1,
+    .control = -1,
+};
+
+static int usbapi_reactor_add(struct usbapi_device *dev);
+static void usbapi_reactor_remove(struct usbapi_device *dev);
+#endif
+
+/* A device tree that is never changed, shared until the last reference goes. */
+struct usbapi_snapshot {
+    usb_device_info *devices;
+    unsigned long generation;
+    int refs;
+};
+
+/*
+ * Input reports received from the device, in slots allocated once at open.
+ * read_thread alone moves head and fills the slot there; readers copy the
+ * slot at tail out and then move tail over it. When the ring is full the
+ * thread drops the oldest report by moving tail itself, so a reader only
+ * keeps its copy if tail is still where it was: no lock is taken, the mutex
+ * and condition of the device are only for readers to sleep on.
+ * A reader borrowing reports in place sets INPUT_RING_HELD in tail, which
+ * the thread never moves then: it drops the new report instead. With
+ * USBAPI_QUEUE_BLOCK the thread does not read the device while the ring is
+ * full, it sleeps on the condition until a reader wakes it.
+ */
+struct input_ring {
+    char        *data;          /* size slots of slot_size bytes */
+    uint32_t    *len;
+    uint64_t    *time;          /* when the thread read it, see usbapi_report */
+    uint32_t    size;           /* power of two, 0 if there is no input endpoint */
+    uint32_t    slot_size;
+    uint32_t    max_reports;    /* no more are kept, less than size */
+    uint32_t    head;           /* where the next report goes */
+    uint32_t    tail;           /* the oldest report */
+    uint32_t    held;           /* how many from tail are borrowed */
+    int         waiting;        /* readers asleep on the condition */
+    int         blocked;        /* the thread is asleep on it */
+    enum usbapi_queue_policy policy;
+    /* counted by the thread only */
+    unsigned long dropped_oldest;
+    unsigned long dropped_newest;
+    unsigned long blocks;
+    unsigned long discarded;
+};
+
+#define INPUT_RING_MIN_SLOT     64
+/* head and tail count modulo 2^31, the top bit of tail is the flag */
+#define INPUT_RING_HELD         0x80000000u
+#define INPUT_RING_INDEX(i)     ((i) & ~INPUT_RING_HELD)
+
+static void input_ring_free(struct input_ring *ring)
+{
+    free(ring->data);
+    free(ring->len);
+    free(ring->time);
+}
+
 struct usbapi_device_endpoint
 {
     /** The address of the endpoint described by this descriptor. Bits 0:3 are
@@ -65,7 +183,7 @@ struct usbapi_device{
 
     /* Read thread objects */
     os_thread_t thread;
-    os_mutex_t buffer_mutex; /* Protects input_reports */
+    os_mutex_t buffer_mutex; /* Readers sleep on it until there is a report */
     os_cond_t condition;
 #ifdef OS_LINUX
     int thread_pipe[2];
@@ -73,10 +191,28 @@ struct usbapi_device{
 
     os_mutex_t dev_mutex;
     int shutdown_thread;
+    int pause_thread;   /* stop read_thread but keep the device open */
 
-    /* List of received input reports. */
-    struct input_report *input_reports;
+    /* Next open device with the same bus and device number */
+    struct usbapi_device *index_next;
+
+    /* Ring of received input reports. */
+    struct input_ring input_reports;
 #define DEFAULT_MAX_INPUT_REPORTS 100
+    /* as usbapi_set_queue_limits asked */
+    uint32_t queue_max_reports;
+    size_t queue_max_bytes;
+
+    /* read by the shared threads of usbapi_set_reactor, not a thread of its own */
+    int reactor;
+    struct usbapi_reactor_entry *reactor_entry;    /* changed with reactor.mutex */
+
+    enum usbapi_read_mode read_mode;
+    /* USBAPI_READ_FRAMED: what read_thread has made no message of yet */
+    usbapi_framer framer;
+    char *frame_data;   /* framer.max_len and a report */
+    size_t frame_len;
+    size_t frame_seen;
 };
 
 static usbapi_device *new_usbapi_device(void)
@@ -89,9 +225,20 @@ static usbapi_device *new_usbapi_device(void)
     }
     dev->handle=INVALID_HANDLE_VALUE;
     dev->info=NULL;
-    dev->input_reports=NULL;
+    memset(&dev->input_reports,0,sizeof(dev->input_reports));
+    dev->index_next=NULL;
 
     dev->shutdown_thread=0;
+    dev->pause_thread=0;
+    dev->queue_max_reports=DEFAULT_MAX_INPUT_REPORTS;
+    dev->queue_max_bytes=0;
+    dev->reactor=0;
+    dev->reactor_entry=NULL;
+    dev->read_mode=USBAPI_READ_STREAM;
+    memset(&dev->framer,0,sizeof(dev->framer));
+    dev->frame_data=NULL;
+    dev->frame_len=0;
+    dev->frame_seen=0;
     os_mutex_init(dev->buffer_mutex);
     os_cond_init(dev->condition);
     os_mutex_init(dev->dev_mutex);
@@ -105,7 +252,8 @@ static usbapi_device *new_usbapi_device(void)
 
 static void free_usbapi_device(usbapi_device *dev)
 {
-    usbapi_flush(dev);
+    input_ring_free(&dev->input_reports);
+    free(dev->frame_data);
     /* Clean up the info objects */
     usbapi_free_enumeration(dev->info);
     dev->info = NULL;
@@ -121,24 +269,88 @@ static void free_usbapi_device(usbapi_device *dev)
 }
 
 
-usbapi_device_info *usbapi_enumerate(unsigned short vendor_id, unsigned short product_id)
+static void usbapi_context_init(void)
+{
+    if(context.num<0){
+        // not init
+        os_mutex_init(context.mutex);
+        os_mutex_init(context.monitor_mutex);
+#ifdef OS_LINUX
+        os_mutex_init(reactor.start_mutex);
+        os_mutex_init(reactor.mutex);
+#endif
+        context.num = 0;
+    }
+}
+
+/*
+ * The strings of the records of one enumeration: the records of the
+ * interfaces of a device, and the devices of a maker, point to the same
+ * copies. Every record holds a reference, the one they are made with is
+ * dropped once they all are.
+ */
+struct usbapi_strings {
+    int         refs;
+    usb_arena   arena;
+    usb_intern  intern;
+};
+
+static struct usbapi_strings *usbapi_strings_new(void)
+{
+    struct usbapi_strings *strings = calloc(1,sizeof(struct usbapi_strings));
+
+    if(!strings)
+        return NULL;
+    strings->refs = 1;
+    usb_arena_init(&strings->arena);
+    if(usb_intern_init(&strings->intern,&strings->arena,0)){
+        free(strings);
+        return NULL;
+    }
+    return strings;
+}
+
+static char *usbapi_strings_get(struct usbapi_strings *strings,const char *str)
+{
+    return (char*)usb_intern_str(&strings->intern,str);
+}
+
+static void usbapi_strings_retain(struct usbapi_strings *strings)
+{
+    __atomic_add_fetch(&strings->refs,1,__ATOMIC_RELAXED);
+}
+
+static void usbapi_strings_release(struct usbapi_strings *strings)
+{
+    if(!strings || __atomic_sub_fetch(&strings->refs,1,__ATOMIC_ACQ_REL))
+        return;
+    usb_intern_destroy(&strings->intern);
+    usb_arena_release(&strings->arena);
+    free(strings);
+}
+
+/* a record for every interface of the devices matching vendor_id and product_id */
+static usbapi_device_info *usbapi_collect(const usb_device_info* info,unsigned short vendor_id, unsigned short product_id)
 {
-    usb_device_info* root_info = NULL,* info = NULL;
     usbapi_device_info *root = NULL; /* return object */
     usbapi_device_info *cur_dev = NULL;
+    struct usbapi_strings *strings = NULL;
     int i,j,k;
 
-    root_info = info = get_usb_devices();
     while(info) {
         if((vendor_id==0&&product_id==0)||
                 (vendor_id == info->idVendor && product_id == info->idProduct)){
-            for(i=0;i<info->bNumConfigurations&&info->config[i];i++){ // generally, usb device has only one config
+            for(i=0;info->config&&i<info->bNumConfigurations&&info->config[i];i++){ // generally, usb device has only one config
                 usb_device_config* config = info->config[i];
                 for(j=0;j<config->bNumInterfaces&&config->interfaces[j];j++){
                     usb_device_interface* inf = config->interfaces[j];
                     // got right device
                     usbapi_device_info *tmp;
                     /* VID/PID match. Create the record. */
+                    if(!strings && !(strings = usbapi_strings_new())){
+                        LOGE(TAG,"calloc failed!");
+                        goto next;
+                    }
                     tmp = calloc(1, sizeof(struct usbapi_device_info));
                     if(!tmp){
                         LOGE(TAG,"calloc failed!");
@@ -156,12 +368,15 @@ usbapi_device_info *usbapi_enumerate(unsigned short vendor_id, unsigned short pr
 
                     /* Fill out the record */
                     cur_dev->path = inf->path?strdup(inf->path):NULL;
+                    cur_dev->location = inf->location?strdup(inf->location):NULL;
                     cur_dev->product_id = info->idProduct;
                     cur_dev->vendor_id = info->idVendor;
-                    cur_dev->serial_number = info->serial?strdup(info->serial):NULL;
+                    cur_dev->strings = strings;
+                    usbapi_strings_retain(strings);
+                    cur_dev->serial_number = usbapi_strings_get(strings,info->serial);
                     cur_dev->release_number = info->bcdDevice?(unsigned short)(atof(info->bcdDevice)*100):0;
-                    cur_dev->manufacturer_string = info->manufacturer?strdup(info->manufacturer):NULL;
-                    cur_dev->product_string = info->product?strdup(info->product):NULL;
+                    cur_dev->manufacturer_string = usbapi_strings_get(strings,info->manufacturer);
+                    cur_dev->product_string = usbapi_strings_get(strings,info->product);
                     cur_dev->usage = 0;
                     cur_dev->interface_number = inf->bInterfaceNumber;
                     cur_dev->class_code = inf->bInterfaceClass;
@@ -169,7 +384,7 @@ usbapi_device_info *usbapi_enumerate(unsigned short vendor_id, unsigned short pr
                     cur_dev->devnum = info->devnum;
                     cur_dev->input_endpoint = NULL;
                     cur_dev->output_endpoint = NULL;
-                    for(k=0;k<inf->bNumEndpoints&&inf->endpoint[k];k++){
+                    for(k=0;inf->endpoint&&k<inf->bNumEndpoints&&inf->endpoint[k];k++){
                         usb_device_endpoint* ep = inf->endpoint[k];
                         if(ep->in == USB_ENDPOINT_IN && !cur_dev->input_endpoint){
                             cur_dev->input_endpoint = (struct usbapi_device_endpoint *)malloc(sizeof(struct usbapi_device_endpoint));
@@ -178,7 +393,6 @@ usbapi_device_info *usbapi_enumerate(unsigned short vendor_id, unsigned short pr
                             cur_dev->input_endpoint->ivl = ep->bInterval;
                             cur_dev->input_endpoint->max = ep->wMaxPacketSize;
                         }else if(ep->in== USB_ENDPOINT_OUT && !cur_dev->output_endpoint){
-                            cur_dev->output_endpoint = (struct usbapi_device_endpoint *)malloc(sizeof(struct usbapi_device_endpoint));
                             cur_dev->output_endpoint = (struct usbapi_device_endpoint *)malloc(sizeof(struct usbapi_device_endpoint));
                             cur_dev->output_endpoint->addr = ep->bEndpointAddress;
                             cur_dev->output_endpoint->attr = ep->bmAttributes;
@@ -194,12 +408,61 @@ usbapi_device_info *usbapi_enumerate(unsigned short vendor_id, unsigned short pr
 next:
         info = info->next;
     }
+    usbapi_strings_release(strings);
+
+    return root;
+}
+
+/* whether hotplug keeps a tree that enumerations can share */
+static int usbapi_shared(void)
+{
+    int shared = 0;
+
+    if(context.num>=0){
+        os_mutex_lock(context.mutex);
+        shared = context.monitoring;
+        os_mutex_unlock(context.mutex);
+    }
+    return shared;
+}
 
+/*
+ * A shared snapshot costs nothing, so it is used whenever there is one.
+ * Otherwise the parse is told what is wanted, and neither reads the
+ * configs of other devices nor looks for nodes of other classes.
+ */
+static usbapi_device_info *usbapi_enumerate_class(unsigned short vendor_id, unsigned short product_id, int class_code)
+{
+    usbapi_snapshot *snapshot;
+    usb_device_info *root_info;
+    usb_device_filter filter;
+    usbapi_device_info *root = NULL; /* return object */
+
+    if(usbapi_shared()){
+        snapshot = usbapi_snapshot_acquire();
+        if(snapshot){
+            root = usbapi_collect(snapshot->devices,vendor_id,product_id);
+            usbapi_snapshot_release(snapshot);
+        }
+        return root;
+    }
+
+    filter.vendor_id = vendor_id;
+    filter.product_id = product_id;
+    filter.class_code = class_code;
+    /* bandwidth is all that the records don't use */
+    root_info = get_usb_devices_filtered(&filter,USB_ENUM_ALL&~USB_ENUM_BANDWIDTH);
+    root = usbapi_collect(root_info,vendor_id,product_id);
     free_usb_devices(root_info);
 
     return root;
 }
 
+usbapi_device_info *usbapi_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+    return usbapi_enumerate_class(vendor_id,product_id,-1);
+}
+
 usbapi_device_info*  dup_usbapi_info(usbapi_device_info *dev_info)
 {
     usbapi_device_info* ret;
@@ -211,9 +474,14 @@ usbapi_device_info*  dup_usbapi_info(usbapi_device_info *dev_info)
 
     memcpy(ret,dev_info,sizeof(usbapi_device_info));
     ret->path = dev_info->path?strdup(dev_info->path):NULL;
-    ret->serial_number = dev_info->serial_number?strdup(dev_info->serial_number):NULL;
-    ret->manufacturer_string = dev_info->manufacturer_string?strdup(dev_info->manufacturer_string):NULL;
-    ret->product_string = dev_info->product_string?strdup(dev_info->product_string):NULL;
+    ret->location = dev_info->location?strdup(dev_info->location):NULL;
+    if(dev_info->strings){
+        usbapi_strings_retain(dev_info->strings);
+    }else{
+        ret->serial_number = dev_info->serial_number?strdup(dev_info->serial_number):NULL;
+        ret->manufacturer_string = dev_info->manufacturer_string?strdup(dev_info->manufacturer_string):NULL;
+        ret->product_string = dev_info->product_string?strdup(dev_info->product_string):NULL;
+    }
     if(dev_info->input_endpoint){
         ret->input_endpoint = (struct usbapi_device_endpoint*)malloc(sizeof(struct usbapi_device_endpoint));
         memcpy(ret->input_endpoint,dev_info->input_endpoint,sizeof(struct usbapi_device_endpoint));
@@ -233,9 +501,14 @@ void  usbapi_free_enumeration(usbapi_device_info *devs)
     while (d) {
         usbapi_device_info *next = d->next;
         free(d->path);
-        free(d->serial_number);
-        free(d->manufacturer_string);
-        free(d->product_string);
+        free(d->location);
+        if(d->strings){
+            usbapi_strings_release(d->strings);
+        }else{
+            free(d->serial_number);
+            free(d->manufacturer_string);
+            free(d->product_string);
+        }
         free(d->input_endpoint);
         free(d->output_endpoint);
         free(d);
@@ -245,21 +518,381 @@ void  usbapi_free_enumeration(usbapi_device_info *devs)
 
 /* Helper function, to simplify hid_read().
    This should be called with dev->buffer_mutex locked. */
-static int return_data(usbapi_device *dev, char *data, size_t length)
+/* microseconds on a clock that only goes forward */
+static uint64_t input_report_time(void)
+{
+#if defined OS_LINUX
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#elif defined OS_WIN
+    return (uint64_t)GetTickCount64() * 1000;
+#endif
+}
+
+/* as big as the packets of the endpoint, wMaxPacketSize counts the extra transactions of high speed */
+static uint32_t input_report_size(const struct usbapi_device_endpoint *ep)
 {
-    /* Copy the data out of the linked list item (rpt) into the
-       return buffer (data), and delete the liked list item. */
-    struct input_report *rpt = dev->input_reports;
-    size_t len;
+    uint32_t size;
+
+    if(!ep)
+        return 0;
+    size = (ep->max & 0x7ff) * (1 + ((ep->max >> 11) & 3));
+    return size < INPUT_RING_MIN_SLOT ? INPUT_RING_MIN_SLOT : size;
+}
+
+/* the slots of a ring for the reads of dev in mode, 0 for none */
+static uint32_t input_slot_size(usbapi_device *dev, enum usbapi_read_mode mode, const usbapi_framer *framer)
+{
+    if(!dev->info->input_endpoint)
+        return 0;
+    if(mode == USBAPI_READ_FRAMED)
+        return framer->max_len;
+    return input_report_size(dev->info->input_endpoint);
+}
+
+/* as many slots as max_bytes allows, 0 for any; no ring for a slot_size of 0 */
+static int input_ring_init(struct input_ring *ring, uint32_t slot_size, uint32_t max_reports, size_t max_bytes)
+{
+    uint32_t size = 1;
+
+    memset(ring,0,sizeof(*ring));
+    if(!slot_size)
+        return 0;
+    /* the slots are what the memory goes to, the spare one included */
+    if(max_bytes){
+        while((size_t)size * 2 * slot_size <= max_bytes && size <= max_reports)
+            size <<= 1;
+        if(size < 2)
+            size = 2;
+        if(max_reports > size - 1)
+            max_reports = size - 1;
+        size = 1;
+    }
+    /* one spare slot, the one at head, is filled while the ring is full */
+    while(size <= max_reports)
+        size <<= 1;
+
+    ring->data = (char*)malloc((size_t)size * slot_size);
+    ring->len = (uint32_t*)malloc(size * sizeof(uint32_t));
+    ring->time = (uint64_t*)malloc(size * sizeof(uint64_t));
+    if(!ring->data || !ring->len || !ring->time){
+        free(ring->data);
+        free(ring->len);
+        free(ring->time);
+        memset(ring,0,sizeof(*ring));
+        return -1;
+    }
+    ring->size = size;
+    ring->slot_size = slot_size;
+    ring->max_reports = max_reports;
+    return 0;
+}
 
-    len = (length < rpt->len)? length: rpt->len;
-    if (len > 0)
-        memcpy(data, rpt->data, len);
-    dev->input_reports = rpt->next;
+/* the slot for the next report, never one a reader may take */
+static char *input_ring_reserve(struct input_ring *ring)
+{
+    uint32_t head = __atomic_load_n(&ring->head,__ATOMIC_RELAXED);
 
-    free(rpt->data);
-    free(rpt);
-    return len;
+    return ring->data + (size_t)(head & (ring->size-1)) * ring->slot_size;
+}
+
+static int input_ring_full(struct input_ring *ring)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail,__ATOMIC_SEQ_CST);
+
+    return INPUT_RING_INDEX(__atomic_load_n(&ring->head,__ATOMIC_RELAXED) - tail) >= ring->max_reports;
+}
+
+/* after head or a held tail moved, stored with __ATOMIC_SEQ_CST */
+static void input_ring_wake_readers(usbapi_device *dev)
+{
+    /* against a reader that counts itself as waiting and then looks at the ring */
+    if(__atomic_load_n(&dev->input_reports.waiting,__ATOMIC_SEQ_CST)){
+        os_mutex_lock(dev->buffer_mutex);
+        os_cond_broadcast(dev->condition);
+        os_mutex_unlock(dev->buffer_mutex);
+    }
+}
+
+/*
+ * puts the report in the reserved slot on the ring, if it is full dropping
+ * the oldest one or this one as the policy says, and wakes the readers
+ */
+static void input_ring_commit(usbapi_device *dev, uint32_t len)
+{
+    struct input_ring *ring = &dev->input_reports;
+    uint32_t head = __atomic_load_n(&ring->head,__ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&ring->tail,__ATOMIC_ACQUIRE);
+
+    /* a failed exchange means a reader took it, tail is reloaded */
+    while(INPUT_RING_INDEX(head - tail) >= ring->max_reports){
+        if((tail & INPUT_RING_HELD) || ring->policy != USBAPI_QUEUE_DROP_OLDEST){
+            __atomic_add_fetch(&ring->dropped_newest,1,__ATOMIC_RELAXED);
+            return;
+        }
+        if(__atomic_compare_exchange_n(&ring->tail,&tail,INPUT_RING_INDEX(tail+1),0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)){
+            __atomic_add_fetch(&ring->dropped_oldest,1,__ATOMIC_RELAXED);
+            break;
+        }
+    }
+    ring->len[head & (ring->size-1)] = len;
+    ring->time[head & (ring->size-1)] = input_report_time();
+    __atomic_store_n(&ring->head,INPUT_RING_INDEX(head+1),__ATOMIC_SEQ_CST);
+    input_ring_wake_readers(dev);
+}
+
+#ifdef OS_LINUX
+static void usbapi_reactor_kick(usbapi_device *dev);
+#endif
+
+/*
+ * for USBAPI_QUEUE_BLOCK: sleeps while the ring is full, 0 when there is
+ * room. A reactor thread does not sleep, it is -1 at once and the reader
+ * that makes room kicks the device.
+ */
+static int input_ring_wait_room(usbapi_device *dev)
+{
+    struct input_ring *ring = &dev->input_reports;
+
+    if(!input_ring_full(ring))
+        return 0;
+    __atomic_add_fetch(&ring->blocks,1,__ATOMIC_RELAXED);
+#ifdef OS_LINUX
+    if(dev->reactor){
+        __atomic_store_n(&ring->blocked,1,__ATOMIC_SEQ_CST);
+        /* room meanwhile, unless the reader that made it kicks already */
+        if(!input_ring_full(ring) && __atomic_exchange_n(&ring->blocked,0,__ATOMIC_SEQ_CST))
+            return 0;
+        return -1;
+    }
+#endif
+    os_mutex_lock(dev->buffer_mutex);
+    /* against a reader that moves tail and then looks for a blocked thread */
+    __atomic_store_n(&ring->blocked,1,__ATOMIC_SEQ_CST);
+    while(input_ring_full(ring) && !dev->shutdown_thread && !dev->pause_thread)
+        os_cond_wait(dev->condition, dev->buffer_mutex);
+    __atomic_store_n(&ring->blocked,0,__ATOMIC_RELAXED);
+    os_mutex_unlock(dev->buffer_mutex);
+    return input_ring_full(ring) ? -1 : 0;
+}
+
+/* after a reader made room on the ring */
+static void input_ring_wake_thread(usbapi_device *dev)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&dev->input_reports.blocked,__ATOMIC_RELAXED)){
+#ifdef OS_LINUX
+        if(dev->reactor){
+            if(__atomic_exchange_n(&dev->input_reports.blocked,0,__ATOMIC_SEQ_CST))
+                usbapi_reactor_kick(dev);
+            return;
+        }
+#endif
+        os_mutex_lock(dev->buffer_mutex);
+        os_cond_broadcast(dev->condition);
+        os_mutex_unlock(dev->buffer_mutex);
+    }
+}
+
+/* the length of the oldest report, 0 if there is none or reports are borrowed */
+static int input_ring_peek(struct input_ring *ring)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail,__ATOMIC_SEQ_CST);
+
+    if((tail & INPUT_RING_HELD) || tail == __atomic_load_n(&ring->head,__ATOMIC_SEQ_CST))
+        return 0;
+    return ring->len[tail & (ring->size-1)];
+}
+
+/* copies the oldest report to data, cut at max, and takes it off; 0 if there is none or it is borrowed */
+static int input_ring_take(struct input_ring *ring, char *data, size_t max)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail,__ATOMIC_ACQUIRE);
+
+    while(!(tail & INPUT_RING_HELD) && tail != __atomic_load_n(&ring->head,__ATOMIC_ACQUIRE)){
+        uint32_t slot = tail & (ring->size-1);
+        size_t len = ring->len[slot];
+
+        /* a report dropped under the copy may be half overwritten, len too */
+        if(len > ring->slot_size)
+            len = ring->slot_size;
+        if(len > max)
+            len = max;
+        memcpy(data,ring->data + (size_t)slot * ring->slot_size,len);
+        if(__atomic_compare_exchange_n(&ring->tail,&tail,INPUT_RING_INDEX(tail+1),0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+            return len;
+    }
+    return 0;
+}
+
+/*
+ * borrows up to max of the oldest reports in place, they stay on the ring
+ * until input_ring_unhold; how many, -1 if some are borrowed already
+ */
+static int input_ring_hold(struct input_ring *ring, usbapi_report *reports, int max)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail,__ATOMIC_ACQUIRE);
+    uint32_t i,n;
+
+    do{
+        if(tail & INPUT_RING_HELD)
+            return -1;
+        n = INPUT_RING_INDEX(__atomic_load_n(&ring->head,__ATOMIC_ACQUIRE) - tail);
+        if(n == 0)
+            return 0;
+        if(n > (uint32_t)max)
+            n = max;
+        /* a failed exchange means the thread dropped the oldest one */
+    }while(!__atomic_compare_exchange_n(&ring->tail,&tail,tail|INPUT_RING_HELD,0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE));
+
+    ring->held = n;
+    for(i=0;i<n;i++){
+        uint32_t slot = (tail+i) & (ring->size-1);
+        reports[i].data = ring->data + (size_t)slot * ring->slot_size;
+        reports[i].len = ring->len[slot];
+        reports[i].time = ring->time[slot];
+    }
+    return n;
+}
+
+/* takes the borrowed reports off the ring */
+static void input_ring_unhold(struct input_ring *ring)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail,__ATOMIC_ACQUIRE);
+
+    /* nobody else moves a held tail */
+    if(tail & INPUT_RING_HELD)
+        __atomic_store_n(&ring->tail,INPUT_RING_INDEX(tail+ring->held),__ATOMIC_SEQ_CST);
+    ring->held = 0;
+}
+
+/* borrowed reports are kept until they are given back */
+static void input_ring_clear(struct input_ring *ring)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail,__ATOMIC_ACQUIRE);
+
+    while(!(tail & INPUT_RING_HELD) &&
+            !__atomic_compare_exchange_n(&ring->tail,&tail,__atomic_load_n(&ring->head,__ATOMIC_ACQUIRE),
+                0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+        ;
+}
+
+
+/* USBAPI_READ_FRAMED: puts the messages in frame_data on the ring, -1 if it stopped for room */
+static int input_frame_parse(usbapi_device *dev)
+{
+    usbapi_framer *framer = &dev->framer;
+    size_t start = 0,left;
+    int stalled = 0;
+    long len;
+
+    while((left = dev->frame_len - start) > 0){
+        len = framer->frame(framer,dev->frame_data+start,left,dev->frame_seen);
+        if(len == 0){
+            dev->frame_seen = left;
+            break;
+        }
+        dev->frame_seen = 0;
+        if(len < 0 || (size_t)len > left || (size_t)len > framer->max_len){
+            __atomic_add_fetch(&dev->input_reports.discarded,1,__ATOMIC_RELAXED);
+            start++;
+            continue;
+        }
+        if(dev->input_reports.policy == USBAPI_QUEUE_BLOCK && input_ring_wait_room(dev)){
+            stalled = 1;
+            break;
+        }
+        memcpy(input_ring_reserve(&dev->input_reports),dev->frame_data+start,len);
+        input_ring_commit(dev,len);
+        start += len;
+    }
+
+    /* no message is that long, the next report would not fit either */
+    if(!stalled && dev->frame_len - start >= framer->max_len){
+        __atomic_add_fetch(&dev->input_reports.discarded,dev->frame_len - start,__ATOMIC_RELAXED);
+        start = dev->frame_len;
+        dev->frame_seen = 0;
+    }
+    if(start){
+        memmove(dev->frame_data,dev->frame_data+start,dev->frame_len-start);
+        dev->frame_len -= start;
+    }
+    return stalled ? -1 : 0;
+}
+
+/* reads a report after what the framer has left, as input_read */
+static int input_frame_read(usbapi_device *dev)
+{
+    int bytes_read = -1;
+
+    /* the messages left by a stop for room first, no report may come */
+    if(input_frame_parse(dev))
+        return -1;
+    os_read(dev->handle,dev->frame_data+dev->frame_len,input_report_size(dev->info->input_endpoint),bytes_read);
+    if(bytes_read<=0)
+        return 0;
+    dev->frame_len += bytes_read;
+    return input_frame_parse(dev) ? -1 : 1;
+}
+
+/*
+ * reads a report of the device to the ring, or the messages of the framer:
+ * 1 if there was one, 0 if there was nothing, -1 if the ring is full and
+ * the device is to wait for room
+ */
+static int input_read(usbapi_device *dev)
+{
+    char *buf;
+    int bytes_read = -1;
+
+    if(dev->input_reports.policy == USBAPI_QUEUE_BLOCK && input_ring_wait_room(dev))
+        return -1;
+    if(dev->read_mode == USBAPI_READ_FRAMED)
+        return input_frame_read(dev);
+
+    buf = input_ring_reserve(&dev->input_reports);
+    os_read(dev->handle,buf,dev->input_reports.slot_size,bytes_read);
+    if(bytes_read<=0)
+        return 0;
+    input_ring_commit(dev,bytes_read);
+    return 1;
+}
+
+long usbapi_frame_fixed(const usbapi_framer *framer, const char *data, size_t len, size_t seen)
+{
+    return len >= framer->length ? (long)framer->length : 0;
+}
+
+long usbapi_frame_prefix(const usbapi_framer *framer, const char *data, size_t len, size_t seen)
+{
+    const unsigned char *p = (const unsigned char*)data + framer->offset;
+    unsigned long field = 0;
+    long total;
+    int i;
+
+    if(len < framer->offset + framer->size)
+        return 0;
+    for(i=0;i<framer->size;i++){
+        if(framer->big_endian)
+            field = field << 8 | p[i];
+        else
+            field |= (unsigned long)p[i] << (8*i);
+    }
+    total = (long)field + framer->adjust;
+    /* the length cannot end before its field does */
+    if(total < (long)(framer->offset + framer->size))
+        return -1;
+    return (size_t)total <= len ? total : 0;
+}
+
+long usbapi_frame_delimiter(const usbapi_framer *framer, const char *data, size_t len, size_t seen)
+{
+    /* memchr goes a vector at a time, and only over what is new */
+    const char *end = memchr(data+seen,framer->delimiter,len-seen);
+
+    return end ? end - data + 1 : 0;
 }
 
 
@@ -270,8 +903,6 @@ static DWORD WINAPI *read_thread(LVOID param)
 #endif
 {
     usbapi_device *dev = param;
-    unsigned char buf[2048];
-    int bytes_read;
     int res;
 
     if(!dev||!dev->info){
@@ -289,9 +920,12 @@ static DWORD WINAPI *read_thread(LVOID param)
 
     /* Handle all the events. */
     while (1) {
-        if(dev->shutdown_thread || dev->handle == INVALID_HANDLE_VALUE){
+        if(dev->shutdown_thread || dev->pause_thread || dev->handle == INVALID_HANDLE_VALUE){
             break;
         }
+        if(dev->input_reports.policy == USBAPI_QUEUE_BLOCK && input_ring_wait_room(dev)){
+            continue;
+        }
 #ifdef OS_LINUX
         struct pollfd fds[] = {
             { .fd = dev->thread_pipe[0],
@@ -311,41 +945,7 @@ static DWORD WINAPI *read_thread(LVOID param)
 #endif
         if(res>0){
             // has data
-            memset(buf,0,sizeof(buf));
-            bytes_read = -1;
-            os_read(dev->handle,buf,sizeof(buf),bytes_read);
-            if(bytes_read>0){
-                struct input_report *rpt = (struct input_report*)malloc(sizeof(struct input_report));
-                rpt->data = malloc(bytes_read);
-                memcpy(rpt->data, buf, bytes_read);
-                rpt->len = bytes_read;
-                rpt->next = NULL;
-
-                os_mutex_lock(dev->buffer_mutex);
-                /* Attach the new report object to the end of the list. */
-                if (dev->input_reports == NULL) {
-                    /* The list is empty. Put it at the root. */
-                    dev->input_reports = rpt;
-                    os_cond_signal(dev->condition);
-                } else {
-                    /* Find the end of the list and attach. */
-                    struct input_report *cur = dev->input_reports;
-                    int num_queued = 1;
-                    while (cur->next != NULL) {
-                        cur = cur->next;
-                        num_queued++;
-                    }
-                    cur->next = rpt;
-
-                    /* Pop one off if we've reached DEFAULT_MAX_INPUT_REPORTS in the queue. This
-                       way we don't grow forever if the user never reads
-                       anything from the device. */
-                    if((num_queued >= DEFAULT_MAX_INPUT_REPORTS)){
-                        return_data(dev, NULL, 0);
-                    }
-                }
-                os_mutex_unlock(dev->buffer_mutex);
-            }
+            input_read(dev);
         }else if(res<0){
             // error
         }
@@ -372,64 +972,598 @@ static DWORD WINAPI *read_thread(LVOID param)
     return NULL;
 }
 
+#ifdef OS_LINUX
+
+static struct usbapi_reactor_entry *usbapi_reactor_entry_get(uint32_t index)
+{
+    struct usbapi_reactor_entry *chunk;
+
+    chunk = __atomic_load_n(&reactor.chunks[index / USBAPI_REACTOR_CHUNK],__ATOMIC_ACQUIRE);
+    return &chunk[index % USBAPI_REACTOR_CHUNK];
+}
+
+/* a free entry, with reactor.mutex held; NULL if there is no room */
+static struct usbapi_reactor_entry *usbapi_reactor_entry_new(void)
+{
+    struct usbapi_reactor_entry *e,*chunk;
+    int i;
+
+    if(!reactor.free){
+        if(reactor.nchunks == USBAPI_REACTOR_MAX_CHUNKS)
+            return NULL;
+        chunk = (struct usbapi_reactor_entry*)calloc(USBAPI_REACTOR_CHUNK,sizeof(*chunk));
+        if(!chunk)
+            return NULL;
+        for(i=USBAPI_REACTOR_CHUNK-1;i>=0;i--){
+            os_mutex_init(chunk[i].mutex);
+            chunk[i].index = reactor.nchunks * USBAPI_REACTOR_CHUNK + i;
+            chunk[i].next = reactor.free;
+            reactor.free = &chunk[i];
+        }
+        __atomic_store_n(&reactor.chunks[reactor.nchunks++],chunk,__ATOMIC_RELEASE);
+    }
+    e = reactor.free;
+    reactor.free = e->next;
+    return e;
+}
+
+static void usbapi_reactor_entry_free(struct usbapi_reactor_entry *e)
+{
+    os_mutex_lock(reactor.mutex);
+    /* kicks still listed for the device are left to the next one */
+    e->gen++;
+    e->next = reactor.free;
+    reactor.free = e;
+    os_mutex_unlock(reactor.mutex);
+}
+
+static int usbapi_reactor_arm(struct usbapi_reactor_entry *e, int op)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u64 = e->index | (uint64_t)e->gen << 32;
+    return epoll_ctl(reactor.epfd,op,e->dev->handle,&ev);
+}
+
+/* reads the device of the entry for an event, if it is still the one of gen */
+static void usbapi_reactor_service(uint32_t index, uint32_t gen, uint32_t events)
+{
+    struct usbapi_reactor_entry *e = usbapi_reactor_entry_get(index);
+    int i,res = 1;
+
+    os_mutex_lock(e->mutex);
+    if(e->dev && e->gen == gen){
+        if(events & (EPOLLERR | EPOLLHUP)){
+            /* not armed again, usb_plugout closes it */
+            LOGD(TAG,"device %p hung up",e->dev);
+        }else{
+            for(i=0;i<USBAPI_REACTOR_READS && res>0;i++)
+                res = input_read(e->dev);
+            /* a device stalled on a full queue is kicked by the reader that makes room */
+            if(res >= 0 && usbapi_reactor_arm(e,EPOLL_CTL_MOD))
+                LOGE(TAG,"arm device %p failed: %s",e->dev,strerror(errno));
+        }
+    }
+    os_mutex_unlock(e->mutex);
+}
+
+/*
+ * a reader made room for a device that stalled, a reactor thread goes on
+ * with it; nothing if the device left the reactor meanwhile, unplugged or
+ * paused. The entry and the eventfd are only looked at with reactor.mutex,
+ * which the device leaves with, and the eventfd is closed with.
+ */
+static void usbapi_reactor_kick(usbapi_device *dev)
+{
+    struct usbapi_reactor_entry *e;
+    uint64_t one = 1;
+
+    os_mutex_lock(reactor.mutex);
+    e = dev->reactor_entry;
+    if(e && reactor.control >= 0){
+        e->kick_gen = e->gen;
+        if(!e->kicked){
+            e->kicked = 1;
+            e->kick_next = reactor.kicks;
+            reactor.kicks = e;
+        }
+        if(write(reactor.control,&one,sizeof(one)) != sizeof(one))
+            LOGE(TAG,"reactor control signal failed!");
+    }
+    os_mutex_unlock(reactor.mutex);
+}
+
+static void usbapi_reactor_kicked(void)
+{
+    struct usbapi_reactor_entry *e;
+    uint64_t count;
+    uint32_t gen;
+
+    /* another thread may have taken the count, and the kicks with it */
+    if(read(reactor.control,&count,sizeof(count)) == sizeof(count) &&
+            __atomic_load_n(&reactor.stopping,__ATOMIC_ACQUIRE)){
+        /* the stop was taken too, give it back to the other threads */
+        count = 1;
+        if(write(reactor.control,&count,sizeof(count)) != sizeof(count))
+            LOGE(TAG,"reactor control signal failed!");
+        return;
+    }
+
+    for(;;){
+        os_mutex_lock(reactor.mutex);
+        e = reactor.kicks;
+        if(e){
+            reactor.kicks = e->kick_next;
+            e->kicked = 0;
+            gen = e->kick_gen;
+        }
+        os_mutex_unlock(reactor.mutex);
+        if(!e)
+            break;
+        usbapi_reactor_service(e->index,gen,EPOLLIN);
+    }
+}
+
+static void *usbapi_reactor_main(void *param)
+{
+    struct epoll_event events[USBAPI_REACTOR_EVENTS];
+    int i,n;
+
+    LOGD(TAG,"reactor thread start!");
+    while(!__atomic_load_n(&reactor.stopping,__ATOMIC_ACQUIRE)){
+        n = epoll_wait(reactor.epfd,events,USBAPI_REACTOR_EVENTS,-1);
+        for(i=0;i<n;i++){
+            if(events[i].data.u64 == USBAPI_REACTOR_CONTROL)
+                usbapi_reactor_kicked();
+            else
+                usbapi_reactor_service((uint32_t)events[i].data.u64,(uint32_t)(events[i].data.u64 >> 32),events[i].events);
+        }
+    }
+    LOGD(TAG,"reactor thread stop!");
+    return NULL;
+}
+
+/* with reactor.start_mutex held */
+static int usbapi_reactor_start(void)
+{
+    struct epoll_event ev;
+    int i;
+
+    reactor.epfd = epoll_create1(EPOLL_CLOEXEC);
+    reactor.control = eventfd(0,EFD_CLOEXEC | EFD_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.u64 = USBAPI_REACTOR_CONTROL;
+    if(reactor.epfd < 0 || reactor.control < 0 ||
+            epoll_ctl(reactor.epfd,EPOLL_CTL_ADD,reactor.control,&ev)){
+        LOGE(TAG,"reactor start failed: %s",strerror(errno));
+        if(reactor.epfd >= 0)
+            close(reactor.epfd);
+        if(reactor.control >= 0)
+            close(reactor.control);
+        reactor.epfd = reactor.control = -1;
+        return -1;
+    }
+
+    reactor.stopping = 0;
+    for(i=0;i<reactor.threads;i++)
+        os_thread_create(reactor.thread[i],usbapi_reactor_main,NULL);
+    reactor.running = reactor.threads;
+    LOGD(TAG,"reactor started with %d threads",reactor.running);
+    return 0;
+}
+
+/* with reactor.start_mutex held, when no device is left */
+static void usbapi_reactor_stop(void);
+
+/*
+ * with reactor.start_mutex held: as many threads as reactor.threads asks,
+ * more are started at once but fewer only once no device is left
+ */
+static int usbapi_reactor_apply(void)
+{
+    if(reactor.running && !reactor.users && reactor.running != reactor.threads)
+        usbapi_reactor_stop();
+    if(!reactor.running)
+        return reactor.threads ? usbapi_reactor_start() : 0;
+    for(;reactor.running < reactor.threads;reactor.running++)
+        os_thread_create(reactor.thread[reactor.running],usbapi_reactor_main,NULL);
+    return 0;
+}
+
+static void usbapi_reactor_stop(void)
+{
+    uint64_t one = 1;
+    int i;
+
+    __atomic_store_n(&reactor.stopping,1,__ATOMIC_RELEASE);
+    if(write(reactor.control,&one,sizeof(one)) != sizeof(one))
+        LOGE(TAG,"reactor control signal failed!");
+    for(i=0;i<reactor.running;i++)
+        os_thread_join(reactor.thread[i]);
+    reactor.running = 0;
+    close(reactor.epfd);
+    reactor.epfd = -1;
+    /* no device is left to kick, but a reader may still be about to */
+    os_mutex_lock(reactor.mutex);
+    close(reactor.control);
+    reactor.control = -1;
+
+    for(i=0;i<reactor.nchunks;i++){
+        int j;
+        for(j=0;j<USBAPI_REACTOR_CHUNK;j++)
+            os_mutex_destroy(reactor.chunks[i][j].mutex);
+        free(reactor.chunks[i]);
+        reactor.chunks[i] = NULL;
+    }
+    reactor.nchunks = 0;
+    reactor.free = NULL;
+    reactor.kicks = NULL;
+    os_mutex_unlock(reactor.mutex);
+    LOGD(TAG,"reactor stopped");
+}
+
+/* dev is read by the reactor threads from now on */
+static int usbapi_reactor_attach(usbapi_device *dev)
+{
+    struct usbapi_reactor_entry *e;
+    int flags;
+
+    /* nothing to read */
+    if(!dev->info->input_endpoint)
+        return 0;
+
+    os_mutex_lock(reactor.mutex);
+    e = usbapi_reactor_entry_new();
+    os_mutex_unlock(reactor.mutex);
+    if(!e){
+        LOGE(TAG,"no reactor entry for device %p!",dev);
+        return -1;
+    }
+
+    /* an event may be stale, a read must not wait for data then */
+    flags = fcntl(dev->handle,F_GETFL);
+    if(flags == -1 || fcntl(dev->handle,F_SETFL,flags | O_NONBLOCK)){
+        usbapi_reactor_entry_free(e);
+        return -1;
+    }
+
+    os_mutex_lock(e->mutex);
+    e->dev = dev;
+    if(usbapi_reactor_arm(e,EPOLL_CTL_ADD)){
+        LOGE(TAG,"add device %p to the reactor failed: %s",dev,strerror(errno));
+        e->dev = NULL;
+        os_mutex_unlock(e->mutex);
+        usbapi_reactor_entry_free(e);
+        return -1;
+    }
+    /* before a thread may read it, and stall */
+    os_mutex_lock(reactor.mutex);
+    dev->reactor_entry = e;
+    os_mutex_unlock(reactor.mutex);
+    os_mutex_unlock(e->mutex);
+    return 0;
+}
+
+/* no reactor thread reads dev once this returns, and no reader kicks it */
+static void usbapi_reactor_detach(usbapi_device *dev)
+{
+    struct usbapi_reactor_entry *e;
+
+    os_mutex_lock(reactor.mutex);
+    e = dev->reactor_entry;
+    dev->reactor_entry = NULL;
+    os_mutex_unlock(reactor.mutex);
+    if(!e)
+        return;
+    os_mutex_lock(e->mutex);
+    epoll_ctl(reactor.epfd,EPOLL_CTL_DEL,dev->handle,NULL);
+    e->dev = NULL;
+    os_mutex_unlock(e->mutex);
+    usbapi_reactor_entry_free(e);
+}
+
+/* the threads are started by usbapi_set_reactor, opening and closing a device costs none */
+static int usbapi_reactor_add(usbapi_device *dev)
+{
+    int ret = 0;
+
+    os_mutex_lock(reactor.start_mutex);
+    /* usbapi_set_reactor(0) since the device was opened */
+    if(!reactor.running || usbapi_reactor_attach(dev))
+        ret = -1;
+    else
+        reactor.users++;
+    os_mutex_unlock(reactor.start_mutex);
+    return ret;
+}
+
+static void usbapi_reactor_remove(usbapi_device *dev)
+{
+    os_mutex_lock(reactor.start_mutex);
+    usbapi_reactor_detach(dev);
+    reactor.users--;
+    /* the threads usbapi_set_reactor asked to go while dev was read go now */
+    if(usbapi_reactor_apply())
+        reactor.threads = 0;
+    os_mutex_unlock(reactor.start_mutex);
+}
+
+int usbapi_set_reactor(int threads)
+{
+    int ret;
+
+    if(threads<0||threads>USBAPI_REACTOR_MAX_THREADS){
+        LOGD(TAG,"Invalid parameter!");
+        return -1;
+    }
+    usbapi_context_init();
+    os_mutex_lock(reactor.start_mutex);
+    reactor.threads = threads;
+    ret = usbapi_reactor_apply();
+    if(ret)
+        reactor.threads = 0;
+    os_mutex_unlock(reactor.start_mutex);
+    return ret;
+}
+
+#else
+
+int usbapi_set_reactor(int threads)
+{
+    return threads ? -1 : 0;
+}
+
+#endif
+
 static void usbapi_force_close(usbapi_device *dev);
 
-#if defined OS_LINUX
-void usb_plugout(int bus,int dev,const char* sys_name)
+#if defined OS_LINUX
+/*
+ * Apply a hotplug event to the live tree, with context.mutex held. Only
+ * the device is read again from sysfs. A tree parsed from the text dump is
+ * not patched, its bandwidth would be stale: it is rebuilt instead, as is
+ * a tree the patches have left enough garbage in or that could not read
+ * the device. The rebuild waits for the next use of the tree, so a burst
+ * of events costs one parse, and none on the thread of the monitor.
+ */
+static void usbapi_patch_devices(int bus,int dev,const char* sys_name,int removed)
+{
+    context.generation++;
+    if(!context.live || context.stale)
+        return;
+    if(usb_tree_from_dump(context.devices)){
+        context.stale = 1;
+        return;
+    }
+
+    if(removed)
+        context.devices = usb_tree_remove_device(context.devices,bus,dev);
+    else
+        context.devices = usb_tree_add_device(context.devices,sys_name);
+
+    if(++context.patches >= USBAPI_MAX_PATCHES ||
+            (!removed && bus && !usb_lookup_device(context.devices,bus,dev)))
+        context.stale = 1;
+}
+
+void usb_plugin(int bus,int dev,const char* sys_name)
+{
+    LOGD(TAG,"Get plugin:bus=%d dev=%d sys_name=%s",bus,dev,sys_name);
+    os_mutex_lock(context.mutex);
+    usbapi_patch_devices(bus,dev,sys_name,0);
+    os_mutex_unlock(context.mutex);
+}
+
+void usb_plugout(int bus,int dev,const char* sys_name)
+{
+    usbapi_device *device = NULL;
+
+    LOGD(TAG,"Get plugout:bus=%d dev=%d sys_name=%s",bus,dev,sys_name);
+    os_mutex_lock(context.mutex);
+    /* closing a device deregisters it, so take the head until none is left */
+    while((device = usb_index_get(&context.index,bus,dev)) != NULL){
+        os_mutex_unlock(context.mutex);
+        usbapi_force_close(device);
+        os_mutex_lock(context.mutex);
+    }
+    usbapi_patch_devices(bus,dev,sys_name,1);
+    os_mutex_unlock(context.mutex);
+}
+
+/* drivers bind after the device is added, and change its interfaces */
+void usb_bind(const char* sys_name)
+{
+    LOGD(TAG,"Get bind:sys_name=%s",sys_name);
+    os_mutex_lock(context.mutex);
+    usbapi_patch_devices(0,0,sys_name,0);
+    os_mutex_unlock(context.mutex);
+}
+
+#endif
+
+/*
+ * Run the hotplug monitor while a device is open or the tree is kept. It
+ * is stopped by joining its thread, so this is only called from the
+ * threads of the user, never from a hotplug callback.
+ */
+static void usbapi_update_monitor(void)
+{
+#if defined OS_LINUX
+    int want;
+
+    os_mutex_lock(context.monitor_mutex);
+    os_mutex_lock(context.mutex);
+    want = context.num>0 || context.inits>0;
+    os_mutex_unlock(context.mutex);
+
+    if(want && !context.monitoring){
+        want = linux_netlink_start_event_monitor(usb_plugin,usb_plugout,usb_bind) == 0;
+        os_mutex_lock(context.mutex);
+        context.monitoring = want;
+        context.generation++;
+        os_mutex_unlock(context.mutex);
+    }else if(!want && context.monitoring){
+        linux_netlink_stop_event_monitor();
+        /* nothing tells when the devices change now */
+        os_mutex_lock(context.mutex);
+        context.monitoring = 0;
+        context.generation++;
+        usbapi_snapshot_release(context.snapshot);
+        context.snapshot = NULL;
+        os_mutex_unlock(context.mutex);
+    }
+    os_mutex_unlock(context.monitor_mutex);
+#endif
+}
+
+int usbapi_init(void)
+{
+    usbapi_context_init();
+
+    os_mutex_lock(context.mutex);
+    context.inits++;
+    os_mutex_unlock(context.mutex);
+
+    /* the monitor runs first, events that come while the tree is read wait for it */
+    usbapi_update_monitor();
+
+    os_mutex_lock(context.mutex);
+    if(!context.live){
+        context.devices = get_usb_devices();
+        context.patches = 0;
+        context.stale = 0;
+        context.live = 1;
+    }
+    os_mutex_unlock(context.mutex);
+
+    return 0;
+}
+
+/* the live tree, with context.mutex held; rebuilt if hotplug left it stale */
+static usb_device_info *usbapi_live_devices(void)
+{
+    if(context.stale){
+        free_usb_devices(context.devices);
+        context.devices = get_usb_devices();
+        context.patches = 0;
+        context.stale = 0;
+    }
+    return context.devices;
+}
+
+void usbapi_exit(void)
+{
+    int last;
+
+    if(context.num<0)
+        return;
+
+    os_mutex_lock(context.mutex);
+    if(context.inits>0 && --context.inits==0){
+        free_usb_devices(context.devices);
+        context.devices = NULL;
+        context.live = 0;
+        context.stale = 0;
+    }
+    last = context.inits == 0;
+    os_mutex_unlock(context.mutex);
+
+    usbapi_update_monitor();
+    if(last)
+        usbapi_set_reactor(0);
+}
+
+static usbapi_snapshot *new_usbapi_snapshot(usb_device_info* devices,unsigned long generation)
+{
+    usbapi_snapshot *snapshot = (usbapi_snapshot*)malloc(sizeof(usbapi_snapshot));
+
+    if(!snapshot){
+        LOGE(TAG,"malloc failed!");
+        free_usb_devices(devices);
+        return NULL;
+    }
+    snapshot->devices = devices;
+    snapshot->generation = generation;
+    snapshot->refs = 1;
+    return snapshot;
+}
+
+/*
+ * While the hotplug monitor runs, everyone in the same generation gets the
+ * same snapshot: a copy of the tree kept by usbapi_init, or one parse. With
+ * no monitor there is no telling when it gets old, so each call parses.
+ */
+usbapi_snapshot *usbapi_snapshot_acquire(void)
+{
+    usbapi_snapshot *snapshot;
+    unsigned long generation;
+
+    usbapi_context_init();
+
+    os_mutex_lock(context.mutex);
+    if(!context.monitoring){
+        generation = ++context.generation;
+        os_mutex_unlock(context.mutex);
+        return new_usbapi_snapshot(get_usb_devices(),generation);
+    }
+
+    if(!context.snapshot || context.snapshot->generation != context.generation){
+        usbapi_snapshot_release(context.snapshot);
+        context.snapshot = new_usbapi_snapshot(context.live?usb_clone_devices(usbapi_live_devices()):get_usb_devices(),
+                                               context.generation);
+    }
+    snapshot = context.snapshot;
+    if(snapshot)
+        __sync_add_and_fetch(&snapshot->refs,1);
+    os_mutex_unlock(context.mutex);
+
+    return snapshot;
+}
+
+void usbapi_snapshot_release(usbapi_snapshot *snapshot)
+{
+    if(snapshot && __sync_sub_and_fetch(&snapshot->refs,1) == 0){
+        free_usb_devices(snapshot->devices);
+        free(snapshot);
+    }
+}
+
+const usb_device_info *usbapi_snapshot_devices(const usbapi_snapshot *snapshot)
+{
+    return snapshot?snapshot->devices:NULL;
+}
+
+unsigned long usbapi_snapshot_generation(const usbapi_snapshot *snapshot)
+{
+    return snapshot?snapshot->generation:0;
+}
+
+unsigned long usbapi_generation(void)
 {
-    int i;
-    usbapi_device *device = NULL;
-    (void)sys_name;
+    unsigned long generation;
 
-    LOGD(TAG,"Get plugout:bus=%d dev=%d sys_name=%s",bus,dev,sys_name);
+    usbapi_context_init();
     os_mutex_lock(context.mutex);
-    for(i=0;i<context.max&&context.devices[i]!=NULL&&context.devices[i]->info!=NULL;i++){
-        usbapi_device_info *info = context.devices[i]->info;
-        if(info->busnum == bus && info->devnum == dev){
-            device = context.devices[i];
-            os_mutex_unlock(context.mutex);
-            usbapi_force_close(device);
-            os_mutex_lock(context.mutex);
-        }
-    }
+    generation = context.generation;
     os_mutex_unlock(context.mutex);
+
+    return generation;
 }
 
-#endif
+static void deregister_usbDevice(usbapi_device* dev);
 
-static void register_usbDevice(usbapi_device* dev)
+static int register_usbDevice(usbapi_device* dev)
 {
-    int i;
-
-    if(context.num<0){
-        // not init
-        os_mutex_init(context.mutex);
-        context.num = 0;
-    }
+    usbapi_context_init();
 
-    if(!dev)
-        return;
+    if(!dev||!dev->info)
+        return -1;
 
     os_mutex_lock(context.mutex);
 
     if(context.num == 0){
-        context.max = 128;
-        context.devices = (usbapi_device**)malloc(sizeof(usbapi_device*)*context.max);
-        memset(context.devices,0,sizeof(usbapi_device*)*context.max);
-#if defined OS_LINUX
-        linux_netlink_start_event_monitor(NULL,usb_plugout);
-#endif
-    }
-
-    for(i=0;i<context.max&&context.devices[i]!=NULL;i++);
-    if(i>=context.max){
-        // mem not enough
-        context.max = context.max*2;
-        usbapi_device** devices = (usbapi_device**)malloc(sizeof(usbapi_device*)*context.max);
-        memset(devices,0,sizeof(usbapi_device*)*context.max);
-        memcpy(devices,context.devices,context.num*sizeof(usbapi_device*));
-        free(context.devices);
-        context.devices = devices;
+        usb_index_init(&context.index,0);
     }
 
     LOGD(TAG,"register device %p with path=%s bus=%02x dev=%02x",
@@ -438,17 +1572,27 @@ static void register_usbDevice(usbapi_device* dev)
                dev->info?dev->info->busnum:-1,
                dev->info?dev->info->devnum:-1);
 
-    context.devices[i] = dev;
+    dev->index_next = usb_index_put(&context.index,dev->info->busnum,dev->info->devnum,dev);
     context.num++;
 
     os_mutex_unlock(context.mutex);
+
+#ifdef OS_LINUX
+    if(dev->reactor && usbapi_reactor_add(dev)){
+        dev->reactor = 0;
+        deregister_usbDevice(dev);
+        return -1;
+    }
+#endif
+    return 0;
 }
 
 static void deregister_usbDevice(usbapi_device* dev)
 {
-    int i;
+    usbapi_device *head,**p;
+    int found = 0;
 
-    if(!dev)
+    if(!dev||!dev->info)
         return;
 
     if(context.num<=0)
@@ -456,30 +1600,33 @@ static void deregister_usbDevice(usbapi_device* dev)
 
     os_mutex_lock(context.mutex);
 
-    for(i=0;i<context.max ;i++){
-    	if(context.devices[i]==dev){
-    		// device found
-                    LOGD(TAG,"deregister device %p with path=%s bus=%02x dev=%02x",
-    		                   dev,
-    		                   dev->info?dev->info->path:"NULL",
-    		                   dev->info?dev->info->busnum:-1,
-    		                   dev->info?dev->info->devnum:-1);
-    		        context.devices[i] = NULL;
-    		        context.num--;
-    		        break;
-    	}
+    /* unlink dev from the chain of its bus and device number */
+    head = (usbapi_device*)usb_index_get(&context.index,dev->info->busnum,dev->info->devnum);
+    for(p=&head;*p&&*p!=dev;p=&(*p)->index_next);
+    if(*p){
+        // device found
+        LOGD(TAG,"deregister device %p with path=%s bus=%02x dev=%02x",
+                   dev,
+                   dev->info->path,
+                   dev->info->busnum,
+                   dev->info->devnum);
+        *p = dev->index_next;
+        dev->index_next = NULL;
+        usb_index_put(&context.index,dev->info->busnum,dev->info->devnum,head);
+        context.num--;
+        found = 1;
     }
 
+    /* the monitor is left to usbapi_update_monitor, this may run on its thread */
     if(context.num==0){
-#if defined OS_LINUX
-        linux_netlink_stop_event_monitor();
-#endif
-        context.max = 0;
-        free(context.devices);
-        context.devices = NULL;
+        usb_index_destroy(&context.index);
     }
     os_mutex_unlock(context.mutex);
 
+#ifdef OS_LINUX
+    if(found && dev->reactor)
+        usbapi_reactor_remove(dev);
+#endif
 }
 
 #ifdef OS_LINUX
@@ -510,11 +1657,20 @@ err_close_pipe:
 
 #endif
 
-usbapi_device *  usbapi_open(usbapi_device_info *dev_info)
+const char *usbapi_device_path(usbapi_device_info *dev_info)
 {
     if(!dev_info)
         return NULL;
     if(!dev_info->path)
+        dev_info->path = usb_resolve_path(dev_info->location);
+    return dev_info->path;
+}
+
+usbapi_device *  usbapi_open(usbapi_device_info *dev_info)
+{
+    if(!dev_info)
+        return NULL;
+    if(!usbapi_device_path(dev_info))
         return NULL;
 
     usbapi_device *dev = new_usbapi_device();
@@ -522,6 +1678,10 @@ usbapi_device *  usbapi_open(usbapi_device_info *dev_info)
         return NULL;
 
     dev->info = dup_usbapi_info(dev_info);
+    if(input_ring_init(&dev->input_reports,input_slot_size(dev,dev->read_mode,&dev->framer),dev->queue_max_reports,dev->queue_max_bytes)){
+        LOGE(TAG,"malloc failed!");
+        goto err;
+    }
 
     /* OPEN HERE */
     dev->handle = os_open(dev->info->path);
@@ -536,7 +1696,8 @@ usbapi_device *  usbapi_open(usbapi_device_info *dev_info)
     }
 
 #ifdef OS_LINUX
-    if(create_pipe(dev->thread_pipe)!=0){
+    dev->reactor = reactor.threads > 0;
+    if(!dev->reactor && create_pipe(dev->thread_pipe)!=0){
         os_close(dev->handle);
         LOGE(TAG,"create pipe failed!");
         goto err;
@@ -544,8 +1705,14 @@ usbapi_device *  usbapi_open(usbapi_device_info *dev_info)
 #endif
 
     LOGD(TAG,"Open usb succeed with path=%s handle=%d",dev->info->path,dev->handle);
-    register_usbDevice(dev);
-    os_thread_create(dev->thread, read_thread, dev);
+    if(register_usbDevice(dev)){
+        os_close(dev->handle);
+        LOGE(TAG,"register device failed!");
+        goto err;
+    }
+    usbapi_update_monitor();
+    if(!dev->reactor)
+        os_thread_create(dev->thread, read_thread, dev);
 
     return dev;
 err:
@@ -553,43 +1720,184 @@ err:
     return NULL;
 }
 
-usbapi_device *  usbapi_open_vid_pid(unsigned short vendor_id, unsigned short product_id)
+/*
+ * The record usbapi_collect would make first for vendor_id:product_id, of
+ * class_code unless it is -1, looked for with a visitor: nothing is
+ * allocated. Devices come in the order sysfs lists them, so the record of
+ * a device is only kept while no other match comes first in the order of
+ * the enumeration.
+ */
+/* a string descriptor is up to 127 UTF-16 units, 3 bytes each in UTF-8 */
+#define USBAPI_FIND_STRING_SIZE 382
+#define USBAPI_FIND_PATH_SIZE   4096
+
+typedef struct usbapi_find_record {
+    int                     found;          /* info has an interface, its endpoints follow */
+    usbapi_device_info      info;
+    struct usbapi_device_endpoint input;
+    struct usbapi_device_endpoint output;
+    char                    name[32];
+    char                    manufacturer[USBAPI_FIND_STRING_SIZE];
+    char                    product[USBAPI_FIND_STRING_SIZE];
+    char                    serial[USBAPI_FIND_STRING_SIZE];
+    char                    location[USBAPI_FIND_PATH_SIZE];
+} usbapi_find_record;
+
+typedef struct usbapi_find {
+    unsigned short          vendor_id;
+    unsigned short          product_id;
+    int                     class_code;
+    usbapi_find_record      records[2];
+    int                     best;           /* record kept, -1 for none */
+    int                     cur;            /* record being filled, the other one */
+} usbapi_find;
+
+static char *usbapi_find_copy(char *buf,size_t size,const char *str)
 {
-    usbapi_device_info* info,*root_info;
-    usbapi_device* dev = NULL;
+    if(!str || strlen(str) >= size)
+        return NULL;
+    strcpy(buf,str);
+    return buf;
+}
 
-    info = root_info = usbapi_enumerate(vendor_id,product_id);
-    while(info){
-        if(info->vendor_id == vendor_id &&
-                info->product_id == product_id){
-            dev = usbapi_open(info);
-            break;
-        }
-        info = info->next;
-    }
-    usbapi_free_enumeration(root_info);
-    return dev;
+/* the record filled becomes the one kept, and the old one is filled next */
+static void usbapi_find_commit(usbapi_find *find)
+{
+    if(!find->records[find->cur].found)
+        return;
+    find->best = find->cur;
+    find->cur = !find->cur;
+    find->records[find->cur].found = 0;
 }
 
-usbapi_device *  usbapi_open_vid_pid_class(unsigned short vendor_id, unsigned short product_id,enum usb_class_code class_code)
+static int usbapi_find_device(void *ctx,const usb_device_info *device)
+{
+    usbapi_find *find = (usbapi_find*)ctx;
+    usbapi_find_record *record;
+    usbapi_device_info *info;
+
+    usbapi_find_commit(find);
+    if(device->idVendor != find->vendor_id || device->idProduct != find->product_id)
+        return USB_VISIT_SKIP;
+    if(!device->name || (find->best >= 0 &&
+            usb_compare_device_names(device->name,find->records[find->best].name) >= 0))
+        return USB_VISIT_SKIP;
+
+    record = &find->records[find->cur];
+    memset(record,0,sizeof(usbapi_find_record));
+    info = &record->info;
+    usbapi_find_copy(record->name,sizeof(record->name),device->name);
+    info->vendor_id = device->idVendor;
+    info->product_id = device->idProduct;
+    info->busnum = device->busnum;
+    info->devnum = device->devnum;
+    info->release_number = device->bcdDevice?(unsigned short)(atof(device->bcdDevice)*100):0;
+    info->manufacturer_string = usbapi_find_copy(record->manufacturer,sizeof(record->manufacturer),device->manufacturer);
+    info->product_string = usbapi_find_copy(record->product,sizeof(record->product),device->product);
+    info->serial_number = usbapi_find_copy(record->serial,sizeof(record->serial),device->serial);
+    return USB_VISIT_CONTINUE;
+}
+
+static int usbapi_find_config(void *ctx,const usb_device_info *device,const usb_device_config *config)
+{
+    usbapi_find *find = (usbapi_find*)ctx;
+
+    return find->records[find->cur].found?USB_VISIT_SKIP:USB_VISIT_CONTINUE;
+}
+
+static int usbapi_find_interface(void *ctx,const usb_device_info *device,const usb_device_config *config,
+                                 const usb_device_interface *inf)
 {
+    usbapi_find *find = (usbapi_find*)ctx;
+    usbapi_find_record *record = &find->records[find->cur];
+
+    if(record->found)
+        return USB_VISIT_SKIP;
+    if(find->class_code >= 0 && inf->bInterfaceClass != find->class_code)
+        return USB_VISIT_CONTINUE;
+
+    record->found = 1;
+    record->info.interface_number = inf->bInterfaceNumber;
+    record->info.class_code = inf->bInterfaceClass;
+    record->info.location = usbapi_find_copy(record->location,sizeof(record->location),inf->location);
+    return USB_VISIT_CONTINUE;
+}
+
+static int usbapi_find_endpoint(void *ctx,const usb_device_info *device,const usb_device_interface *inf,
+                                const usb_device_endpoint *ep)
+{
+    usbapi_find *find = (usbapi_find*)ctx;
+    usbapi_find_record *record = &find->records[find->cur];
+    struct usbapi_device_endpoint *endpoint;
+
+    if(!record->found)
+        return USB_VISIT_CONTINUE;
+    if(ep->in == USB_ENDPOINT_IN && !record->info.input_endpoint)
+        endpoint = record->info.input_endpoint = &record->input;
+    else if(ep->in == USB_ENDPOINT_OUT && !record->info.output_endpoint)
+        endpoint = record->info.output_endpoint = &record->output;
+    else
+        return USB_VISIT_CONTINUE;
+    endpoint->addr = ep->bEndpointAddress;
+    endpoint->attr = ep->bmAttributes;
+    endpoint->ivl = ep->bInterval;
+    endpoint->max = ep->wMaxPacketSize;
+    return USB_VISIT_CONTINUE;
+}
+
+static usbapi_device *usbapi_open_first(unsigned short vendor_id, unsigned short product_id, int class_code)
+{
+    static const usb_visitor visitor = {
+        usbapi_find_device,usbapi_find_config,usbapi_find_interface,usbapi_find_endpoint,
+        USB_ENUM_ALL&~USB_ENUM_BANDWIDTH
+    };
     usbapi_device_info* info,*root_info;
     usbapi_device* dev = NULL;
-
-    info = root_info = usbapi_enumerate(vendor_id,product_id);
-    while(info){
-        if(info->vendor_id == vendor_id &&
-                info->product_id == product_id &&
-                info->class_code == class_code ){
-            dev = usbapi_open(info);
-            break;
+    usbapi_find find;
+
+    /* the shared tree is read in memory already */
+    if(usbapi_shared()){
+        info = root_info = usbapi_enumerate_class(vendor_id,product_id,class_code);
+        while(info){
+            if(info->vendor_id == vendor_id &&
+                    info->product_id == product_id &&
+                    (class_code < 0 || info->class_code == class_code)){
+                dev = usbapi_open(info);
+                break;
+            }
+            info = info->next;
         }
-        info = info->next;
+        usbapi_free_enumeration(root_info);
+        return dev;
     }
-    usbapi_free_enumeration(root_info);
+
+    memset(&find,0,sizeof(find));
+    find.vendor_id = vendor_id;
+    find.product_id = product_id;
+    find.class_code = class_code;
+    find.best = -1;
+    usb_enumerate_visit(&visitor,&find);
+    usbapi_find_commit(&find);
+    if(find.best < 0)
+        return NULL;
+
+    /* the record is copied when opened, all but the path it resolves to */
+    info = &find.records[find.best].info;
+    dev = usbapi_open(info);
+    free(info->path);
     return dev;
 }
 
+usbapi_device *  usbapi_open_vid_pid(unsigned short vendor_id, unsigned short product_id)
+{
+    return usbapi_open_first(vendor_id,product_id,-1);
+}
+
+usbapi_device *  usbapi_open_vid_pid_class(unsigned short vendor_id, unsigned short product_id,enum usb_class_code class_code)
+{
+    return usbapi_open_first(vendor_id,product_id,class_code);
+}
+
 int usbapi_isOpen(usbapi_device* dev)
 {
     if(dev){
@@ -621,27 +1929,36 @@ static void usbapi_force_close(usbapi_device *dev)
     }
     /* Cause read_thread() to stop. */
     dev->shutdown_thread = 1;
+    /* also when it is blocked on a full queue */
+    os_mutex_lock(dev->buffer_mutex);
+    os_cond_broadcast(dev->condition);
+    os_mutex_unlock(dev->buffer_mutex);
 
     LOGD(TAG,"close %d with path=%s",dev->handle,dev->info?dev->info->path:"NULL");
+    /* a device of the reactor is left by its threads here */
     deregister_usbDevice(dev);
 
+    if(!dev->reactor){
 #ifdef OS_LINUX
-    /* Write some dummy data to the control pipe and
-     * wait for the thread to exit */
-    char dummy = 1;
-    int r = write(dev->thread_pipe[1], &dummy, sizeof(dummy));
-    if (r <= 0) {
-        LOGE(TAG,"control pipe signal failed!");
-    }
+        /* Write some dummy data to the control pipe and
+         * wait for the thread to exit */
+        char dummy = 1;
+        int r = write(dev->thread_pipe[1], &dummy, sizeof(dummy));
+        if (r <= 0) {
+            LOGE(TAG,"control pipe signal failed!");
+        }
 #endif
-    /* Wait for read_thread() to end. */
-    LOGD(TAG,"wait for thread exit...");
-    os_thread_join(dev->thread);
+        /* Wait for read_thread() to end. */
+        LOGD(TAG,"wait for thread exit...");
+        os_thread_join(dev->thread);
+    }
 
     os_close(dev->handle);
 #ifdef OS_LINUX
-    close(dev->thread_pipe[0]);
-    close(dev->thread_pipe[1]);
+    if(!dev->reactor){
+        close(dev->thread_pipe[0]);
+        close(dev->thread_pipe[1]);
+    }
 #endif
     // not free device ,user should call usbapi_close
     LOGD(TAG,"close device %d sucess,wait for free %p",dev->handle,dev);
@@ -654,6 +1971,7 @@ void  usbapi_close(usbapi_device *dev)
         return;
     usbapi_force_close(dev);
     free_usbapi_device(dev);
+    usbapi_update_monitor();
 }
 
 
@@ -744,23 +2062,14 @@ int usbapi_read_timeout(usbapi_device *dev, char *data, size_t max, int msecs)
     res = usbapi_pollin(dev,msecs);
     if(res > 0){
         int bytes_read = 0;
-        os_mutex_lock(dev->buffer_mutex);
-#if 1
-        while(dev->input_reports && bytes_read<max){
-        	int readed = return_data(dev,data+bytes_read,max-bytes_read);
-        	if(readed<=0){
-        		break;
-        	}else{
-        		bytes_read += readed;
-        	}
-        }
-#else
-        if (dev->input_reports) {
-            /* Return the first one */
-            bytes_read = return_data(dev, data, max);
+        int readed;
+        while(bytes_read<max &&
+                (readed = input_ring_take(&dev->input_reports,data+bytes_read,max-bytes_read))>0){
+            bytes_read += readed;
+            if(dev->read_mode != USBAPI_READ_STREAM)
+                break;
         }
-#endif
-        os_mutex_unlock(dev->buffer_mutex);
+        input_ring_wake_thread(dev);
         LOGD(TAG,"#### %d bytes read.",bytes_read);
         if(bytes_read>0)
             LOGD_HEX(TAG,data,MIN(40,bytes_read));
@@ -781,15 +2090,290 @@ int usbapi_read(usbapi_device *dev, char *data, size_t max)
     return usbapi_read_timeout(dev, data, max, 0);
 }
 
+int usbapi_read_acquire(usbapi_device *dev, const char **data, size_t *len, int msecs)
+{
+    usbapi_report report;
+    int res;
+
+    if(!data||!len){
+        LOGD(TAG,"Invalid parameter!");
+        return -1;
+    }
+
+    res = usbapi_read_acquire_batch(dev,&report,1,msecs);
+    if(res > 0){
+        *data = report.data;
+        *len = report.len;
+        return report.len;
+    }
+    return res;
+}
+
+int usbapi_read_acquire_batch(usbapi_device *dev, usbapi_report *reports, int max, int msecs)
+{
+    int res;
+
+    if(!dev||!reports||max<=0){
+        LOGD(TAG,"Invalid parameter!");
+        return -1;
+    }
+
+    /* pollin would wait for the release of reports borrowed already */
+    if(__atomic_load_n(&dev->input_reports.tail,__ATOMIC_ACQUIRE) & INPUT_RING_HELD){
+        LOGD(TAG,"Reports held already, release them first!");
+        return -1;
+    }
+    res = usbapi_pollin(dev,msecs);
+    if(res > 0){
+        res = input_ring_hold(&dev->input_reports,reports,max);
+        if(res < 0)
+            LOGD(TAG,"Reports held already, release them first!");
+    }
+    return res;
+}
+
+void usbapi_read_release(usbapi_device *dev)
+{
+    if(!dev)
+        return;
+    input_ring_unhold(&dev->input_reports);
+    input_ring_wake_thread(dev);
+    /* readers slept while the reports were borrowed, more may be left */
+    input_ring_wake_readers(dev);
+}
+
 void usbapi_flush(usbapi_device *dev)
 {
     if(!dev)
         return;
+    input_ring_clear(&dev->input_reports);
+    input_ring_wake_thread(dev);
+}
+
+/* the reports that fit in to, the newest ones, and the counters */
+static void input_ring_move(struct input_ring *to, struct input_ring *from)
+{
+    uint32_t tail = INPUT_RING_INDEX(from->tail);
+    uint32_t head = from->head;
+
+    if(INPUT_RING_INDEX(head - tail) > to->max_reports)
+        tail = INPUT_RING_INDEX(head - to->max_reports);
+    for(;tail != head;tail = INPUT_RING_INDEX(tail+1)){
+        uint32_t slot = tail & (from->size-1);
+        uint32_t len = MIN(from->len[slot],to->slot_size);
+
+        memcpy(input_ring_reserve(to),from->data + (size_t)slot * from->slot_size,len);
+        to->len[to->head & (to->size-1)] = len;
+        to->time[to->head & (to->size-1)] = from->time[slot];
+        to->head++;
+    }
+    to->waiting = from->waiting;
+    to->dropped_oldest = from->dropped_oldest;
+    to->dropped_newest = from->dropped_newest;
+    to->blocks = from->blocks;
+    to->discarded = from->discarded;
+}
+
+/* stops the reads of an open device, with dev_mutex held until usbapi_resume */
+static int usbapi_pause(usbapi_device *dev)
+{
+    os_mutex_lock(dev->dev_mutex);
+    if(dev->shutdown_thread||dev->handle==INVALID_HANDLE_VALUE){
+        os_mutex_unlock(dev->dev_mutex);
+        LOGD(TAG,"Invalid handle!");
+        return -1;
+    }
+
+#ifdef OS_LINUX
+    if(dev->reactor){
+        usbapi_reactor_detach(dev);
+        return 0;
+    }
+#endif
+    dev->pause_thread = 1;
+#ifdef OS_LINUX
+    char dummy = 1;
+    if (write(dev->thread_pipe[1], &dummy, sizeof(dummy)) <= 0) {
+        LOGE(TAG,"control pipe signal failed!");
+    }
+#endif
+    os_mutex_lock(dev->buffer_mutex);
+    os_cond_broadcast(dev->condition);
+    os_mutex_unlock(dev->buffer_mutex);
+    os_thread_join(dev->thread);
+#ifdef OS_LINUX
+    if (read(dev->thread_pipe[0], &dummy, sizeof(dummy)) <= 0) {
+        LOGE(TAG,"control pipe drain failed!");
+    }
+#endif
+    dev->pause_thread = 0;
+    return 0;
+}
+
+static void usbapi_resume(usbapi_device *dev)
+{
+#ifdef OS_LINUX
+    if(dev->reactor){
+        /* left unread otherwise, until it is closed */
+        if(usbapi_reactor_attach(dev))
+            LOGE(TAG,"device %p left the reactor!",dev);
+        os_mutex_unlock(dev->dev_mutex);
+        return;
+    }
+#endif
+    os_thread_create(dev->thread, read_thread, dev);
+    os_mutex_unlock(dev->dev_mutex);
+}
+
+/*
+ * with read_thread stopped: ring in place of the ring of dev, with the
+ * reports that fit; -1 if reports are borrowed, their data is in the old one
+ */
+static int input_ring_replace(usbapi_device *dev, struct input_ring *ring)
+{
+    struct input_ring old;
+
+    /* readers asleep in usbapi_pollin look at the ring with the mutex */
     os_mutex_lock(dev->buffer_mutex);
-    while (dev->input_reports) {
-        return_data(dev, NULL, 0);
+    if(__atomic_load_n(&dev->input_reports.tail,__ATOMIC_ACQUIRE) & INPUT_RING_HELD){
+        os_mutex_unlock(dev->buffer_mutex);
+        LOGD(TAG,"Reports held, release them first!");
+        return -1;
     }
+    old = dev->input_reports;
+    if(ring->size)
+        input_ring_move(ring,&old);
+    dev->input_reports = *ring;
     os_mutex_unlock(dev->buffer_mutex);
+    input_ring_free(&old);
+    return 0;
+}
+
+int usbapi_set_queue_limits(usbapi_device *dev, int max_reports, size_t max_bytes, enum usbapi_queue_policy policy)
+{
+    struct input_ring ring;
+
+    if(!dev||max_reports<0||max_reports>(1<<20)||policy>USBAPI_QUEUE_BLOCK){
+        LOGD(TAG,"Invalid parameter!");
+        return -1;
+    }
+    if(!max_reports)
+        max_reports = DEFAULT_MAX_INPUT_REPORTS;
+
+    if(input_ring_init(&ring,input_slot_size(dev,dev->read_mode,&dev->framer),max_reports,max_bytes)){
+        LOGE(TAG,"malloc failed!");
+        return -1;
+    }
+    ring.policy = policy;
+
+    /* the ring is only changed with read_thread stopped */
+    if(usbapi_pause(dev)){
+        input_ring_free(&ring);
+        return -1;
+    }
+    if(input_ring_replace(dev,&ring)){
+        usbapi_resume(dev);
+        input_ring_free(&ring);
+        return -1;
+    }
+    dev->queue_max_reports = max_reports;
+    dev->queue_max_bytes = max_bytes;
+    usbapi_resume(dev);
+
+    LOGD(TAG,"queue of %p: %u reports of %u bytes, policy %d",dev,ring.max_reports,ring.slot_size,policy);
+    return 0;
+}
+
+/* 0 for a built-in framer that can never find a message, it would discard all */
+static int usbapi_framer_valid(const usbapi_framer *framer)
+{
+    if(!framer||!framer->frame||!framer->max_len||framer->max_len>(1<<20))
+        return 0;
+    if(framer->frame == usbapi_frame_fixed)
+        return framer->length && framer->length <= framer->max_len;
+    if(framer->frame == usbapi_frame_prefix){
+        if(framer->size != 1 && framer->size != 2 && framer->size != 4)
+            return 0;
+        if(framer->offset > framer->max_len || framer->max_len - framer->offset < (size_t)framer->size)
+            return 0;
+        /* the longest field the length can have must still reach past it */
+        return (long long)((1ULL << (8*framer->size)) - 1) + framer->adjust >=
+                (long long)(framer->offset + framer->size);
+    }
+    return 1;
+}
+
+int usbapi_set_read_mode(usbapi_device *dev, enum usbapi_read_mode mode, const usbapi_framer *framer)
+{
+    struct input_ring ring;
+    char *frame_data = NULL;
+
+    if(!dev||mode>USBAPI_READ_FRAMED){
+        LOGD(TAG,"Invalid parameter!");
+        return -1;
+    }
+    if(mode == USBAPI_READ_FRAMED && !usbapi_framer_valid(framer)){
+        LOGD(TAG,"Invalid framer!");
+        return -1;
+    }
+
+    if(mode == USBAPI_READ_FRAMED && dev->info->input_endpoint){
+        frame_data = (char*)malloc(framer->max_len + input_report_size(dev->info->input_endpoint));
+        if(!frame_data){
+            LOGE(TAG,"malloc failed!");
+            return -1;
+        }
+    }
+
+    /* the slots are as big as the messages */
+    if(input_ring_init(&ring,input_slot_size(dev,mode,framer),dev->queue_max_reports,dev->queue_max_bytes)){
+        free(frame_data);
+        LOGE(TAG,"malloc failed!");
+        return -1;
+    }
+    ring.policy = dev->input_reports.policy;
+
+    if(usbapi_pause(dev)){
+        input_ring_free(&ring);
+        free(frame_data);
+        return -1;
+    }
+    if(input_ring_replace(dev,&ring)){
+        usbapi_resume(dev);
+        input_ring_free(&ring);
+        free(frame_data);
+        return -1;
+    }
+    dev->read_mode = mode;
+    if(mode == USBAPI_READ_FRAMED)
+        dev->framer = *framer;
+    free(dev->frame_data);
+    dev->frame_data = frame_data;
+    dev->frame_len = 0;
+    dev->frame_seen = 0;
+    usbapi_resume(dev);
+
+    LOGD(TAG,"read mode of %p: %d, %u bytes a read",dev,mode,ring.slot_size);
+    return 0;
+}
+
+int usbapi_get_queue_stats(usbapi_device *dev, usbapi_queue_stats *stats)
+{
+    struct input_ring *ring;
+
+    if(!dev||!stats){
+        LOGD(TAG,"Invalid parameter!");
+        return -1;
+    }
+
+    ring = &dev->input_reports;
+    stats->queued = INPUT_RING_INDEX(__atomic_load_n(&ring->head,__ATOMIC_ACQUIRE) -
+                                     __atomic_load_n(&ring->tail,__ATOMIC_ACQUIRE));
+    stats->dropped_oldest = __atomic_load_n(&ring->dropped_oldest,__ATOMIC_RELAXED);
+    stats->dropped_newest = __atomic_load_n(&ring->dropped_newest,__ATOMIC_RELAXED);
+    stats->blocked = __atomic_load_n(&ring->blocks,__ATOMIC_RELAXED);
+    stats->discarded = __atomic_load_n(&ring->discarded,__ATOMIC_RELAXED);
+    return 0;
 }
 
 int  usbapi_pollin(usbapi_device *dev,int msecs)
@@ -806,43 +2390,41 @@ int  usbapi_pollin(usbapi_device *dev,int msecs)
         return -1;
     }
 
-    os_mutex_lock(dev->buffer_mutex);
     /* There's an input report queued up. Return it. */
-    if (dev->input_reports) {
-        ret = dev->input_reports->len;
-        goto exit;
-    }
+    ret = input_ring_peek(&dev->input_reports);
+    if (ret > 0)
+        return ret;
     if (dev->shutdown_thread) {
         /* This means the device has been disconnected.
            An error code of -1 should be returned. */
-        ret = -1;
-        goto exit;
+        return -1;
+    }
+    if (msecs != -1 && msecs <= 0) {
+        /* Purely non-blocking */
+        return 0;
     }
+
+    os_mutex_lock(dev->buffer_mutex);
+    __atomic_add_fetch(&dev->input_reports.waiting,1,__ATOMIC_SEQ_CST);
     if (msecs == -1) {
         /* Blocking */
-        while (!dev->input_reports && !dev->shutdown_thread) {
+        while (!(ret = input_ring_peek(&dev->input_reports)) && !dev->shutdown_thread) {
             os_cond_wait(dev->condition, dev->buffer_mutex);
         }
-        if (dev->input_reports)
-            ret = dev->input_reports->len;
-    }else if (msecs > 0){
+        if (!ret)
+            ret = -1;
+    }else {
         /* Non-blocking, but called with timeout. */
         int res;
 
-        while (!dev->input_reports && !dev->shutdown_thread) {
+        while (!(ret = input_ring_peek(&dev->input_reports)) && !dev->shutdown_thread) {
             os_cond_timedwait(dev->condition, dev->buffer_mutex, msecs,res);
             if (res == 0) {
-                if (dev->input_reports) {
-                    ret = dev->input_reports->len;
-                    break;
-                }
-
-                /* If we're here, there was a spurious wake up
-                   or the read thread was shutdown. Run the
-                   loop again (ie: don't break). */
+                /* If we're here, there was a spurious wake up, a report
+                   or the read thread was shutdown. Run the loop again. */
             }else if (res == ETIMEDOUT) {
                 /* Timed out. */
-                ret = 0;
+                ret = input_ring_peek(&dev->input_reports);
                 break;
             }else {
                 /* Error. */
@@ -850,12 +2432,10 @@ int  usbapi_pollin(usbapi_device *dev,int msecs)
                 break;
             }
         }
-    }else {
-        /* Purely non-blocking */
-        ret = 0;
+        if (!ret && dev->shutdown_thread)
+            ret = -1;
     }
-
-exit:
+    __atomic_sub_fetch(&dev->input_reports.waiting,1,__ATOMIC_SEQ_CST);
     os_mutex_unlock(dev->buffer_mutex);
     return ret;
 }
@@ -8,10 +8,14 @@
 BEGIN_EXTERN_C
 
 typedef struct usbapi_device usbapi_device;
+typedef struct usbapi_snapshot usbapi_snapshot;
 
 struct usbapi_device_info{
-    /** Platform-specific device path */
+    /** Platform-specific device path, NULL until
+        usbapi_device_path or usbapi_open resolved it */
     char *path;
+    /** Where the path is resolved from */
+    char *location;
     /** Device Vendor ID */
     unsigned short vendor_id;
     /** Device Product ID */
@@ -45,16 +49,103 @@ struct usbapi_device_info{
     /* Endpoint information */
     struct usbapi_device_endpoint *input_endpoint;
     struct usbapi_device_endpoint *output_endpoint;
+    /** Where the strings live, shared with the other records
+        of the enumeration and their dups */
+    struct usbapi_strings *strings;
     /** Pointer to the next device */
     struct usbapi_device_info *next;
 };
 
 typedef struct usbapi_device_info usbapi_device_info;
 
+/** What the read thread does with a report when the queue of the device is full */
+enum usbapi_queue_policy {
+    USBAPI_QUEUE_DROP_OLDEST = 0,   /* the default */
+    USBAPI_QUEUE_DROP_NEWEST,
+    /** Stop reading the device, it is left to buffer in the kernel and the device */
+    USBAPI_QUEUE_BLOCK,
+};
+
+typedef struct usbapi_queue_stats {
+    unsigned long queued;           /* reports in the queue now */
+    unsigned long dropped_oldest;
+    unsigned long dropped_newest;
+    unsigned long blocked;          /* times the read thread stopped reading */
+    unsigned long discarded;        /* bytes the framer made no message of */
+} usbapi_queue_stats;
+
+/** What a read returns */
+enum usbapi_read_mode {
+    /** As many reports as fit, one after the other: the default */
+    USBAPI_READ_STREAM = 0,
+    /** One report, cut if it does not fit */
+    USBAPI_READ_REPORT,
+    /** One message, the read thread cuts the reports into messages with a framer */
+    USBAPI_READ_FRAMED,
+};
+
+typedef struct usbapi_framer usbapi_framer;
+
+/**
+ * The length of the message data starts with, 0 if data is not all of it
+ * yet, -1 if data does not start one and the first byte is to be dropped.
+ * The first seen bytes of data were given before, with no message in them.
+ */
+typedef long (*usbapi_frame_fn)(const usbapi_framer *framer, const char *data, size_t len, size_t seen);
+
+struct usbapi_framer {
+    usbapi_frame_fn frame;
+    /** No message is longer, the data is dropped when there is none in as much */
+    size_t max_len;
+    /** For usbapi_frame_fixed */
+    size_t length;
+    /** For usbapi_frame_prefix: a length of 1, 2 or 4 bytes at offset,
+        the message is that many plus adjust bytes long */
+    size_t offset;
+    int size;
+    int big_endian;
+    long adjust;
+    /** For usbapi_frame_delimiter: the last byte of a message */
+    unsigned char delimiter;
+    /** For a frame function of the caller */
+    void *user;
+};
+
+/** A report as it lies in the queue of an open device, see usbapi_read_acquire */
+typedef struct usbapi_report {
+    const char *data;
+    size_t len;
+    /** When the device sent it, in microseconds of a monotonic clock */
+    uint64_t time;
+} usbapi_report;
+
+/*
+ * keep the device tree in memory until the last usbapi_exit. A tree read
+ * from sysfs is patched by hotplug; one parsed from the text dump is parsed
+ * again on its next use after a burst of events.
+ */
+EXPORT int usbapi_init(void);
+EXPORT void usbapi_exit(void);
+/* a device tree that never changes, shared by the callers of one generation */
+EXPORT usbapi_snapshot *usbapi_snapshot_acquire(void);
+EXPORT void usbapi_snapshot_release(usbapi_snapshot *snapshot);
+EXPORT const usb_device_info *usbapi_snapshot_devices(const usbapi_snapshot *snapshot);
+EXPORT unsigned long usbapi_snapshot_generation(const usbapi_snapshot *snapshot);
+/* changes on every hotplug event, compare it with the generation of a snapshot */
+EXPORT unsigned long usbapi_generation(void);
 EXPORT usbapi_device_info *usbapi_enumerate(unsigned short vendor_id, unsigned short product_id);
 EXPORT void usbapi_free_enumeration(usbapi_device_info *devs);
 EXPORT usbapi_device_info* dup_usbapi_info(usbapi_device_info *dev_info);
+/* resolve the path of dev_info on the first call and keep it there */
+EXPORT const char *usbapi_device_path(usbapi_device_info *dev_info);
 
+/*
+ * devices opened from now on are read by threads shared by all of them,
+ * that many, not by a thread each; 0 for a thread each again (the default).
+ * The threads start here and are kept until usbapi_set_reactor(0) or the
+ * last usbapi_exit, and the close of the devices they read. Linux only.
+ */
+EXPORT int usbapi_set_reactor(int threads);
 EXPORT usbapi_device *  usbapi_open(usbapi_device_info *dev_info);
 EXPORT usbapi_device *  usbapi_open_vid_pid(unsigned short vendor_id, unsigned short product_id);
 EXPORT usbapi_device *  usbapi_open_vid_pid_class(unsigned short vendor_id, unsigned short product_id,enum usb_class_code class_code);
@@ -63,7 +154,37 @@ EXPORT void usbapi_close(usbapi_device *dev);
 EXPORT int  usbapi_write(usbapi_device* dev,const char* data,size_t length);
 EXPORT int usbapi_read_timeout(usbapi_device *dev, char *data, size_t max, int msecs);
 EXPORT int  usbapi_read(usbapi_device *dev, char *data, size_t max);
+/*
+ * the oldest report without a copy: its length, 0 on timeout or -1. It stays
+ * queued, and data stays good, until usbapi_read_release; while it is held a
+ * full queue drops new reports, usbapi_read and usbapi_pollin see none and
+ * wait for the release, and another acquire is -1.
+ */
+EXPORT int usbapi_read_acquire(usbapi_device *dev, const char **data, size_t *len, int msecs);
+/* the same for all the reports queued, up to max of them: how many */
+EXPORT int usbapi_read_acquire_batch(usbapi_device *dev, usbapi_report *reports, int max, int msecs);
+EXPORT void usbapi_read_release(usbapi_device *dev);
 EXPORT void usbapi_flush(usbapi_device *dev);
+/*
+ * at most max_reports queued (the default for 0) taking at most max_bytes
+ * of memory (no limit for 0), the reports queued are kept if they fit. The
+ * queue is made anew: call it while no other thread reads the device, and
+ * not while reports are borrowed, it is -1 then.
+ */
+EXPORT int usbapi_set_queue_limits(usbapi_device *dev, int max_reports, size_t max_bytes, enum usbapi_queue_policy policy);
+/*
+ * mode for the reads from now on, framer is copied and only used for
+ * USBAPI_READ_FRAMED, -1 for a built-in one that could never find a
+ * message in max_len bytes; what is queued is kept as it is, cut to fit.
+ * Call it while no other thread reads the device, and not while reports
+ * are borrowed, it is -1 then.
+ */
+EXPORT int usbapi_set_read_mode(usbapi_device *dev, enum usbapi_read_mode mode, const usbapi_framer *framer);
+EXPORT long usbapi_frame_fixed(const usbapi_framer *framer, const char *data, size_t len, size_t seen);
+EXPORT long usbapi_frame_prefix(const usbapi_framer *framer, const char *data, size_t len, size_t seen);
+EXPORT long usbapi_frame_delimiter(const usbapi_framer *framer, const char *data, size_t len, size_t seen);
+/* the counters are kept from the open on */
+EXPORT int usbapi_get_queue_stats(usbapi_device *dev, usbapi_queue_stats *stats);
 EXPORT int  usbapi_pollin(usbapi_device *dev,int msecs);
 EXPORT int  usbapi_pollout(usbapi_device *dev,int msecs);
 EXPORT const usbapi_device_info *usbapi_getinfo(usbapi_device*dev);
@@ -0,0 +1,116 @@
+#include "usbarena.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define USB_ARENA_MIN_CHUNK     (16*1024)
+#define USB_ARENA_MAX_CHUNK     (1024*1024)
+
+/* alignment good enough for anything in the device tree */
+#define USB_ARENA_ALIGN         (sizeof(void*)>sizeof(long long)?sizeof(void*):sizeof(long long))
+#define USB_ARENA_ROUND(x)      (((x)+USB_ARENA_ALIGN-1)&~(USB_ARENA_ALIGN-1))
+
+struct usb_arena_chunk {
+    usb_arena_chunk *next;
+    size_t          size;
+    size_t          used;
+};
+
+#define CHUNK_HEADER            USB_ARENA_ROUND(sizeof(usb_arena_chunk))
+#define CHUNK_DATA(chunk)       ((char*)(chunk)+CHUNK_HEADER)
+
+extern void usb_arena_init(usb_arena* arena)
+{
+    arena->chunks = NULL;
+    arena->next_size = USB_ARENA_MIN_CHUNK;
+    arena->total = 0;
+}
+
+static usb_arena_chunk* usb_arena_grow(usb_arena* arena,size_t size)
+{
+    usb_arena_chunk* chunk;
+    size_t chunk_size = arena->next_size;
+
+    if(chunk_size < size)
+        chunk_size = size;
+
+    chunk = (usb_arena_chunk*)malloc(CHUNK_HEADER+chunk_size);
+    if(!chunk)
+        return NULL;
+    chunk->size = chunk_size;
+    chunk->used = 0;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->total += chunk_size;
+
+    /* every chunk is twice the last one, so big trees need few of them */
+    if(arena->next_size < USB_ARENA_MAX_CHUNK)
+        arena->next_size *= 2;
+
+    return chunk;
+}
+
+extern void* usb_arena_alloc(usb_arena* arena,size_t size)
+{
+    usb_arena_chunk* chunk = arena->chunks;
+    void* ret;
+
+    size = USB_ARENA_ROUND(size?size:1);
+    if(!chunk || chunk->size-chunk->used < size){
+        chunk = usb_arena_grow(arena,size);
+        if(!chunk)
+            return NULL;
+    }
+
+    ret = CHUNK_DATA(chunk)+chunk->used;
+    chunk->used += size;
+    memset(ret,0,size);
+
+    return ret;
+}
+
+extern char* usb_arena_strndup(usb_arena* arena,const char* data,size_t len)
+{
+    char* ret = (char*)usb_arena_alloc(arena,len+1);
+
+    if(ret)
+        memcpy(ret,data,len);
+    return ret;
+}
+
+extern char* usb_arena_strdup(usb_arena* arena,const char* data)
+{
+    return data?usb_arena_strndup(arena,data,strlen(data)):NULL;
+}
+
+extern void usb_arena_adopt(usb_arena* arena,usb_arena* from)
+{
+    usb_arena_chunk* last = from->chunks;
+
+    if(!last)
+        return;
+    while(last->next)
+        last = last->next;
+
+    /* keep allocating from the current chunk of arena */
+    if(arena->chunks){
+        last->next = arena->chunks->next;
+        arena->chunks->next = from->chunks;
+    }else{
+        arena->chunks = from->chunks;
+    }
+    arena->total += from->total;
+    usb_arena_init(from);
+}
+
+extern void usb_arena_release(usb_arena* arena)
+{
+    usb_arena_chunk* chunk = arena->chunks;
+
+    while(chunk){
+        usb_arena_chunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    usb_arena_init(arena);
+}
@@ -0,0 +1,35 @@
+#ifndef USBARENA_H
+#define USBARENA_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * Growable bump allocator: memory is handed out from large chunks and
+ * only given back all at once by usb_arena_release.
+ */
+typedef struct usb_arena_chunk usb_arena_chunk;
+
+typedef struct usb_arena {
+    usb_arena_chunk *chunks;    /* the newest chunk first */
+    size_t          next_size;  /* size of the next chunk */
+    size_t          total;      /* bytes held in chunks */
+} usb_arena;
+
+extern void usb_arena_init(usb_arena* arena);
+/* zeroed memory, aligned for any type */
+extern void* usb_arena_alloc(usb_arena* arena,size_t size);
+extern char* usb_arena_strndup(usb_arena* arena,const char* data,size_t len);
+extern char* usb_arena_strdup(usb_arena* arena,const char* data);
+/* move every chunk of from into arena, from is left empty */
+extern void usb_arena_adopt(usb_arena* arena,usb_arena* from);
+extern void usb_arena_release(usb_arena* arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // USBARENA_H
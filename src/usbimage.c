@@ -0,0 +1,490 @@
+#include "usbimage.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define USBIMAGE_LOG_ERROR(fmt,...)    fprintf(stderr,fmt" in func:%s line:%d\n",##__VA_ARGS__,__FUNCTION__,__LINE__)
+
+#define USB_IMAGE_ALIGN(n)      (((n)+3)&~(size_t)3)
+
+/* the records and the strings are built apart, the strings go last */
+typedef struct usb_image_writer {
+    char        *data;
+    size_t      len;
+    size_t      size;
+    char        *strings;
+    size_t      nstrings;
+    size_t      ssize;
+    int         failed;
+} usb_image_writer;
+
+/* a device and its index in the list, sorted by address to find parents */
+typedef struct usb_image_slot {
+    const usb_device_info   *device;
+    uint32_t                index;
+} usb_image_slot;
+
+static int usb_image_grow(char** data,size_t* size,size_t need)
+{
+    size_t size2 = *size?*size:4096;
+    char *tmp;
+
+    while(size2 < need)
+        size2 *= 2;
+    if(size2 == *size)
+        return 0;
+    tmp = (char*)realloc(*data,size2);
+    if(!tmp)
+        return -1;
+    *data = tmp;
+    *size = size2;
+    return 0;
+}
+
+/* zeroed room for size bytes, return its offset; the data may move */
+static uint32_t usb_image_reserve(usb_image_writer* w,size_t size)
+{
+    size_t offset = USB_IMAGE_ALIGN(w->len);
+
+    if(w->failed || offset+size > UINT32_MAX ||
+            usb_image_grow(&w->data,&w->size,offset+size)){
+        w->failed = 1;
+        return 0;
+    }
+    memset(w->data+w->len,0,offset+size-w->len);
+    w->len = offset+size;
+    return (uint32_t)offset;
+}
+
+static uint32_t usb_image_add_string(usb_image_writer* w,const char* s)
+{
+    size_t len,offset = w->nstrings;
+
+    if(!s || w->failed)
+        return 0;
+    len = strlen(s)+1;
+    if(offset+len > UINT32_MAX ||
+            usb_image_grow(&w->strings,&w->ssize,offset+len)){
+        w->failed = 1;
+        return 0;
+    }
+    memcpy(w->strings+offset,s,len);
+    w->nstrings = offset+len;
+    return (uint32_t)offset;
+}
+
+static int usb_image_slot_compare(const void* a,const void* b)
+{
+    const usb_device_info *x = ((const usb_image_slot*)a)->device,*y = ((const usb_image_slot*)b)->device;
+
+    return x<y?-1:x>y;
+}
+
+/* the index of device plus one, 0 for a device not in the list */
+static uint32_t usb_image_index(const usb_image_slot* slots,uint32_t num,const usb_device_info* device)
+{
+    usb_image_slot key,*slot;
+
+    if(!device)
+        return 0;
+    key.device = device;
+    slot = (usb_image_slot*)bsearch(&key,slots,num,sizeof(usb_image_slot),usb_image_slot_compare);
+    return slot?slot->index+1:0;
+}
+
+static uint32_t usb_image_add_interfaces(usb_image_writer* w,const usb_device_config* config,uint32_t* num)
+{
+    const usb_device_interface *from;
+    usb_image_interface rec;
+    usb_image_endpoint ep;
+    uint32_t offset,endpoints;
+    int i,j,n = 0,nendpoint;
+
+    while(config->interfaces && n < config->bNumInterfaces && config->interfaces[n])
+        n++;
+    *num = n;
+    if(!n)
+        return 0;
+
+    offset = usb_image_reserve(w,n*sizeof(usb_image_interface));
+    for(i=0;i<n&&!w->failed;i++){
+        from = config->interfaces[i];
+        memset(&rec,0,sizeof(rec));
+        rec.driver = usb_image_add_string(w,from->driver);
+        rec.path = usb_image_add_string(w,from->path);
+        rec.location = usb_image_add_string(w,from->location);
+        rec.bInterfaceNumber = from->bInterfaceNumber;
+        rec.bAlternateSetting = from->bAlternateSetting;
+        rec.bNumEndpoints = from->bNumEndpoints;
+        rec.bInterfaceClass = from->bInterfaceClass;
+        rec.bInterfaceSubClass = from->bInterfaceSubClass;
+        rec.bInterfaceProtocol = from->bInterfaceProtocol;
+        rec.attached = from->attached;
+
+        nendpoint = 0;
+        while(from->endpoint && nendpoint < from->bNumEndpoints && from->endpoint[nendpoint])
+            nendpoint++;
+        endpoints = nendpoint?usb_image_reserve(w,nendpoint*sizeof(usb_image_endpoint)):0;
+        for(j=0;j<nendpoint&&!w->failed;j++){
+            ep.in = from->endpoint[j]->in;
+            ep.bEndpointAddress = from->endpoint[j]->bEndpointAddress;
+            ep.bmAttributes = from->endpoint[j]->bmAttributes;
+            ep.wMaxPacketSize = from->endpoint[j]->wMaxPacketSize;
+            ep.bInterval = from->endpoint[j]->bInterval;
+            memcpy(w->data+endpoints+j*sizeof(ep),&ep,sizeof(ep));
+        }
+        rec.nendpoints = nendpoint;
+        rec.endpoints = endpoints;
+        if(!w->failed)
+            memcpy(w->data+offset+i*sizeof(rec),&rec,sizeof(rec));
+    }
+    return offset;
+}
+
+static uint32_t usb_image_add_configs(usb_image_writer* w,const usb_device_info* device,uint32_t* num)
+{
+    const usb_device_config *from;
+    usb_image_config rec;
+    uint32_t offset;
+    int i,n = 0;
+
+    while(device->config && n < device->bNumConfigurations && device->config[n])
+        n++;
+    *num = n;
+    if(!n)
+        return 0;
+
+    offset = usb_image_reserve(w,n*sizeof(usb_image_config));
+    for(i=0;i<n&&!w->failed;i++){
+        from = device->config[i];
+        memset(&rec,0,sizeof(rec));
+        rec.bConfigurationValue = from->bConfigurationValue;
+        rec.bNumInterfaces = from->bNumInterfaces;
+        rec.bmAttributes = from->bmAttributes;
+        rec.bMaxPower = from->bMaxPower;
+        rec.interfaces = usb_image_add_interfaces(w,from,&rec.ninterfaces);
+        if(!w->failed)
+            memcpy(w->data+offset+i*sizeof(rec),&rec,sizeof(rec));
+    }
+    return offset;
+}
+
+static void usb_image_add_device(usb_image_writer* w,const usb_device_info* from,
+                                 const usb_image_slot* slots,uint32_t num,uint32_t offset)
+{
+    usb_image_device rec;
+    usb_image_bandwidth bandwidth;
+    uint32_t child;
+    int i;
+
+    memset(&rec,0,sizeof(rec));
+    rec.name = usb_image_add_string(w,from->name);
+    rec.version = usb_image_add_string(w,from->version);
+    rec.bcdDevice = usb_image_add_string(w,from->bcdDevice);
+    rec.manufacturer = usb_image_add_string(w,from->manufacturer);
+    rec.product = usb_image_add_string(w,from->product);
+    rec.serial = usb_image_add_string(w,from->serial);
+    rec.busnum = from->busnum;
+    rec.level = from->level;
+    rec.portNumber = from->portNumber;
+    rec.connectorNumber = from->connectorNumber;
+    rec.devnum = from->devnum;
+    rec.speed = from->speed;
+    rec.bDeviceClass = from->bDeviceClass;
+    rec.bDeviceSubClass = from->bDeviceSubClass;
+    rec.bDeviceProtocol = from->bDeviceProtocol;
+    rec.bMaxPacketSize0 = from->bMaxPacketSize0;
+    rec.idVendor = from->idVendor;
+    rec.idProduct = from->idProduct;
+    rec.bNumConfigurations = from->bNumConfigurations;
+    rec.parent = usb_image_index(slots,num,from->parent);
+
+    if(from->maxchild > 0 && from->children){
+        rec.maxchild = from->maxchild;
+        rec.children = usb_image_reserve(w,from->maxchild*sizeof(uint32_t));
+        for(i=0;i<from->maxchild&&!w->failed;i++){
+            child = usb_image_index(slots,num,from->children[i]);
+            memcpy(w->data+rec.children+i*sizeof(child),&child,sizeof(child));
+        }
+    }
+    if(from->bandwidth){
+        bandwidth.allocated = from->bandwidth->allocated;
+        bandwidth.total = from->bandwidth->total;
+        bandwidth.numInterruptRequests = from->bandwidth->numInterruptRequests;
+        bandwidth.numIsocRequests = from->bandwidth->numIsocRequests;
+        rec.bandwidth = usb_image_reserve(w,sizeof(bandwidth));
+        if(!w->failed)
+            memcpy(w->data+rec.bandwidth,&bandwidth,sizeof(bandwidth));
+    }
+    rec.configs = usb_image_add_configs(w,from,&rec.nconfigs);
+
+    if(!w->failed)
+        memcpy(w->data+offset,&rec,sizeof(rec));
+}
+
+static int usb_image_write_file(const char* path,const char* data,size_t len,const char* data2,size_t len2)
+{
+    char tmp[4096];
+    ssize_t ret;
+    size_t done;
+    int fd,i;
+
+    if(snprintf(tmp,sizeof(tmp),"%s.XXXXXX",path) >= (int)sizeof(tmp))
+        return -1;
+    fd = mkstemp(tmp);
+    if(fd < 0){
+        USBIMAGE_LOG_ERROR("create %s failed!%s",tmp,strerror(errno));
+        return -1;
+    }
+
+    for(i=0;i<2;i++){
+        for(done=0;done<len;done+=ret){
+            ret = write(fd,data+done,len-done);
+            if(ret < 0 && errno == EINTR){
+                ret = 0;
+                continue;
+            }
+            if(ret <= 0){
+                USBIMAGE_LOG_ERROR("write %s failed!%s",tmp,strerror(errno));
+                close(fd);
+                unlink(tmp);
+                return -1;
+            }
+        }
+        data = data2;
+        len = len2;
+    }
+
+    /* readers see the old image or the new one, never half of it */
+    fchmod(fd,0644);
+    close(fd);
+    if(rename(tmp,path)){
+        USBIMAGE_LOG_ERROR("rename %s failed!%s",tmp,strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* root is the head of a tree, as get_usb_devices returns it */
+extern int usb_image_save(const usb_device_info* root,const char* path)
+{
+    usb_image_writer w;
+    usb_image_header header;
+    usb_image_slot *slots = NULL;
+    const usb_device_info *device;
+    uint32_t num = 0,i,devices;
+    int ret = -1;
+
+    if(!path)
+        return -1;
+    for(device=root;device;device=device->next)
+        num++;
+
+    memset(&w,0,sizeof(w));
+    /* offset 0 of the strings is NULL */
+    usb_image_add_string(&w,"");
+    usb_image_reserve(&w,sizeof(usb_image_header));
+    devices = usb_image_reserve(&w,num*sizeof(usb_image_device));
+
+    slots = (usb_image_slot*)malloc((num?num:1)*sizeof(usb_image_slot));
+    if(!slots)
+        w.failed = 1;
+    for(i=0,device=root;slots&&device;i++,device=device->next){
+        slots[i].device = device;
+        slots[i].index = i;
+    }
+    if(slots)
+        qsort(slots,num,sizeof(usb_image_slot),usb_image_slot_compare);
+
+    for(i=0,device=root;device&&!w.failed;i++,device=device->next)
+        usb_image_add_device(&w,device,slots,num,devices+i*sizeof(usb_image_device));
+
+    memset(&header,0,sizeof(header));
+    header.magic = USB_IMAGE_MAGIC;
+    header.version = USB_IMAGE_VERSION;
+    header.ndevices = num;
+    header.devices = num?devices:0;
+    header.strings = (uint32_t)USB_IMAGE_ALIGN(w.len);
+    header.nstrings = (uint32_t)w.nstrings;
+    if((uint64_t)header.strings+w.nstrings > UINT32_MAX)
+        w.failed = 1;
+    header.size = header.strings+header.nstrings;
+
+    if(!w.failed){
+        /* the padding before the strings */
+        usb_image_reserve(&w,header.strings-w.len);
+        memcpy(w.data,&header,sizeof(header));
+    }
+    if(!w.failed)
+        ret = usb_image_write_file(path,w.data,w.len,w.strings,w.nstrings);
+
+    free(slots);
+    free(w.data);
+    free(w.strings);
+    return ret;
+}
+
+extern usb_image* usb_image_open(const void* data,size_t size)
+{
+    const usb_image_header *header = (const usb_image_header*)data;
+    usb_image *image;
+
+    if(!data || size < sizeof(usb_image_header) || ((uintptr_t)data & 3))
+        return NULL;
+    if(header->magic != USB_IMAGE_MAGIC || header->version != USB_IMAGE_VERSION ||
+            header->size > size || header->size < sizeof(usb_image_header))
+        return NULL;
+    if((uint64_t)header->devices+(uint64_t)header->ndevices*sizeof(usb_image_device) > header->size ||
+            (header->devices & 3) || (header->ndevices && !header->devices))
+        return NULL;
+    if(!header->nstrings || (uint64_t)header->strings+header->nstrings > header->size ||
+            ((const char*)data)[header->strings+header->nstrings-1] != 0)
+        return NULL;
+
+    image = (usb_image*)malloc(sizeof(usb_image));
+    if(!image)
+        return NULL;
+    image->data = (const char*)data;
+    image->size = header->size;
+    image->mapped = 0;
+    return image;
+}
+
+extern usb_image* usb_image_load(const char* path)
+{
+    struct stat st;
+    usb_image *image;
+    void *data;
+    int fd;
+
+    fd = open(path,O_RDONLY|O_CLOEXEC);
+    if(fd < 0)
+        return NULL;
+    if(fstat(fd,&st) || st.st_size < (off_t)sizeof(usb_image_header)){
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if(data == MAP_FAILED){
+        USBIMAGE_LOG_ERROR("map %s failed!%s",path,strerror(errno));
+        return NULL;
+    }
+
+    image = usb_image_open(data,st.st_size);
+    if(!image){
+        USBIMAGE_LOG_ERROR("%s is not a device image!",path);
+        munmap(data,st.st_size);
+        return NULL;
+    }
+    /* unmap all of it, the file may be longer than the image */
+    image->size = st.st_size;
+    image->mapped = 1;
+    return image;
+}
+
+extern void usb_image_close(usb_image* image)
+{
+    if(!image)
+        return;
+    if(image->mapped)
+        munmap((void*)image->data,image->size);
+    free(image);
+}
+
+#define USB_IMAGE_HEADER(image)     ((const usb_image_header*)(image)->data)
+
+/* size bytes at offset, if they are in the image */
+static const void* usb_image_at(const usb_image* image,uint64_t offset,uint64_t size)
+{
+    if(!offset || offset+size > USB_IMAGE_HEADER(image)->size || (offset & 3))
+        return NULL;
+    return image->data+offset;
+}
+
+extern uint32_t usb_image_num_devices(const usb_image* image)
+{
+    return image?USB_IMAGE_HEADER(image)->ndevices:0;
+}
+
+extern const usb_image_device* usb_image_device_at(const usb_image* image,uint32_t i)
+{
+    if(!image || i >= USB_IMAGE_HEADER(image)->ndevices)
+        return NULL;
+    return (const usb_image_device*)(image->data+USB_IMAGE_HEADER(image)->devices)+i;
+}
+
+extern const usb_image_device* usb_image_find(const usb_image* image,int busnum,int devnum)
+{
+    const usb_image_device *device;
+    uint32_t i;
+
+    for(i=0;(device=usb_image_device_at(image,i));i++){
+        if(device->busnum == busnum && device->devnum == devnum)
+            return device;
+    }
+    return NULL;
+}
+
+extern const usb_image_device* usb_image_parent(const usb_image* image,const usb_image_device* device)
+{
+    if(!device || !device->parent)
+        return NULL;
+    return usb_image_device_at(image,device->parent-1);
+}
+
+extern const usb_image_device* usb_image_child(const usb_image* image,const usb_image_device* device,int i)
+{
+    const uint32_t *children;
+
+    if(!device || i < 0 || i >= device->maxchild)
+        return NULL;
+    children = (const uint32_t*)usb_image_at(image,device->children,(uint64_t)device->maxchild*sizeof(uint32_t));
+    if(!children || !children[i])
+        return NULL;
+    return usb_image_device_at(image,children[i]-1);
+}
+
+extern const usb_image_bandwidth* usb_image_bandwidth_of(const usb_image* image,const usb_image_device* device)
+{
+    if(!device)
+        return NULL;
+    return (const usb_image_bandwidth*)usb_image_at(image,device->bandwidth,sizeof(usb_image_bandwidth));
+}
+
+extern const usb_image_config* usb_image_config_at(const usb_image* image,const usb_image_device* device,int i)
+{
+    if(!device || i < 0 || (uint32_t)i >= device->nconfigs)
+        return NULL;
+    return (const usb_image_config*)usb_image_at(image,device->configs+(uint64_t)i*sizeof(usb_image_config),
+                                                  sizeof(usb_image_config));
+}
+
+extern const usb_image_interface* usb_image_interface_at(const usb_image* image,const usb_image_config* config,int i)
+{
+    if(!config || i < 0 || (uint32_t)i >= config->ninterfaces)
+        return NULL;
+    return (const usb_image_interface*)usb_image_at(image,config->interfaces+(uint64_t)i*sizeof(usb_image_interface),
+                                                     sizeof(usb_image_interface));
+}
+
+extern const usb_image_endpoint* usb_image_endpoint_at(const usb_image* image,const usb_image_interface* interface,int i)
+{
+    if(!interface || i < 0 || (uint32_t)i >= interface->nendpoints)
+        return NULL;
+    return (const usb_image_endpoint*)usb_image_at(image,interface->endpoints+(uint64_t)i*sizeof(usb_image_endpoint),
+                                                    sizeof(usb_image_endpoint));
+}
+
+extern const char* usb_image_string(const usb_image* image,uint32_t offset)
+{
+    if(!image || !offset || offset >= USB_IMAGE_HEADER(image)->nstrings)
+        return NULL;
+    return image->data+USB_IMAGE_HEADER(image)->strings+offset;
+}
@@ -0,0 +1,131 @@
+#ifndef USBIMAGE_H
+#define USBIMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "usbview.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * A device tree saved as one block that can be mapped and walked in place.
+ * Records refer to each other by offset from the start of the image, and
+ * strings by offset into its string table, so nothing has to be fixed up
+ * after loading. Offset 0 is NULL everywhere. The image is in the byte
+ * order of the machine that saved it, another one refuses to load it.
+ */
+#define USB_IMAGE_MAGIC     0x49425355u     /* "USBI" */
+#define USB_IMAGE_VERSION   2
+
+typedef struct usb_image_header {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    size;           /* of the whole image */
+    uint32_t    ndevices;
+    uint32_t    devices;        /* usb_image_device[ndevices], in list order */
+    uint32_t    strings;        /* string table */
+    uint32_t    nstrings;       /* bytes in the string table */
+    uint32_t    reserved;
+} usb_image_header;
+
+typedef struct usb_image_endpoint {
+    int32_t     in;
+    int32_t     bEndpointAddress;
+    int32_t     bmAttributes;
+    int32_t     wMaxPacketSize;
+    int32_t     bInterval;
+} usb_image_endpoint;
+
+typedef struct usb_image_interface {
+    uint32_t    driver;         /* strings */
+    uint32_t    path;
+    uint32_t    location;
+    int32_t     bInterfaceNumber;
+    int32_t     bAlternateSetting;
+    int32_t     bNumEndpoints;
+    int32_t     bInterfaceClass;
+    int32_t     bInterfaceSubClass;
+    int32_t     bInterfaceProtocol;
+    int32_t     attached;
+    uint32_t    nendpoints;
+    uint32_t    endpoints;      /* usb_image_endpoint[nendpoints] */
+} usb_image_interface;
+
+typedef struct usb_image_config {
+    int32_t     bConfigurationValue;
+    int32_t     bNumInterfaces;
+    int32_t     bmAttributes;
+    int32_t     bMaxPower;
+    uint32_t    ninterfaces;
+    uint32_t    interfaces;     /* usb_image_interface[ninterfaces] */
+} usb_image_config;
+
+typedef struct usb_image_device {
+    uint32_t    name;           /* strings */
+    uint32_t    version;
+    uint32_t    bcdDevice;
+    uint32_t    manufacturer;
+    uint32_t    product;
+    uint32_t    serial;
+    int32_t     busnum;
+    int32_t     level;
+    int32_t     portNumber;
+    int32_t     connectorNumber;
+    int32_t     devnum;
+    int32_t     speed;
+    int32_t     bDeviceClass;
+    int32_t     bDeviceSubClass;
+    int32_t     bDeviceProtocol;
+    int32_t     bMaxPacketSize0;
+    int32_t     idVendor;
+    int32_t     idProduct;
+    int32_t     bNumConfigurations;
+    int32_t     maxchild;
+    uint32_t    parent;         /* index of the parent plus one */
+    uint32_t    children;       /* uint32_t[maxchild], indexes plus one */
+    uint32_t    nconfigs;
+    uint32_t    configs;        /* usb_image_config[nconfigs] */
+    uint32_t    bandwidth;      /* usb_image_bandwidth */
+} usb_image_device;
+
+typedef struct usb_image_bandwidth {
+    int32_t     allocated;
+    int32_t     total;
+    int32_t     numInterruptRequests;
+    int32_t     numIsocRequests;
+} usb_image_bandwidth;
+
+typedef struct usb_image {
+    const char  *data;
+    size_t      size;
+    int         mapped;         /* data is a mapping of the file loaded */
+} usb_image;
+
+/* write the tree of root to path, replaced atomically; 0 on success */
+extern int usb_image_save(const usb_device_info* root,const char* path);
+/* map a saved image, NULL if it is missing or not valid */
+extern usb_image* usb_image_load(const char* path);
+/* the same for an image already in memory, which must outlive it */
+extern usb_image* usb_image_open(const void* data,size_t size);
+extern void usb_image_close(usb_image* image);
+
+/* the reader view, anything out of the image gives NULL */
+extern uint32_t usb_image_num_devices(const usb_image* image);
+extern const usb_image_device* usb_image_device_at(const usb_image* image,uint32_t i);
+/* first device with these numbers, in O(n) */
+extern const usb_image_device* usb_image_find(const usb_image* image,int busnum,int devnum);
+extern const usb_image_device* usb_image_parent(const usb_image* image,const usb_image_device* device);
+extern const usb_image_device* usb_image_child(const usb_image* image,const usb_image_device* device,int i);
+extern const usb_image_bandwidth* usb_image_bandwidth_of(const usb_image* image,const usb_image_device* device);
+extern const usb_image_config* usb_image_config_at(const usb_image* image,const usb_image_device* device,int i);
+extern const usb_image_interface* usb_image_interface_at(const usb_image* image,const usb_image_config* config,int i);
+extern const usb_image_endpoint* usb_image_endpoint_at(const usb_image* image,const usb_image_interface* interface,int i);
+extern const char* usb_image_string(const usb_image* image,uint32_t offset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // USBIMAGE_H
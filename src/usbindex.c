@@ -0,0 +1,125 @@
+#include "usbindex.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define USB_INDEX_MIN_SIZE  16
+
+static unsigned int usb_index_hash(const usb_index* index,int busnum,int devnum)
+{
+    unsigned int key = ((unsigned int)busnum<<8) ^ (unsigned int)devnum;
+
+    /* Fibonacci hashing */
+    return (key*2654435761u) & (unsigned int)(index->size-1);
+}
+
+static usb_index_slot* usb_index_find(const usb_index* index,int busnum,int devnum)
+{
+    unsigned int i;
+
+    if(!index->slots)
+        return NULL;
+
+    for(i=usb_index_hash(index,busnum,devnum);;i=(i+1)&(index->size-1)){
+        usb_index_slot* slot = &index->slots[i];
+        if(!slot->value ||
+                (slot->busnum == busnum && slot->devnum == devnum))
+            return slot;
+    }
+}
+
+static int usb_index_resize(usb_index* index,int size)
+{
+    usb_index_slot *old = index->slots;
+    int i,old_size = index->size;
+
+    index->slots = (usb_index_slot*)calloc(size,sizeof(usb_index_slot));
+    if(!index->slots){
+        index->slots = old;
+        return -1;
+    }
+    index->size = size;
+
+    for(i=0;i<old_size;i++){
+        if(old[i].value)
+            *usb_index_find(index,old[i].busnum,old[i].devnum) = old[i];
+    }
+    free(old);
+
+    return 0;
+}
+
+extern int usb_index_init(usb_index* index,int hint)
+{
+    int size = USB_INDEX_MIN_SIZE;
+
+    /* keep the load under one half */
+    while(size < hint*2)
+        size *= 2;
+
+    memset(index,0,sizeof(usb_index));
+    return usb_index_resize(index,size);
+}
+
+extern void usb_index_destroy(usb_index* index)
+{
+    free(index->slots);
+    memset(index,0,sizeof(usb_index));
+}
+
+extern void* usb_index_get(const usb_index* index,int busnum,int devnum)
+{
+    usb_index_slot* slot = usb_index_find(index,busnum,devnum);
+    return slot?slot->value:NULL;
+}
+
+extern void* usb_index_put(usb_index* index,int busnum,int devnum,void* value)
+{
+    usb_index_slot* slot;
+    void* old;
+
+    if(!value)
+        return usb_index_remove(index,busnum,devnum);
+
+    if(!index->slots || (index->used+1)*2 > index->size){
+        if(usb_index_resize(index,index->size?index->size*2:USB_INDEX_MIN_SIZE))
+            return NULL;
+    }
+
+    slot = usb_index_find(index,busnum,devnum);
+    old = slot->value;
+    if(!old)
+        index->used++;
+    slot->busnum = busnum;
+    slot->devnum = devnum;
+    slot->value = value;
+
+    return old;
+}
+
+extern void* usb_index_remove(usb_index* index,int busnum,int devnum)
+{
+    usb_index_slot *slot = usb_index_find(index,busnum,devnum);
+    unsigned int i,j,k,mask;
+    void* old;
+
+    if(!slot || !slot->value)
+        return NULL;
+
+    old = slot->value;
+    index->used--;
+
+    /* shift the following entries back, so no tombstone is needed */
+    mask = index->size-1;
+    i = slot-index->slots;
+    for(j=(i+1)&mask;index->slots[j].value;j=(j+1)&mask){
+        k = usb_index_hash(index,index->slots[j].busnum,index->slots[j].devnum);
+        /* move j to i unless its home k lies cyclically in (i,j] */
+        if((i<=j)?(i<k && k<=j):(i<k || k<=j))
+            continue;
+        index->slots[i] = index->slots[j];
+        i = j;
+    }
+    index->slots[i].value = NULL;
+
+    return old;
+}
@@ -0,0 +1,36 @@
+#ifndef USBINDEX_H
+#define USBINDEX_H
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * Open addressing hash table keyed by (busnum,devnum), linear probing.
+ * Values are owned by the caller.
+ */
+typedef struct usb_index_slot {
+    int     busnum;
+    int     devnum;
+    void    *value;     /* NULL for an empty slot */
+} usb_index_slot;
+
+typedef struct usb_index {
+    usb_index_slot  *slots;
+    int             size;   /* power of two */
+    int             used;
+} usb_index;
+
+extern int usb_index_init(usb_index* index,int hint);
+extern void usb_index_destroy(usb_index* index);
+extern void* usb_index_get(const usb_index* index,int busnum,int devnum);
+/* add or replace, return the value replaced */
+extern void* usb_index_put(usb_index* index,int busnum,int devnum,void* value);
+/* return the value removed */
+extern void* usb_index_remove(usb_index* index,int busnum,int devnum);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // USBINDEX_H
@@ -0,0 +1,139 @@
+#include "usbintern.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define USB_INTERN_MIN_SIZE 64
+
+/* strings here are a few words long, so they are hashed a word at a time */
+static unsigned int usb_intern_hash(const char* data,size_t len)
+{
+    uint64_t h = len*0x9e3779b97f4a7c15ull,w;
+
+    for(;len>=sizeof(w);len-=sizeof(w),data+=sizeof(w)){
+        memcpy(&w,data,sizeof(w));
+        h = (h^w)*0xff51afd7ed558ccdull;
+        h ^= h>>32;
+    }
+    if(len){
+        w = 0;
+        memcpy(&w,data,len);
+        h = (h^w)*0xff51afd7ed558ccdull;
+        h ^= h>>32;
+    }
+    return (unsigned int)(h^(h>>29));
+}
+
+static usb_intern_slot* usb_intern_lookup(const usb_intern* intern,const char* data,size_t len,unsigned int hash)
+{
+    unsigned int i,mask = intern->size-1;
+
+    for(i=hash&mask;;i=(i+1)&mask){
+        usb_intern_slot* slot = &intern->slots[i];
+        if(!slot->str ||
+                (slot->hash == hash && slot->len == len && memcmp(slot->str,data,len) == 0))
+            return slot;
+    }
+}
+
+static int usb_intern_resize(usb_intern* intern,int size)
+{
+    usb_intern_slot *old = intern->slots;
+    int i,old_size = intern->size;
+
+    intern->slots = (usb_intern_slot*)calloc(size,sizeof(usb_intern_slot));
+    if(!intern->slots){
+        intern->slots = old;
+        return -1;
+    }
+    intern->size = size;
+
+    for(i=0;i<old_size;i++){
+        if(old[i].str)
+            *usb_intern_lookup(intern,old[i].str,old[i].len,old[i].hash) = old[i];
+    }
+    free(old);
+
+    return 0;
+}
+
+extern int usb_intern_init(usb_intern* intern,usb_arena* arena,int hint)
+{
+    int size = USB_INTERN_MIN_SIZE;
+
+    /* keep the load under one half */
+    while(size < hint*2)
+        size *= 2;
+
+    memset(intern,0,sizeof(usb_intern));
+    intern->arena = arena;
+    return usb_intern_resize(intern,size);
+}
+
+extern void usb_intern_destroy(usb_intern* intern)
+{
+    free(intern->slots);
+    memset(intern,0,sizeof(usb_intern));
+}
+
+/* the slot of data, ready to be filled if it is empty */
+static usb_intern_slot* usb_intern_slot_for(usb_intern* intern,const char* data,size_t len,unsigned int hash)
+{
+    if(!intern->slots || (intern->used+1)*2 > intern->size){
+        if(usb_intern_resize(intern,intern->size?intern->size*2:USB_INTERN_MIN_SIZE))
+            return NULL;
+    }
+    return usb_intern_lookup(intern,data,len,hash);
+}
+
+/* the copy of data, data itself or a new one as copy says if there is none */
+static const char* usb_intern_put(usb_intern* intern,const char* data,size_t len,int copy)
+{
+    unsigned int hash = usb_intern_hash(data,len);
+    usb_intern_slot* slot;
+    const char* str = data;
+
+    /* most strings are there already, which needs no room */
+    if(intern->slots){
+        slot = usb_intern_lookup(intern,data,len,hash);
+        if(slot->str)
+            return slot->str;
+    }
+
+    slot = usb_intern_slot_for(intern,data,len,hash);
+    if(!slot)
+        return NULL;
+    if(copy && !(str = usb_arena_strndup(intern->arena,data,len)))
+        return NULL;
+    slot->str = str;
+    slot->hash = hash;
+    slot->len = len;
+    intern->used++;
+
+    return str;
+}
+
+extern const char* usb_intern_strn(usb_intern* intern,const char* data,size_t len)
+{
+    return usb_intern_put(intern,data,len,1);
+}
+
+extern const char* usb_intern_str(usb_intern* intern,const char* str)
+{
+    return str?usb_intern_put(intern,str,strlen(str),1):NULL;
+}
+
+extern const char* usb_intern_keep(usb_intern* intern,const char* data,size_t len)
+{
+    return usb_intern_put(intern,data,len,0);
+}
+
+extern const char* usb_intern_find(const usb_intern* intern,const char* str)
+{
+    size_t len;
+
+    if(!str || !intern->slots)
+        return NULL;
+    len = strlen(str);
+    return usb_intern_lookup(intern,str,len,usb_intern_hash(str,len))->str;
+}
@@ -0,0 +1,46 @@
+#ifndef USBINTERN_H
+#define USBINTERN_H
+
+#include <stddef.h>
+#include "usbarena.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * One copy of every string put in, so that equal strings are the same
+ * pointer. The copies are made in an arena and live as long as it does;
+ * the table itself is open addressing with linear probing.
+ */
+typedef struct usb_intern_slot {
+    const char      *str;       /* NULL for an empty slot */
+    unsigned int    hash;
+    unsigned int    len;
+} usb_intern_slot;
+
+typedef struct usb_intern {
+    usb_intern_slot *slots;
+    usb_arena       *arena;     /* where the copies are made */
+    int             size;       /* power of two */
+    int             used;
+} usb_intern;
+
+extern int usb_intern_init(usb_intern* intern,usb_arena* arena,int hint);
+extern void usb_intern_destroy(usb_intern* intern);
+/* the copy of data[0,len), made on first use; NULL if out of memory */
+extern const char* usb_intern_strn(usb_intern* intern,const char* data,size_t len);
+extern const char* usb_intern_str(usb_intern* intern,const char* str);
+/*
+ * the same, but data itself becomes the copy if there is none yet: it must
+ * be terminated at len and live as long as the table, like a literal
+ */
+extern const char* usb_intern_keep(usb_intern* intern,const char* data,size_t len);
+/* the copy of str if there is one, nothing is added */
+extern const char* usb_intern_find(const usb_intern* intern,const char* str);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // USBINTERN_H
@@ -0,0 +1,282 @@
+#include "usbscan.h"
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USB_SCAN_X86
+#include <immintrin.h>
+#endif
+
+typedef struct usb_scan_kernels {
+    const char  *name;
+    int         (*supported)(void);
+    const char* (*line)(const char* p,const char* end);
+    int         (*fields)(const char* line,unsigned short* pos,int max,size_t* len);
+} usb_scan_kernels;
+
+#define USB_SCAN_CTZ(m)     __builtin_ctz(m)
+
+/* the bits of the '=' in m, up to the terminator in z if there is one */
+#define USB_SCAN_STORE(m,z,i,pos,max,n)     do{     \
+        if(z)                                       \
+            m &= (z&-z)-1;                          \
+        for(;m;m &= m-1,n++){                       \
+            if(n < max)                             \
+                pos[n] = (i)+USB_SCAN_CTZ(m);       \
+        }                                           \
+    }while(0)
+
+/**********************scalar****************************************/
+
+static int usb_scan_scalar_supported(void)
+{
+    return 1;
+}
+
+static const char* usb_scan_line_scalar(const char* p,const char* end)
+{
+    for(;p < end && *p != '\n';++p);
+    return p;
+}
+
+static int usb_scan_fields_scalar(const char* line,unsigned short* pos,int max,size_t* len)
+{
+    size_t i;
+    int n = 0;
+
+    for(i=0;line[i];i++){
+        if(line[i] == '='){
+            if(n < max)
+                pos[n] = i;
+            n++;
+        }
+    }
+    *len = i;
+    return n;
+}
+
+#ifdef USB_SCAN_X86
+/**********************sse2****************************************/
+
+static int usb_scan_sse2_supported(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("sse2")))
+static const char* usb_scan_line_sse2(const char* p,const char* end)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    unsigned int m;
+
+    for(;end-p >= 16;p += 16){
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p),nl));
+        if(m)
+            return p+USB_SCAN_CTZ(m);
+    }
+    return usb_scan_line_scalar(p,end);
+}
+
+__attribute__((target("sse2")))
+static int usb_scan_fields_sse2(const char* line,unsigned short* pos,int max,size_t* len)
+{
+    const __m128i eq = _mm_set1_epi8('='),zero = _mm_setzero_si128();
+    __m128i v;
+    unsigned int m,z;
+    size_t i;
+    int n = 0;
+
+    for(i=0;;i+=16){
+        v = _mm_loadu_si128((const __m128i*)(line+i));
+        z = _mm_movemask_epi8(_mm_cmpeq_epi8(v,zero));
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(v,eq));
+        USB_SCAN_STORE(m,z,i,pos,max,n);
+        if(z){
+            *len = i+USB_SCAN_CTZ(z);
+            return n;
+        }
+    }
+}
+
+/**********************avx2****************************************/
+
+static int usb_scan_avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static const char* usb_scan_line_avx2(const char* p,const char* end)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    unsigned int m;
+
+    for(;end-p >= 32;p += 32){
+        m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p),nl));
+        if(m)
+            return p+USB_SCAN_CTZ(m);
+    }
+    return usb_scan_line_sse2(p,end);
+}
+
+__attribute__((target("avx2")))
+static int usb_scan_fields_avx2(const char* line,unsigned short* pos,int max,size_t* len)
+{
+    const __m256i eq = _mm256_set1_epi8('='),zero = _mm256_setzero_si256();
+    __m256i v;
+    unsigned int m,z;
+    size_t i;
+    int n = 0;
+
+    for(i=0;;i+=32){
+        v = _mm256_loadu_si256((const __m256i*)(line+i));
+        z = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v,zero));
+        m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v,eq));
+        USB_SCAN_STORE(m,z,i,pos,max,n);
+        if(z){
+            *len = i+USB_SCAN_CTZ(z);
+            return n;
+        }
+    }
+}
+#endif
+
+/**********************dispatch****************************************/
+
+/* the best first */
+static const usb_scan_kernels usb_scan_all[] = {
+#ifdef USB_SCAN_X86
+    {"avx2",    usb_scan_avx2_supported,    usb_scan_line_avx2,     usb_scan_fields_avx2},
+    {"sse2",    usb_scan_sse2_supported,    usb_scan_line_sse2,     usb_scan_fields_sse2},
+#endif
+    {"scalar",  usb_scan_scalar_supported,  usb_scan_line_scalar,   usb_scan_fields_scalar},
+};
+
+#define USB_SCAN_NUM    ((int)(sizeof(usb_scan_all)/sizeof(usb_scan_all[0])))
+
+static const usb_scan_kernels *usb_scan_current = NULL;
+static pthread_once_t usb_scan_once = PTHREAD_ONCE_INIT;
+
+static void usb_scan_select(void)
+{
+    int i;
+
+#ifdef USB_SCAN_X86
+    __builtin_cpu_init();
+#endif
+    for(i=0;i<USB_SCAN_NUM-1 && !usb_scan_all[i].supported();i++);
+    __atomic_store_n(&usb_scan_current,&usb_scan_all[i],__ATOMIC_RELEASE);
+}
+
+static const usb_scan_kernels* usb_scan_kernels_get(void)
+{
+    pthread_once(&usb_scan_once,usb_scan_select);
+    return __atomic_load_n(&usb_scan_current,__ATOMIC_ACQUIRE);
+}
+
+extern int usb_scan_use(const char* kernel)
+{
+    int i;
+
+    pthread_once(&usb_scan_once,usb_scan_select);
+    for(i=0;i<USB_SCAN_NUM;i++){
+        if(strcmp(usb_scan_all[i].name,kernel) == 0 && usb_scan_all[i].supported()){
+            __atomic_store_n(&usb_scan_current,&usb_scan_all[i],__ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+extern const char* usb_scan_kernel(void)
+{
+    return usb_scan_kernels_get()->name;
+}
+
+extern const char* usb_scan_line(const char* p,const char* end)
+{
+    return usb_scan_kernels_get()->line(p,end);
+}
+
+extern int usb_scan_fields(const char* line,unsigned short* pos,int max,size_t* len)
+{
+    return usb_scan_kernels_get()->fields(line,pos,max,len);
+}
+
+/**********************numbers****************************************/
+
+#define SWAR_ONES           0x0101010101010101ull
+#define SWAR_HIGH           0x8080808080808080ull
+
+/* the high bit of every byte of w in [lo,hi], without carries between bytes */
+#define SWAR_IN(w,lo,hi)    ((((w)|SWAR_HIGH)-(lo)*SWAR_ONES) & \
+                             (((hi)*SWAR_ONES|SWAR_HIGH)-((w)&~SWAR_HIGH)) & ~(w) & SWAR_HIGH)
+
+static const char* usb_scan_int_scalar(const char* p,int base,int* value)
+{
+    int v = 0,d;
+
+    for(;;++p){
+        if(*p>='0' && *p<='9')
+            d = *p-'0';
+        else if(base == 16 && (*p|0x20)>='a' && (*p|0x20)<='f')
+            d = (*p|0x20)-'a'+10;
+        else
+            break;
+        v = v*base+d;
+    }
+    *value = v;
+    return p;
+}
+
+/*
+ * Fields are a few digits wide, so the digits are found and summed in one
+ * 64 bit word: the digits are moved to the top of the word and added up
+ * pairwise, then in fours, then in eights.
+ */
+extern const char* usb_scan_int(const char* p,int base,int* value)
+{
+    uint64_t w,digits;
+    int n,neg = 0;
+
+    for(;*p==' ';++p);
+    if(*p == '-'){
+        neg = 1;
+        ++p;
+    }
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(&w,p,sizeof(w));
+    digits = SWAR_IN(w,'0','9');
+    if(base == 16)
+        digits |= SWAR_IN(w|0x20*SWAR_ONES,'a','f');
+    digits = ~digits & SWAR_HIGH;
+    n = digits?__builtin_ctzll(digits)>>3:8;
+    /* longer numbers are left to the loop */
+    if(n < 8){
+        if(n == 0){
+            *value = 0;
+            return p;
+        }
+        w = (w & 0x0f*SWAR_ONES) + ((w>>6) & SWAR_ONES)*9;
+        w <<= 8*(8-n);
+        if(base == 16){
+            w = ((w<<4)|(w>>8)) & 0x00ff00ff00ff00ffull;
+            w = ((w<<8)|(w>>16)) & 0x0000ffff0000ffffull;
+            w = ((w<<16)|(w>>32)) & 0xffffffffull;
+        }else{
+            w = (w*10+(w>>8)) & 0x00ff00ff00ff00ffull;
+            w = (w*100+(w>>16)) & 0x0000ffff0000ffffull;
+            w = (w*10000+(w>>32)) & 0xffffffffull;
+        }
+        *value = neg?-(int)w:(int)w;
+        return p+n;
+    }
+#endif
+
+    p = usb_scan_int_scalar(p,base,value);
+    if(neg)
+        *value = -*value;
+    return p;
+}
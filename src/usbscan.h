@@ -0,0 +1,38 @@
+#ifndef USBSCAN_H
+#define USBSCAN_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * Kernels that find the structure of the usb/devices text: line ends and
+ * the '=' of every field, 16 or 32 bytes at a time where the cpu can. The
+ * best the cpu has is picked on first use, see usb_scan_use.
+ *
+ * The kernels load whole blocks, so up to USB_SCAN_PADDING bytes past the
+ * end of the text they are given must be readable.
+ */
+#define USB_SCAN_PADDING    32
+
+/* the first '\n' in [p,end), or end */
+extern const char* usb_scan_line(const char* p,const char* end);
+/*
+ * offsets of the '=' of the terminated line, the first max of them; the
+ * count of all of them, and in *len the length of the line
+ */
+extern int usb_scan_fields(const char* line,unsigned short* pos,int max,size_t* len);
+/* a number in base 10 or 16 after spaces and a sign, like strtol; where it stops */
+extern const char* usb_scan_int(const char* p,int base,int* value);
+
+/* "avx2", "sse2" or "scalar"; -1 if the cpu has no such kernel */
+extern int usb_scan_use(const char* kernel);
+extern const char* usb_scan_kernel(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // USBSCAN_H
@@ -0,0 +1,342 @@
+#include "usbtable.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define USB_TABLE_ALIGN(n)      (((n)+7)&~(size_t)7)
+
+/* rows are matched a block at a time: one pass over the columns, then the hits are gathered */
+#define USB_TABLE_BLOCK         256
+#define BLOCKS(n)               (((n)+USB_TABLE_BLOCK-1)/USB_TABLE_BLOCK*USB_TABLE_BLOCK)
+
+/* deeper than the tiers usb allows, so that a loop in the parents ends */
+#define USB_TABLE_MAX_DEPTH     8
+
+/* a device and its index in the list, sorted by address to find parents */
+typedef struct usb_table_slot {
+    const usb_device_info   *device;
+    uint32_t                index;
+} usb_table_slot;
+
+static int usb_table_slot_compare(const void* a,const void* b)
+{
+    const usb_device_info *x = ((const usb_table_slot*)a)->device,*y = ((const usb_table_slot*)b)->device;
+
+    return x<y?-1:x>y;
+}
+
+static int32_t usb_table_index(const usb_table_slot* slots,uint32_t num,const usb_device_info* device)
+{
+    usb_table_slot key,*slot;
+
+    if(!device || !slots)
+        return -1;
+    key.device = device;
+    slot = (usb_table_slot*)bsearch(&key,slots,num,sizeof(usb_table_slot),usb_table_slot_compare);
+    return slot?(int32_t)slot->index:-1;
+}
+
+/*
+ * the offset of every column after the header; with base, point the columns
+ * there. The columns are whole blocks long, so that a query never has a short one.
+ */
+static size_t usb_table_columns(usb_table* t,char* base)
+{
+    size_t off = USB_TABLE_ALIGN(sizeof(usb_table));
+    uint32_t nd = BLOCKS(t->ndevices),ni = BLOCKS(t->ninterfaces);
+
+#define COLUMN(field,num)   do{                                     \
+        if(base)                                                    \
+            t->field = (void*)(base+off);                           \
+        off += USB_TABLE_ALIGN((size_t)(num)*sizeof(*t->field));    \
+    }while(0)
+
+    COLUMN(busnum,nd);
+    COLUMN(devnum,nd);
+    COLUMN(vendor,nd);
+    COLUMN(product,nd);
+    COLUMN(device_class,nd);
+    COLUMN(device_subclass,nd);
+    COLUMN(device_protocol,nd);
+    COLUMN(level,nd);
+    COLUMN(speed,nd);
+    COLUMN(parent,nd);
+    COLUMN(first_interface,nd+1);
+    COLUMN(device,nd);
+
+    COLUMN(interface_device,ni);
+    COLUMN(interface_vendor,ni);
+    COLUMN(interface_product,ni);
+    COLUMN(interface_config,ni);
+    COLUMN(interface_number,ni);
+    COLUMN(interface_alt,ni);
+    COLUMN(interface_class,ni);
+    COLUMN(interface_subclass,ni);
+    COLUMN(interface_protocol,ni);
+    COLUMN(driver,ni);
+    COLUMN(first_endpoint,ni+1);
+    COLUMN(interface,ni);
+
+    COLUMN(endpoint_interface,t->nendpoints);
+    COLUMN(endpoint_address,t->nendpoints);
+    COLUMN(endpoint_attributes,t->nendpoints);
+    COLUMN(endpoint_max_packet,t->nendpoints);
+    COLUMN(endpoint_interval,t->nendpoints);
+
+#undef COLUMN
+    return off;
+}
+
+/* the interfaces of every config, as the rest of the table walks them */
+#define FOR_INTERFACES(device,i,j,interface)                                                \
+    for(i=0;device->config && i<device->bNumConfigurations && device->config[i];i++)        \
+        for(j=0;device->config[i]->interfaces && j<device->config[i]->bNumInterfaces &&     \
+                (interface = device->config[i]->interfaces[j]);j++)
+
+#define FOR_ENDPOINTS(interface,k,endpoint)                                                 \
+    for(k=0;interface->endpoint && k<interface->bNumEndpoints &&                            \
+            (endpoint = interface->endpoint[k]);k++)
+
+extern usb_table* usb_table_build(const usb_device_info* root)
+{
+    const usb_device_info *device;
+    const usb_device_interface *interface;
+    const usb_device_endpoint *endpoint;
+    usb_table_slot *slots;
+    usb_table counts,*t;
+    uint32_t d,n,e;
+    size_t size;
+    int i,j,k;
+
+    memset(&counts,0,sizeof(counts));
+    for(device=root;device;device=device->next){
+        counts.ndevices++;
+        FOR_INTERFACES(device,i,j,interface){
+            counts.ninterfaces++;
+            FOR_ENDPOINTS(interface,k,endpoint)
+                counts.nendpoints++;
+        }
+    }
+
+    size = usb_table_columns(&counts,NULL);
+    t = (usb_table*)malloc(size);
+    slots = (usb_table_slot*)malloc((counts.ndevices?counts.ndevices:1)*sizeof(usb_table_slot));
+    if(!t || !slots){
+        free(t);
+        free(slots);
+        return NULL;
+    }
+    /* the padding of the columns is tested too, though never gathered */
+    memset(t,0,size);
+    *t = counts;
+    usb_table_columns(t,(char*)t);
+
+    for(d=0,device=root;device;d++,device=device->next){
+        slots[d].device = device;
+        slots[d].index = d;
+    }
+    qsort(slots,counts.ndevices,sizeof(usb_table_slot),usb_table_slot_compare);
+
+    for(d=0,n=0,e=0,device=root;device;d++,device=device->next){
+        t->busnum[d] = device->busnum;
+        t->devnum[d] = device->devnum;
+        t->vendor[d] = device->idVendor;
+        t->product[d] = device->idProduct;
+        t->device_class[d] = device->bDeviceClass;
+        t->device_subclass[d] = device->bDeviceSubClass;
+        t->device_protocol[d] = device->bDeviceProtocol;
+        t->level[d] = device->level;
+        t->speed[d] = device->speed;
+        t->parent[d] = usb_table_index(slots,counts.ndevices,device->parent);
+        t->first_interface[d] = n;
+        t->device[d] = device;
+
+        FOR_INTERFACES(device,i,j,interface){
+            t->interface_device[n] = d;
+            t->interface_vendor[n] = device->idVendor;
+            t->interface_product[n] = device->idProduct;
+            t->interface_config[n] = device->config[i]->bConfigurationValue;
+            t->interface_number[n] = interface->bInterfaceNumber;
+            t->interface_alt[n] = interface->bAlternateSetting;
+            t->interface_class[n] = interface->bInterfaceClass;
+            t->interface_subclass[n] = interface->bInterfaceSubClass;
+            t->interface_protocol[n] = interface->bInterfaceProtocol;
+            t->driver[n] = interface->driver;
+            t->first_endpoint[n] = e;
+            t->interface[n] = interface;
+
+            FOR_ENDPOINTS(interface,k,endpoint){
+                t->endpoint_interface[e] = n;
+                t->endpoint_address[e] = endpoint->bEndpointAddress;
+                t->endpoint_attributes[e] = endpoint->bmAttributes;
+                t->endpoint_max_packet[e] = endpoint->wMaxPacketSize;
+                t->endpoint_interval[e] = endpoint->bInterval;
+                e++;
+            }
+            n++;
+        }
+    }
+    t->first_interface[d] = n;
+    t->first_endpoint[n] = e;
+
+    free(slots);
+    return t;
+}
+
+extern void usb_table_free(usb_table* table)
+{
+    free(table);
+}
+
+/*********************queries****************************************/
+
+/*
+ * A block of rows is tested one column at a time, each pass a loop of a
+ * fixed length the compiler can vectorize, and only the columns a rule
+ * names are read. The rows past the end are tested too, and not gathered.
+ */
+static void usb_table_test8(uint8_t* restrict hit,const uint8_t* restrict column,int value)
+{
+    uint32_t i;
+
+    for(i=0;i<USB_TABLE_BLOCK;i++)
+        hit[i] &= column[i] == value;
+}
+
+static void usb_table_test16(uint8_t* restrict hit,const uint16_t* restrict column,int value)
+{
+    uint32_t i;
+
+    for(i=0;i<USB_TABLE_BLOCK;i++)
+        hit[i] &= column[i] == value;
+}
+
+static void usb_table_test_string(uint8_t* restrict hit,const char* const* restrict column,const char* value)
+{
+    uint32_t i;
+
+    for(i=0;i<USB_TABLE_BLOCK;i++)
+        hit[i] &= column[i] == value;
+}
+
+/* the column of the device of every row, a gather */
+static void usb_table_test_device16(uint8_t* restrict hit,const uint32_t* restrict device,
+                                    const uint16_t* restrict column,int value)
+{
+    uint32_t i;
+
+    for(i=0;i<USB_TABLE_BLOCK;i++)
+        hit[i] &= column[device[i]] == value;
+}
+
+/* the rows of a block with a hit, from base, appended to out */
+static uint32_t usb_table_gather(const uint8_t* hit,uint32_t len,uint32_t base,
+                                 uint32_t* out,uint32_t max,uint32_t count)
+{
+    uint32_t i;
+
+    /* with room for the whole block, every row is written and only hits advance */
+    if(count+len <= max){
+        for(i=0;i<len;i++){
+            out[count] = base+i;
+            count += hit[i];
+        }
+        return count;
+    }
+    for(i=0;i<len;i++){
+        if(hit[i]){
+            if(count < max)
+                out[count] = base+i;
+            count++;
+        }
+    }
+    return count;
+}
+
+#define BLOCK_LEN(num,base)     ((num)-(base)<USB_TABLE_BLOCK?(num)-(base):USB_TABLE_BLOCK)
+
+/* a rule on a column, none for -1; a value out of range of the column is never there */
+#define TEST(bits,hit,column,value) do{                                     \
+        if((value) > UINT##bits##_MAX)                                      \
+            memset(hit,0,sizeof(hit));                                      \
+        else if((value) >= 0)                                               \
+            usb_table_test##bits(hit,column,value);                         \
+    }while(0)
+
+extern uint32_t usb_table_match_devices(const usb_table* table,const usb_table_match* match,uint32_t* out,uint32_t max)
+{
+    uint8_t hit[USB_TABLE_BLOCK];
+    uint32_t base,len,count = 0;
+
+    for(base=0;base<table->ndevices;base+=len){
+        len = BLOCK_LEN(table->ndevices,base);
+        memset(hit,1,sizeof(hit));
+        TEST(16,hit,table->vendor+base,match->vendor_id);
+        TEST(16,hit,table->product+base,match->product_id);
+        TEST(8,hit,table->device_class+base,match->class_code);
+        TEST(8,hit,table->device_subclass+base,match->subclass);
+        TEST(8,hit,table->device_protocol+base,match->protocol);
+        TEST(16,hit,table->busnum+base,match->busnum);
+        count = usb_table_gather(hit,len,base,out,max,count);
+    }
+    return count;
+}
+
+extern uint32_t usb_table_match_interfaces(const usb_table* table,const usb_table_match* match,uint32_t* out,uint32_t max)
+{
+    uint8_t hit[USB_TABLE_BLOCK];
+    uint32_t base,len,count = 0;
+
+    for(base=0;base<table->ninterfaces;base+=len){
+        len = BLOCK_LEN(table->ninterfaces,base);
+        memset(hit,1,sizeof(hit));
+        TEST(16,hit,table->interface_vendor+base,match->vendor_id);
+        TEST(16,hit,table->interface_product+base,match->product_id);
+        TEST(8,hit,table->interface_class+base,match->class_code);
+        TEST(8,hit,table->interface_subclass+base,match->subclass);
+        TEST(8,hit,table->interface_protocol+base,match->protocol);
+        /* the bus is only kept per device */
+        if(match->busnum > UINT16_MAX)
+            memset(hit,0,sizeof(hit));
+        else if(match->busnum >= 0)
+            usb_table_test_device16(hit,table->interface_device+base,table->busnum,match->busnum);
+        count = usb_table_gather(hit,len,base,out,max,count);
+    }
+    return count;
+}
+
+extern uint32_t usb_table_devices_under(const usb_table* table,uint32_t hub,uint32_t* out,uint32_t max)
+{
+    uint8_t hit[USB_TABLE_BLOCK];
+    uint32_t base,len,i,count = 0;
+    int32_t p;
+    int depth;
+
+    if(hub >= table->ndevices)
+        return 0;
+
+    for(base=0;base<table->ndevices;base+=len){
+        len = BLOCK_LEN(table->ndevices,base);
+        for(i=0;i<len;i++){
+            p = table->parent[base+i];
+            for(depth=0;p >= 0 && (uint32_t)p != hub && depth < USB_TABLE_MAX_DEPTH;depth++)
+                p = table->parent[p];
+            hit[i] = p >= 0 && (uint32_t)p == hub;
+        }
+        count = usb_table_gather(hit,len,base,out,max,count);
+    }
+    return count;
+}
+
+extern uint32_t usb_table_interfaces_by_driver(const usb_table* table,const char* driver,uint32_t* out,uint32_t max)
+{
+    uint8_t hit[USB_TABLE_BLOCK];
+    uint32_t base,len,count = 0;
+
+    for(base=0;base<table->ninterfaces;base+=len){
+        len = BLOCK_LEN(table->ninterfaces,base);
+        memset(hit,1,sizeof(hit));
+        usb_table_test_string(hit,table->driver+base,driver);
+        count = usb_table_gather(hit,len,base,out,max,count);
+    }
+    return count;
+}
@@ -0,0 +1,92 @@
+#ifndef USBTABLE_H
+#define USBTABLE_H
+
+#include <stdint.h>
+#include "usbview.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * An enumeration as parallel arrays, one column per field, for rules that
+ * look at every device or interface. Devices are in list order, the
+ * interfaces of all configs of device i are [first_interface[i],
+ * first_interface[i+1]) and the endpoints of interface j are
+ * [first_endpoint[j],first_endpoint[j+1]). The table is a copy, it does
+ * not change with the tree, but the pointers back into the tree are only
+ * good while the tree is.
+ */
+typedef struct usb_table {
+    uint32_t                    ndevices;
+    uint16_t                    *busnum;
+    uint16_t                    *devnum;
+    uint16_t                    *vendor;
+    uint16_t                    *product;
+    uint8_t                     *device_class;
+    uint8_t                     *device_subclass;
+    uint8_t                     *device_protocol;
+    uint8_t                     *level;
+    uint16_t                    *speed;         /* Mbps, 1 for 1.5 */
+    int32_t                     *parent;        /* index, -1 for none */
+    uint32_t                    *first_interface;
+    const usb_device_info       **device;
+
+    uint32_t                    ninterfaces;
+    uint32_t                    *interface_device;  /* index of the device */
+    uint16_t                    *interface_vendor;  /* of the device, to match without a gather */
+    uint16_t                    *interface_product;
+    uint8_t                     *interface_config;  /* bConfigurationValue */
+    uint8_t                     *interface_number;
+    uint8_t                     *interface_alt;
+    uint8_t                     *interface_class;
+    uint8_t                     *interface_subclass;
+    uint8_t                     *interface_protocol;
+    const char                  **driver;           /* interned, see usb_find_string */
+    uint32_t                    *first_endpoint;
+    const usb_device_interface  **interface;
+
+    uint32_t                    nendpoints;
+    uint32_t                    *endpoint_interface;
+    uint8_t                     *endpoint_address;  /* bit 7 set for in */
+    uint8_t                     *endpoint_attributes;
+    uint16_t                    *endpoint_max_packet;
+    uint16_t                    *endpoint_interval;
+} usb_table;
+
+/*
+ * What a row must have, -1 for any value. For interfaces the class is
+ * that of the interface, the ids are those of its device.
+ */
+typedef struct usb_table_match {
+    int     vendor_id;
+    int     product_id;
+    int     class_code;
+    int     subclass;
+    int     protocol;
+    int     busnum;
+} usb_table_match;
+
+#define USB_TABLE_MATCH_ANY     {-1,-1,-1,-1,-1,-1}
+
+/* one block for the whole table, NULL if out of memory */
+extern usb_table* usb_table_build(const usb_device_info* root);
+extern void usb_table_free(usb_table* table);
+
+/*
+ * The queries write the indexes of the rows found to out, up to max of
+ * them, and return how many there are in all. "All HID interfaces" is a
+ * match with class_code 3 given to usb_table_match_interfaces.
+ */
+extern uint32_t usb_table_match_devices(const usb_table* table,const usb_table_match* match,uint32_t* out,uint32_t max);
+extern uint32_t usb_table_match_interfaces(const usb_table* table,const usb_table_match* match,uint32_t* out,uint32_t max);
+/* the devices behind hub, at any depth */
+extern uint32_t usb_table_devices_under(const usb_table* table,uint32_t hub,uint32_t* out,uint32_t max);
+/* the interfaces whose driver is this one, a string of the tree from usb_find_string */
+extern uint32_t usb_table_interfaces_by_driver(const usb_table* table,const char* driver,uint32_t* out,uint32_t max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // USBTABLE_H
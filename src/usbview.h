@@ -1,6 +1,8 @@
 #ifndef USBVIEW_C
 #define USBVIEW_C
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C"{
 #endif
@@ -112,14 +114,15 @@ typedef struct usb_device_endpoint {
 
 typedef struct usb_device_interface {
     char	*driver;
-    char    *path;
+    char    *path;          /* node under /dev, NULL until usb_interface_path found it */
+    char    *location;      /* directory of the interface under sysfs */
     int		bInterfaceNumber;
     int		bAlternateSetting;
     int		bNumEndpoints;
     int     bInterfaceClass;
     int		bInterfaceSubClass;
     int		bInterfaceProtocol;
-    usb_device_endpoint	**endpoint;
+    usb_device_endpoint	**endpoint;     /* NULL if none was read */
     int     attached;
 } usb_device_interface;
 
@@ -167,7 +170,7 @@ typedef struct usb_device_info {
     char	*serial;
 
     int		bNumConfigurations;
-    usb_device_config	**config;
+    usb_device_config	**config;       /* NULL if none was read, see get_usb_devices_ex */
 
     // for usb device except hub
     struct usb_device_info	*parent;
@@ -178,10 +181,117 @@ typedef struct usb_device_info {
     usb_device_bandwidth	*bandwidth;
 
     struct usb_device_info* next;
+
+    // enumeration the device belongs to
+    struct usb_device_tree	*tree;
 } usb_device_info;
 
+/* what an enumeration reads beyond the topology, the ids and the classes */
+enum usb_enum_flags {
+    USB_ENUM_STRINGS    = 0x01,     /* manufacturer, product and serial */
+    USB_ENUM_INTERFACES = 0x02,     /* configs, interfaces and their drivers */
+    USB_ENUM_ENDPOINTS  = 0x04,     /* implies USB_ENUM_INTERFACES */
+    USB_ENUM_DEVPATH    = 0x08,     /* locations of the interfaces, implies USB_ENUM_INTERFACES */
+    USB_ENUM_BANDWIDTH  = 0x10,     /* only the text dump has it */
+    USB_ENUM_ALL        = 0x1f
+};
+
+/* which devices an enumeration reads fully, see get_usb_devices_filtered */
+typedef struct usb_device_filter {
+    int     vendor_id;      /* both 0 for any device */
+    int     product_id;
+    int     class_code;     /* class of the interfaces whose nodes are found, -1 for any */
+} usb_device_filter;
+
+/* from the text dump where the kernel has one, from sysfs otherwise */
 extern usb_device_info* get_usb_devices();
+/*
+ * flags are USB_ENUM_*, 0 is a scan of the topology only. Without
+ * USB_ENUM_INTERFACES, or for a device the filter rejects, config is NULL
+ * whatever bNumConfigurations says, and without USB_ENUM_ENDPOINTS so is
+ * endpoint; entries past the last one read are NULL too.
+ */
+extern usb_device_info* get_usb_devices_ex(int flags);
+extern usb_device_info* get_usb_devices_filtered(const usb_device_filter* filter,int flags);
+/* the node of an interface of device, looked for once and kept in its tree */
+extern const char* usb_interface_path(usb_device_info* device,usb_device_interface* interface);
+/* the same for a location alone, the path returned must be freed */
+extern char* usb_resolve_path(const char* location);
+/*
+ * the roots every enumeration reads when it is given none, NULL for /sys
+ * and /dev; for fake trees, set before any enumeration and kept alive
+ */
+extern void usb_set_default_roots(const char* sysfs_root,const char* dev_root);
+/* build the tree from sysfs, NULL roots mean the default ones */
+extern usb_device_info* get_usb_devices_sysfs(const char* sysfs_root,const char* dev_root);
+/* the same, reading devices on up to workers threads, 0 for one per cpu */
+extern usb_device_info* get_usb_devices_parallel(const char* sysfs_root,const char* dev_root,int workers);
+/* parse a dump in the format of /proc/bus/usb/devices */
+extern usb_device_info* get_usb_devices_file(const char* file);
+/* one device from the descriptors attribute of sysfs, speed in Mbps */
+extern usb_device_info* get_usb_device_descriptors(const void* data,size_t len,int speed);
+/* a string descriptor as utf-8 into out, the length or -1 */
+extern int usb_decode_string(const void* desc,size_t len,char* out,size_t size);
+
+/* what a callback of a visitor returns */
+enum usb_visit_action {
+    USB_VISIT_CONTINUE  = 0,
+    USB_VISIT_SKIP      = 1,        /* nothing more of this device */
+    USB_VISIT_STOP      = 2         /* nothing more at all */
+};
+
+/*
+ * Callbacks for an enumeration that builds no tree, any of them NULL. What
+ * they are given is only good during the call: it lives on the stack of the
+ * enumeration, without parent, children, configs, interfaces or endpoints,
+ * which come as calls of their own. The name of a device is its name under
+ * sysfs. Levels no callback is there for are not read, so a visitor with
+ * on_device alone reads no configs at all.
+ */
+typedef struct usb_visitor {
+    int     (*on_device)(void* ctx,const usb_device_info* device);
+    int     (*on_config)(void* ctx,const usb_device_info* device,const usb_device_config* config);
+    int     (*on_interface)(void* ctx,const usb_device_info* device,const usb_device_config* config,
+                            const usb_device_interface* interface);
+    int     (*on_endpoint)(void* ctx,const usb_device_info* device,const usb_device_interface* interface,
+                           const usb_device_endpoint* endpoint);
+    int     flags;          /* USB_ENUM_*, what is read */
+} usb_visitor;
+
+/*
+ * Visit every device with no allocation and constant memory, 0 once all
+ * are visited, USB_VISIT_STOP if a callback stopped, -1 if there is nothing
+ * to read. Devices come in the order sysfs lists them.
+ */
+extern int usb_enumerate_visit(const usb_visitor* visitor,void* ctx);
+/* the same for a dump in the format of /proc/bus/usb/devices, in its order */
+extern int usb_enumerate_visit_file(const char* file,const usb_visitor* visitor,void* ctx);
+/* sysfs names of devices, like "usb1" or "1-1.2", in the order of the text dump */
+extern int usb_compare_device_names(const char* a,const char* b);
+/*
+ * Drivers, manufacturers, products and versions are kept once per
+ * enumeration, equal ones are the same pointer. This is the one equal to
+ * str, NULL if no device has it: usb_find_string(root,"usbhid") once, and
+ * then driver == hid for every interface.
+ */
+extern const char* usb_find_string(const usb_device_info* device,const char* str);
+/* release the whole enumeration the device belongs to */
 extern void free_usb_devices(usb_device_info*);
+/* find a device of the enumeration root belongs to, in O(1) */
+extern usb_device_info* usb_lookup_device(usb_device_info* root,int busnum,int devnum);
+/*
+ * patch the tree of root from hotplug events, the head returned replaces
+ * root. The devices are read from sysfs and have no bandwidth: a tree
+ * parsed from the text dump is better parsed again, see usb_tree_from_dump.
+ */
+extern usb_device_info* usb_tree_add_device(usb_device_info* root,const char* sys_name);
+extern usb_device_info* usb_tree_remove_device(usb_device_info* root,int busnum,int devnum);
+/* read the bandwidth of the root hubs again, for a tree parsed from a dump */
+extern void usb_tree_refresh_bandwidth(usb_device_info* root);
+/* 1 if the tree of root was parsed from a text dump, 0 for sysfs */
+extern int usb_tree_from_dump(const usb_device_info* root);
+/* a copy of the tree of root that shares nothing with it */
+extern usb_device_info* usb_clone_devices(const usb_device_info* root);
 extern const char* parse_usb_class_code(int class_code);
 extern const char* parse_usb_transfer_type(int transfer_type);
 
@@ -1,4 +1,8 @@
 #include "usbview.h"
+#include "usbindex.h"
+#include "usbarena.h"
+#include "usbintern.h"
+#include "usbscan.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,13 +10,18 @@
 #include <sys/stat.h>
 #include <sys/utsname.h>
 #include <errno.h>
-#include <linux/kdev_t.h>
 #include <linux/limits.h>
 #include <dirent.h>
 #include <stdarg.h>
 #include <fnmatch.h>
 #include <stddef.h>
 #include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/syscall.h>
 
 #ifdef HAVE_CONFIG_H
     #include <../config.h>
@@ -21,18 +30,25 @@
     #define PACKAGE_BUGREPORT ""
 #endif
 
-#if 1
+#ifdef ENABLE_LOG
 #define USBVIEW_LOG(fmt,...)          fprintf(stdout,fmt"\n",##__VA_ARGS__)
-#define USBVIEW_LOG_ERROR(fmt,...)    fprintf(stderr,fmt" in func:%s line:%d\n",##__VA_ARGS__,__FUNCTION__,__LINE__)
 #else
 #define USBVIEW_LOG(fmt,...)
-#define USBVIEW_LOG_ERROR(fmt,...)
 #endif
+#define USBVIEW_LOG_ERROR(fmt,...)    fprintf(stderr,fmt" in func:%s line:%d\n",##__VA_ARGS__,__FUNCTION__,__LINE__)
 
 #define NEW(p,type) type* p;p = (type*)malloc(sizeof(type));memset(p,0,sizeof(type))
 
-#define SYSFS_DEVICE_PATH   "/sys/bus/usb/devices"
+/* the roots can be moved, the paths below are relative to them */
+#define SYSFS_ROOT          "/sys"
 #define SYSFS_DEV_PATH      "/dev"
+#define SYSFS_DEVICE_PATH   "bus/usb/devices"
+#define SYSFS_DEV_CHAR_PATH "dev/char"
+#define DEV_CHAR_PATH       "char"
+#define UEVENT_DEVNAME_STRING           "DEVNAME="
+
+/* tiers below the root hub, as in 1-1.2.3.4.5.6 */
+#define USB_MAX_DEPTH       7
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
@@ -48,8 +64,6 @@
 #define TOPOLOGY_MAXCHILDREN_STRING		"MxCh="
 
 #define BANDWIDTH_ALOCATED              "Alloc="
-#define BANDWIDTH_TOTAL                 "/"
-#define BANDWIDTH_PERCENT               "us ("
 #define BANDWIDTH_INTERRUPT_TOTAL		"#Int="
 #define BANDWIDTH_ISOC_TOTAL			"#Iso="
 
@@ -85,169 +99,451 @@
 #define ENDPOINT_MAXPACKETSIZE_STRING	"MxPS="
 #define ENDPOINT_INTERVAL_STRING		"Ivl="
 
-static int GetInt (const char *string, char *pattern, int base)
-{
-    char    *pointer;
+/* types of the values in a "Key=value" field */
+enum usb_field_type {
+    FIELD_INT,          /* number, parsed with the base of the field */
+    FIELD_STRING,       /* one word, leading spaces skipped */
+    FIELD_TEXT,         /* the rest of the line */
+    FIELD_RATIO,        /* "a/b", a goes to offset and b to offset2 */
+    FIELD_ENDPOINT      /* "81(I)", address goes to offset and direction to offset2 */
+};
 
-    pointer = strstr (string, pattern);
-    if (pointer == NULL)
-        return(0);
+typedef struct usb_field {
+    const char  *key;       /* including the trailing '=' */
+    size_t      keylen;
+    int         type;
+    int         base;
+    size_t      offset;
+    size_t      offset2;
+} usb_field;
+
+#define USB_FIELD(key,type,base,st,member) \
+    {key,sizeof(key)-1,type,base,offsetof(st,member),0}
+#define USB_FIELD2(key,type,base,st,member,member2) \
+    {key,sizeof(key)-1,type,base,offsetof(st,member),offsetof(st,member2)}
+#define USB_FIELD_NUM(fields)   ((int)(sizeof(fields)/sizeof(fields[0])))
+
+#define FIELD_PTR(obj,offset,type)  ((type*)((char*)(obj)+(offset)))
+
+/* T: line, parsed aside because the parent is only known by its number */
+typedef struct usb_topology {
+    int     busnum;
+    int     level;
+    int     parent;
+    int     portNumber;
+    int     connectorNumber;
+    int     devnum;
+    int     speed;
+    int     maxchild;
+} usb_topology;
+
+/* S: lines, merged into the device once parsed */
+typedef struct usb_strings {
+    char    *manufacturer;
+    char    *product;
+    char    *serial;
+} usb_strings;
+
+static const usb_field topology_fields[] = {
+    USB_FIELD(TOPOLOGY_BUS_STRING,          FIELD_INT, 10, usb_topology, busnum),
+    USB_FIELD(TOPOLOGY_LEVEL_STRING,        FIELD_INT, 10, usb_topology, level),
+    USB_FIELD(TOPOLOGY_PARENT_STRING,       FIELD_INT, 10, usb_topology, parent),
+    USB_FIELD(TOPOLOGY_PORT_STRING,         FIELD_INT, 10, usb_topology, portNumber),
+    USB_FIELD(TOPOLOGY_COUNT_STRING,        FIELD_INT, 10, usb_topology, connectorNumber),
+    USB_FIELD(TOPOLOGY_DEVICENUMBER_STRING, FIELD_INT, 10, usb_topology, devnum),
+    USB_FIELD(TOPOLOGY_SPEED_STRING,        FIELD_INT, 10, usb_topology, speed),
+    USB_FIELD(TOPOLOGY_MAXCHILDREN_STRING,  FIELD_INT, 10, usb_topology, maxchild),
+};
 
-    pointer += strlen(pattern);
-    return((int)(strtol (pointer, NULL, base)));
-}
+static const usb_field bandwidth_fields[] = {
+    USB_FIELD2(BANDWIDTH_ALOCATED,      FIELD_RATIO, 10, usb_device_bandwidth, allocated, total),
+    USB_FIELD(BANDWIDTH_INTERRUPT_TOTAL, FIELD_INT, 10, usb_device_bandwidth, numInterruptRequests),
+    USB_FIELD(BANDWIDTH_ISOC_TOTAL,      FIELD_INT, 10, usb_device_bandwidth, numIsocRequests),
+};
 
+static const usb_field device_fields[] = {
+    USB_FIELD(DEVICE_VERSION_STRING,        FIELD_STRING, 0, usb_device_info, version),
+    USB_FIELD(DEVICE_CLASS_STRING,          FIELD_INT, 16, usb_device_info, bDeviceClass),
+    USB_FIELD(DEVICE_SUBCLASS_STRING,       FIELD_INT, 16, usb_device_info, bDeviceSubClass),
+    USB_FIELD(DEVICE_PROTOCOL_STRING,       FIELD_INT, 16, usb_device_info, bDeviceProtocol),
+    USB_FIELD(DEVICE_MAXPACKETSIZE_STRING,  FIELD_INT, 10, usb_device_info, bMaxPacketSize0),
+    USB_FIELD(DEVICE_NUMCONFIGS_STRING,     FIELD_INT, 10, usb_device_info, bNumConfigurations),
+};
 
-static char* GetString (const char *data,const char *pattern,int skip_sapce)
-{
-    char* p,*end,*ret = NULL;
-    size_t maxlen,len;
+static const usb_field product_fields[] = {
+    USB_FIELD(DEVICE_VENDOR_STRING,     FIELD_INT, 16, usb_device_info, idVendor),
+    USB_FIELD(DEVICE_PRODUCTID_STRING,  FIELD_INT, 16, usb_device_info, idProduct),
+    USB_FIELD(DEVICE_REVISION_STRING,   FIELD_STRING, 0, usb_device_info, bcdDevice),
+};
 
-    if(!data||!pattern)
-        return NULL;
+static const usb_field string_fields[] = {
+    USB_FIELD(DEVICE_MANUFACTURER_STRING,   FIELD_TEXT, 0, usb_strings, manufacturer),
+    USB_FIELD(DEVICE_PRODUCT_STRING,        FIELD_TEXT, 0, usb_strings, product),
+    USB_FIELD(DEVICE_SERIALNUMBER_STRING,   FIELD_TEXT, 0, usb_strings, serial),
+};
 
-    if((p = strstr(data,pattern)) == NULL)
-        return NULL;
+static const usb_field config_fields[] = {
+    USB_FIELD(CONFIG_NUMINTERFACES_STRING,  FIELD_INT, 10, usb_device_config, bNumInterfaces),
+    USB_FIELD(CONFIG_CONFIGNUMBER_STRING,   FIELD_INT, 10, usb_device_config, bConfigurationValue),
+    USB_FIELD(CONFIG_ATTRIBUTES_STRING,     FIELD_INT, 16, usb_device_config, bmAttributes),
+    USB_FIELD(CONFIG_MAXPOWER_STRING,       FIELD_INT, 10, usb_device_config, bMaxPower),
+};
+
+static const usb_field interface_fields[] = {
+    USB_FIELD(INTERFACE_NUMBER_STRING,          FIELD_INT, 10, usb_device_interface, bInterfaceNumber),
+    USB_FIELD(INTERFACE_ALTERNATESETTING_STRING,FIELD_INT, 10, usb_device_interface, bAlternateSetting),
+    USB_FIELD(INTERFACE_NUMENDPOINTS_STRING,    FIELD_INT, 10, usb_device_interface, bNumEndpoints),
+    USB_FIELD(INTERFACE_CLASS_STRING,           FIELD_INT, 16, usb_device_interface, bInterfaceClass),
+    USB_FIELD(INTERFACE_SUBCLASS_STRING,        FIELD_INT, 16, usb_device_interface, bInterfaceSubClass),
+    USB_FIELD(INTERFACE_PROTOCOL_STRING,        FIELD_INT, 16, usb_device_interface, bInterfaceProtocol),
+    USB_FIELD(INTERFACE_DRIVERNAME_STRING,      FIELD_STRING, 0, usb_device_interface, driver),
+};
+
+static const usb_field endpoint_fields[] = {
+    USB_FIELD2(ENDPOINT_ADDRESS_STRING,     FIELD_ENDPOINT, 16, usb_device_endpoint, bEndpointAddress, in),
+    USB_FIELD(ENDPOINT_ATTRIBUTES_STRING,   FIELD_INT, 16, usb_device_endpoint, bmAttributes),
+    USB_FIELD(ENDPOINT_MAXPACKETSIZE_STRING,FIELD_INT, 10, usb_device_endpoint, wMaxPacketSize),
+    USB_FIELD(ENDPOINT_INTERVAL_STRING,     FIELD_INT, 10, usb_device_endpoint, bInterval),
+};
+
+/* like strtol, without the locale and overflow handling it doesn't need */
+static const char *usb_parse_int(const char *p,int base,int *value)
+{
+    int v = 0,neg = 0,d;
+
+    for(;*p==' ';++p);
+    if(*p == '-'){
+        neg = 1;
+        ++p;
+    }
+    for(;;++p){
+        if(*p>='0' && *p<='9')
+            d = *p-'0';
+        else if(base == 16 && (*p|0x20)>='a' && (*p|0x20)<='f')
+            d = (*p|0x20)-'a'+10;
+        else
+            break;
+        v = v*base+d;
+    }
+    *value = neg?-v:v;
+    return p;
+}
 
-    p += strlen(pattern);
-
-    maxlen = strlen(data);
-    if(skip_sapce){
-        // skip space
-        for(;(p)<(data+maxlen) && *p==' ';++p);
-        if(p>=data+maxlen)
-            return NULL;
-        end = strchr(p,' ');
-        if(end){
-            len = (end-p);
+/* parse the value at p into obj, return where the value stops; line is padded, see usb_read_fd */
+static const char *usb_parse_value(const char *line,const char *p,const usb_field *field,void *obj)
+{
+    const char *s;
+
+    switch(field->type){
+    case FIELD_INT:
+        return usb_scan_int(p,field->base,FIELD_PTR(obj,field->offset,int));
+
+    case FIELD_RATIO:
+        p = usb_scan_int(p,field->base,FIELD_PTR(obj,field->offset,int));
+        if(*p == '/')
+            p = usb_scan_int(p+1,field->base,FIELD_PTR(obj,field->offset2,int));
+        return p;
+
+    case FIELD_ENDPOINT:
+        p = usb_scan_int(p,field->base,FIELD_PTR(obj,field->offset,int));
+        // not perfect
+        if(p[0] == '(' && p[1] == 'I' && p[2] == ')'){
+            *FIELD_PTR(obj,field->offset2,enum usb_endpoint_direction) = USB_ENDPOINT_IN;
+        }else if(p[0] == '(' && p[1] == 'O' && p[2] == ')'){
+            *FIELD_PTR(obj,field->offset2,enum usb_endpoint_direction) = USB_ENDPOINT_OUT;
         }else{
-            // save all left
-            len = maxlen-(p-data);
+            USBVIEW_LOG_ERROR("we don't know which type of endpoint it is![%s]",line);
         }
-        ret = (char*)malloc(len+1);
-        memcpy(ret,p,len);
-        ret[len] = 0;
-    }else{
-        len = maxlen-(p-data);
-        ret = (char*)malloc(len+1);
-        memcpy(ret,p,len);
-        ret[len] = 0;
-    }
+        return p;
 
-    return ret;
+    case FIELD_STRING:
+        // skip space, the caller terminates the word
+        for(;*p==' ';++p);
+        for(s=p;*p&&*p!=' ';++p);
+        if(p>s)
+            *FIELD_PTR(obj,field->offset,char*) = (char*)s;
+        return p;
 
+    case FIELD_TEXT:
+        // save all left
+        *FIELD_PTR(obj,field->offset,char*) = (char*)p;
+        return p+strlen(p);
+
+    default:
+        return p;
+    }
 }
 
+/* a line of the kernel has a dozen '=' at most, any after these are ignored */
+#define USB_FIELD_MAX_DELIMS    32
+
+/* whether the key of field ends with the '=' at line[q] */
+static inline int usb_key_at(const char *line,unsigned int q,const usb_field *field)
+{
+    size_t k = field->keylen-1;
 
+    if(q < k)
+        return 0;
+    for(line += q-k;k>0 && line[k-1] == field->key[k-1];k--);
+    return k == 0;
+}
 
-static void DestroyInterface (usb_device_interface *interface)
+/*
+ * Walk the line once: usb_scan_fields finds every '=' in one pass, and
+ * the key in front of each is compared with the field the table has next,
+ * as the kernel prints them in that order. A key out of order is still
+ * found by trying the other fields, a key seen twice keeps its first value.
+ * A '=' inside a value is skipped.
+ *
+ * String values point into the line, which must outlive obj. Words are
+ * terminated in place once all keys are found.
+ */
+static void usb_parse_fields(char *line,const usb_field *fields,int num,void *obj)
 {
-    int i;
-    if (interface == NULL)
-        return;
+    unsigned short pos[USB_FIELD_MAX_DELIMS];
+    const char *p = line,*end;
+    char *ends[4];
+    size_t len;
+    unsigned int done = 0;
+    int i = 0,j,k,nend = 0,npos,next = 0;
+
+    npos = usb_scan_fields(line,pos,USB_FIELD_MAX_DELIMS,&len);
+    if(npos > USB_FIELD_MAX_DELIMS)
+        npos = USB_FIELD_MAX_DELIMS;
+
+    for(j=0;j<npos;j++){
+        if(line+pos[j] < p)
+            continue;
+        for(k=0;k<num;k++){
+            i = next+k < num?next+k:next+k-num;
+            if(!(done & (1u<<i)) && usb_key_at(line,pos[j],&fields[i]))
+                break;
+        }
+        if(k == num)
+            continue;
+        done |= 1u<<i;
+        next = i+1;
+
+        end = usb_parse_value(line,line+pos[j]+1,&fields[i],obj);
+        if(fields[i].type == FIELD_STRING && *end && nend < (int)(sizeof(ends)/sizeof(ends[0])))
+            ends[nend++] = (char*)end;
+        if(end > p)
+            p = end;
+    }
 
-    free (interface->driver);
-    free (interface->path);
-    for(i=0;i<interface->bNumEndpoints;++i)
-        free (interface->endpoint[i]);
-    free (interface->endpoint);
-    free (interface);
+    for(i=0;i<nend;i++)
+        *ends[i] = 0;
+}
 
-    return;
+/* state shared by all the devices of one enumeration */
+struct usb_device_tree {
+    usb_device_info     *head;
+    usb_index           index;      /* (busnum,devnum) -> device */
+    usb_arena           arena;      /* everything the devices point to */
+    usb_intern          strings;    /* the strings devices share, one copy each, in arena */
+    char                *buffer;    /* the file read, strings point into it */
+    const char          *file;      /* the dump the tree was parsed from, if any */
+    usb_index           devnodes;   /* (major,minor) -> node under /dev, filled on demand */
+    const char          *sysfs_root;
+    const char          *dev_root;
+    pthread_mutex_t     lock;       /* devnodes and strings, and arena while workers run */
+};
+
+/* zeroed memory that lives as long as the tree */
+#define TREE_NEW(p,type,tree)           type* p = (type*)usb_arena_alloc(&(tree)->arena,sizeof(type))
+#define TREE_NEW_ARRAY(type,num,tree)   ARENA_NEW_ARRAY(type,num,&(tree)->arena)
+#define ARENA_NEW_ARRAY(type,num,arena) (type*)usb_arena_alloc(arena,(num)*sizeof(type))
+
+/* what a filter lets through gets all its configs read and its nodes found */
+static int usb_filter_device(const usb_device_filter* filter,const usb_device_info* device)
+{
+    if(!filter || (filter->vendor_id == 0 && filter->product_id == 0))
+        return 1;
+    return device->idVendor == filter->vendor_id && device->idProduct == filter->product_id;
 }
 
+static int usb_filter_interface(const usb_device_filter* filter,const usb_device_interface* interface)
+{
+    return !filter || filter->class_code < 0 || interface->bInterfaceClass == filter->class_code;
+}
 
-static void DestroyConfig (usb_device_config *config)
+/* endpoints and nodes belong to interfaces, asking for them asks for those */
+static int usb_enum_normalize(int flags)
 {
-    int     i;
+    if(flags & (USB_ENUM_ENDPOINTS|USB_ENUM_DEVPATH))
+        flags |= USB_ENUM_INTERFACES;
+    return flags;
+}
 
-    if (config == NULL)
-        return;
+/* the driver of an interface without one, one object so it compares by pointer */
+static const char usb_no_driver[] = INTERFACE_DRIVERNAME_NODRIVER_STRING;
 
-    for (i = 0; i < config->bNumInterfaces; ++i)
-        DestroyInterface (config->interfaces[i]);
-    free (config);
+static const char *usb_default_sysfs_root = SYSFS_ROOT;
+static const char *usb_default_dev_root = SYSFS_DEV_PATH;
 
-    return;
+extern void usb_set_default_roots(const char* sysfs_root,const char* dev_root)
+{
+    usb_default_sysfs_root = sysfs_root?sysfs_root:SYSFS_ROOT;
+    usb_default_dev_root = dev_root?dev_root:SYSFS_DEV_PATH;
 }
 
+static struct usb_device_tree *usb_new_tree(void)
+{
+    NEW(tree,struct usb_device_tree);
+    if(usb_index_init(&tree->index,0)){
+        free(tree);
+        return NULL;
+    }
+    usb_arena_init(&tree->arena);
+    if(usb_intern_init(&tree->strings,&tree->arena,0) ||
+            !usb_intern_keep(&tree->strings,usb_no_driver,sizeof(usb_no_driver)-1)){
+        usb_intern_destroy(&tree->strings);
+        usb_index_destroy(&tree->index);
+        free(tree);
+        return NULL;
+    }
+    tree->sysfs_root = usb_default_sysfs_root;
+    tree->dev_root = usb_default_dev_root;
+    pthread_mutex_init(&tree->lock,NULL);
+    return tree;
+}
 
-static usb_device_info *usb_find_device (int devnum, int busnum,usb_device_info* root)
+/*
+ * The copy of a string the tree keeps for all its devices, or NULL. The
+ * sysfs readers, which may run alongside each other, take the lock.
+ */
+static char* usb_tree_string(struct usb_device_tree *tree,const char* data,size_t len)
 {
-    usb_device_info  *ret = root;
+    return (char*)usb_intern_strn(&tree->strings,data,len);
+}
 
-    /* search with device_number and bus_number*/
-    while(ret){
-        if((ret->devnum == devnum) &&
-                (ret->busnum == busnum))
-            return ret;
-        ret = ret->next;
-    }
-    return (NULL);
+static char* usb_tree_string_locked(struct usb_device_tree *tree,const char* data,size_t len)
+{
+    char* ret;
+
+    pthread_mutex_lock(&tree->lock);
+    ret = usb_tree_string(tree,data,len);
+    pthread_mutex_unlock(&tree->lock);
+    return ret;
 }
 
-static void strRev(char* buf)
+#define TREE_STRING(tree,s)     ((s)?usb_tree_string(tree,s,strlen(s)):NULL)
+/* the text parser keeps the words of the buffer, which lives as long as the tree */
+#define TREE_WORD(tree,s)       ((s)?(char*)usb_intern_keep(&(tree)->strings,s,strlen(s)):NULL)
+
+static void usb_free_tree(struct usb_device_tree *tree)
 {
-    char c;
-    int len,i;
-    if(!buf)
+    if(!tree)
         return;
+    usb_index_destroy(&tree->index);
+    usb_index_destroy(&tree->devnodes);
+    usb_intern_destroy(&tree->strings);
+    usb_arena_release(&tree->arena);
+    free(tree->buffer);
+    pthread_mutex_destroy(&tree->lock);
+    free(tree);
+}
 
-    len = strlen(buf);
-    for(i=0;i<len/2;++i){
-        c = buf[i];
-        buf[i] = buf[len-i-1];
-        buf[len-i-1] = c;
-    }
+static usb_device_info *usb_find_device (int devnum, int busnum,usb_device_info* root)
+{
+    /* search with device_number and bus_number*/
+    if(!root || !root->tree)
+        return (NULL);
+    return (usb_device_info*)usb_index_get(&root->tree->index,busnum,devnum);
 }
 
-static char *usb_deep_find_path(char* path,u_int8_t major,u_int8_t minor)
+/* index every char and block node under path by its dev_t */
+static void usb_scan_dev_nodes(struct usb_device_tree *tree,const char* path)
 {
-    char* ret = NULL;
     DIR *dir = NULL;
     struct dirent *dir_ptr = NULL;
     char buf[PATH_MAX];
+    struct stat st;
 
-    USBVIEW_LOG("deep find path with %d:%d ... in %s",major,minor,path);
     dir = opendir(path);
-    if(!dir){
-        USBVIEW_LOG("open %s failed!%s",path,strerror(errno));
-        return NULL;
-    }
+    if(!dir)
+        return;
 
     while((dir_ptr = readdir(dir))){
         if(dir_ptr->d_type == DT_CHR || dir_ptr->d_type == DT_BLK){
-            struct stat st;
             snprintf(buf,sizeof(buf)-1,"%s/%s",path,dir_ptr->d_name);
-            if(stat(buf,&st)==0){
-                int rdev = st.st_rdev;
-                if(MAJOR(rdev)==major && MINOR(rdev) == minor){
-                    ret = strdup(buf);
-                    break;
-                }
-            }else{
-                USBVIEW_LOG("stat %s failed!%s",buf,strerror(errno));
-            }
+            /* the first node found keeps the number */
+            if(stat(buf,&st)==0 &&
+                    !usb_index_get(&tree->devnodes,major(st.st_rdev),minor(st.st_rdev)))
+                usb_index_put(&tree->devnodes,major(st.st_rdev),minor(st.st_rdev),
+                              usb_arena_strdup(&tree->arena,buf));
         }else if(dir_ptr->d_type == DT_DIR &&
                  memcmp(dir_ptr->d_name,".",1) !=0){
             snprintf(buf,sizeof(buf)-1,"%s/%s",path,dir_ptr->d_name);
-            ret = usb_deep_find_path(buf,major,minor);
-            if(ret)
-                break;
+            usb_scan_dev_nodes(tree,buf);
         }
     }
     closedir(dir);
-    USBVIEW_LOG("result=%s",ret?ret:"(null)");
-
-    return ret;
 }
 
+static int usb_is_dev_node(const char* path,unsigned int major,unsigned int minor)
+{
+    struct stat st;
+
+    return stat(path,&st)==0 && (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) &&
+           major(st.st_rdev) == major && minor(st.st_rdev) == minor;
+}
 
-static char* usb_find_path(u_int8_t major,u_int8_t minor)
+/*
+ * Resolve a device number to its node: ask sysfs for the name udev gave
+ * it, then try the /dev/char link, and only then search /dev. The search
+ * is done once per tree and indexes every node it meets. The path is
+ * copied to out, 0 is returned if there was one.
+ */
+static int usb_find_path(struct usb_device_tree *tree,unsigned int major,unsigned int minor,char *out,size_t size)
 {
-    char* ret = NULL;
-    ret = usb_deep_find_path(SYSFS_DEV_PATH,major,minor);
-    return ret;
+    char path[PATH_MAX],link[PATH_MAX/2];
+    char *name,*end;
+    const char *p;
+    ssize_t n;
+    int fd;
+
+    snprintf(path,sizeof(path),"%s/%s/%u:%u/uevent",tree->sysfs_root,SYSFS_DEV_CHAR_PATH,major,minor);
+    fd = open(path,O_RDONLY|O_CLOEXEC);
+    if(fd >= 0){
+        n = read(fd,link,sizeof(link)-1);
+        close(fd);
+        link[n>0?n:0] = 0x00;
+        name = strstr(link,UEVENT_DEVNAME_STRING);
+        if(name && (name == link || name[-1] == '\n')){
+            name += strlen(UEVENT_DEVNAME_STRING);
+            end = strchr(name,'\n');
+            if(end)
+                *end = 0x00;
+            snprintf(path,sizeof(path),"%s/%s",tree->dev_root,name);
+            if(usb_is_dev_node(path,major,minor))
+                return snprintf(out,size,"%s",path) < (int)size?0:-1;
+        }
+    }
+
+    snprintf(path,sizeof(path),"%s/%s/%u:%u",tree->dev_root,DEV_CHAR_PATH,major,minor);
+    n = readlink(path,link,sizeof(link)-1);
+    if(n > 0){
+        link[n] = 0x00;
+        if(link[0] == '/')
+            snprintf(path,sizeof(path),"%s",link);
+        else if(memcmp(link,"../",3) == 0)
+            snprintf(path,sizeof(path),"%s/%s",tree->dev_root,link+3);
+        else
+            snprintf(path,sizeof(path),"%s/%s/%s",tree->dev_root,DEV_CHAR_PATH,link);
+        if(usb_is_dev_node(path,major,minor))
+            return snprintf(out,size,"%s",path) < (int)size?0:-1;
+    }
+
+    /* the index is built in the tree arena, which no worker allocates from */
+    pthread_mutex_lock(&tree->lock);
+    if(!tree->devnodes.slots && usb_index_init(&tree->devnodes,0) == 0)
+        usb_scan_dev_nodes(tree,tree->dev_root);
+    p = (const char*)usb_index_get(&tree->devnodes,major,minor);
+    pthread_mutex_unlock(&tree->lock);
+    USBVIEW_LOG("device %u:%u is %s",major,minor,p?p:"(null)");
+
+    return p && snprintf(out,size,"%s",p) < (int)size?0:-1;
 }
 
 static char *usb_deep_readfile_va(int deep,const char* root,va_list args)
@@ -321,39 +617,13 @@ static char *usb_deep_readfile(int deep,...)
     return ret;
 }
 
-static int usb_get_device_number(usb_device_info* device,usb_device_config* config,usb_device_interface* interface,u_int8_t *major,u_int8_t *minor)
+/* find the dev file of the node a driver made for the interface at path */
+static int usb_get_interface_number(const char* path,unsigned int *major,unsigned int *minor)
 {
     int ret = -1;
-    char path[PATH_MAX];
-    char tmp[PATH_MAX];
-    int len = 0 ,tlen = 0;
-    int level = device->level;
-    usb_device_info* parent = device->parent;
     DIR *dir = NULL;
     struct dirent *dir_ptr = NULL;
 
-    USBVIEW_LOG("Get Device number of %d:%d-%d.%d",
-        device->busnum,device->devnum,config->bConfigurationValue,interface->bInterfaceNumber);
-
-    // if level == 0 use (bus)-0
-    tlen += snprintf(tmp+tlen,sizeof(tmp)-tlen-1,"%d",level?device->portNumber+1:0);
-    for(;level>1&&parent;level--){
-        tlen += snprintf(tmp+tlen,sizeof(tmp)-tlen-1,".%d",parent->portNumber+1);
-        parent = parent->parent;
-    }
-
-    // if parent not found
-    if(level&&!parent){
-        USBVIEW_LOG_ERROR("[%d:%d-%d.%d] break off when finding parent!",
-                  device->busnum,device->devnum,config->bConfigurationValue,interface->bInterfaceNumber);
-        return -1;
-    }else{
-        strRev(tmp);
-        len += snprintf(path,sizeof(path)-len-1,"%s/%d-%s:%d.%d",
-                        SYSFS_DEVICE_PATH,device->busnum,
-                        tmp,config->bConfigurationValue,interface->bInterfaceNumber);
-    }
-
     // I only known hid and printer
     // update me
     dir = opendir(path);
@@ -362,7 +632,7 @@ static int usb_get_device_number(usb_device_info* device,usb_device_config* conf
         while((dir_ptr = readdir(dir))){
             if(dir_ptr->d_type == DT_DIR && memcmp(dir_ptr->d_name,"usb",3)==0 ){
                 buf = usb_deep_readfile(4,path,"usb*","*","dev");
-                if(buf && sscanf(buf,"%d:%d",major,minor)==2){
+                if(buf && sscanf(buf,"%u:%u",major,minor)==2){
                     ret = 0;
                     free(buf);
                     break;
@@ -371,7 +641,7 @@ static int usb_get_device_number(usb_device_info* device,usb_device_config* conf
                     free(buf);
             }else if(dir_ptr->d_type == DT_DIR && strchr(dir_ptr->d_name,':')){
                 buf = usb_deep_readfile(5,path,"*:*:*.*","*","*","dev");
-                if(buf && sscanf(buf,"%d:%d",major,minor)==2){
+                if(buf && sscanf(buf,"%u:%u",major,minor)==2){
                     ret = 0;
                     free(buf);
                     break;
@@ -387,40 +657,142 @@ static int usb_get_device_number(usb_device_info* device,usb_device_config* conf
     if(ret){
         USBVIEW_LOG("get device number failed!");
     }else{
-        USBVIEW_LOG("get device number succeed: major=%d minor=%d",*major,*minor);
+        USBVIEW_LOG("get device number succeed: major=%u minor=%u",*major,*minor);
     }
 
     return ret;
 }
 
-/**********************Funs of usb-devices****************************************/
+/* the directory of an interface under sysfs, worked out from the topology alone */
+static char* usb_get_interface_location(usb_device_info* device,usb_device_config* config,usb_device_interface* interface)
+{
+    char path[PATH_MAX];
+    char tmp[USB_MAX_DEPTH*4];
+    int ports[USB_MAX_DEPTH];
+    int tlen = 0,nport = 0;
+    int level = device->level;
+    usb_device_info* parent = device->parent;
+
+    USBVIEW_LOG("Get location of %d:%d-%d.%d",
+        device->busnum,device->devnum,config->bConfigurationValue,interface->bInterfaceNumber);
+
+    // if level == 0 use (bus)-0
+    ports[nport++] = level?device->portNumber+1:0;
+    for(;level>1&&parent&&nport<USB_MAX_DEPTH;level--){
+        ports[nport++] = parent->portNumber+1;
+        parent = parent->parent;
+    }
+
+    // if parent not found
+    if(level>1||(level&&!parent)){
+        USBVIEW_LOG_ERROR("[%d:%d-%d.%d] break off when finding parent!",
+                  device->busnum,device->devnum,config->bConfigurationValue,interface->bInterfaceNumber);
+        return NULL;
+    }
+
+    // the ports were collected from the device up
+    while(nport--)
+        tlen += snprintf(tmp+tlen,sizeof(tmp)-tlen,tlen?".%d":"%d",ports[nport]);
+    snprintf(path,sizeof(path),"%s/%s/%d-%s:%d.%d",
+             device->tree->sysfs_root,SYSFS_DEVICE_PATH,device->busnum,
+             tmp,config->bConfigurationValue,interface->bInterfaceNumber);
+
+    return usb_arena_strdup(&device->tree->arena,path);
+}
 
-static void AddDevice (usb_device_info** proot,const char *line)
+/*
+ * Nodes are looked for only when somebody asks, listing devices never
+ * touches /dev. What is found is kept in the tree, so it is asked once.
+ */
+extern const char* usb_interface_path(usb_device_info* device,usb_device_interface* interface)
 {
-    NEW(device,usb_device_info);
-    int parentNumber;
-    usb_device_info *tmp;
+    struct usb_device_tree *tree;
+    unsigned int major = 0,minor = 0;
+    char node[PATH_MAX];
+    const char *path;
 
-    /* parse the line */
-    device->busnum          = GetInt (line, TOPOLOGY_BUS_STRING, 16);
-    device->level           = GetInt (line, TOPOLOGY_LEVEL_STRING, 16);
-    parentNumber            = GetInt (line, TOPOLOGY_PARENT_STRING, 10);
-    device->portNumber      = GetInt (line, TOPOLOGY_PORT_STRING, 16);
-    device->connectorNumber = GetInt (line, TOPOLOGY_COUNT_STRING, 16);
-    device->devnum          = GetInt (line, TOPOLOGY_DEVICENUMBER_STRING, 10);
-    device->speed           = GetInt (line, TOPOLOGY_SPEED_STRING, 10);
-    device->maxchild        = GetInt (line, TOPOLOGY_MAXCHILDREN_STRING, 10);
+    if(!device || !device->tree || !interface)
+        return NULL;
+    tree = device->tree;
+
+    pthread_mutex_lock(&tree->lock);
+    path = interface->path;
+    pthread_mutex_unlock(&tree->lock);
+    if(path || !interface->location)
+        return path;
+
+    if(usb_get_interface_number(interface->location,&major,&minor) ||
+            usb_find_path(tree,major,minor,node,sizeof(node)))
+        return NULL;
+
+    pthread_mutex_lock(&tree->lock);
+    if(!interface->path)
+        interface->path = usb_arena_strdup(&tree->arena,node);
+    path = interface->path;
+    pthread_mutex_unlock(&tree->lock);
+
+    return path;
+}
 
+extern char* usb_resolve_path(const char* location)
+{
+    struct usb_device_tree *tree;
+    unsigned int major = 0,minor = 0;
+    char node[PATH_MAX];
+    char *path = NULL;
+
+    if(!location || usb_get_interface_number(location,&major,&minor))
+        return NULL;
+
+    /* only for the roots and the /dev index, which are rarely needed */
+    tree = usb_new_tree();
+    if(!tree)
+        return NULL;
+    if(usb_find_path(tree,major,minor,node,sizeof(node)) == 0)
+        path = strdup(node);
+    usb_free_tree(tree);
+
+    return path;
+}
+
+/**********************Funs of usb-devices****************************************/
+
+/*
+ * Where the lines of a usb/devices dump go. The dump lists every device with
+ * its configs, interfaces and endpoints in order, so only the last one of
+ * each is ever appended to.
+ */
+typedef struct usb_parse_context {
+    struct usb_device_tree  *tree;
+    usb_device_info         *head;
+    usb_device_info         *tail;          /* device of the last T: line */
+    usb_device_config       *config;        /* last config of tail */
+    usb_device_interface    *interface;     /* last interface of config */
+    int                     nconfig;        /* configs filled in tail */
+    int                     ninterface;     /* interfaces filled in config */
+    int                     nendpoint;      /* endpoints filled in interface */
+    const usb_device_filter *filter;
+    int                     flags;          /* USB_ENUM_*, what is parsed beyond the topology */
+    int                     skip;           /* C:/I:/E: lines of tail are not parsed */
+} usb_parse_context;
+
+/* append a device whose topology is filled to the tree */
+static void usb_link_device (usb_parse_context* ctx,usb_device_info* device,int parentNumber)
+{
     device->next = NULL;
 
     // why? what happened?
     if (device->devnum == -1)
         device->devnum = 0;
 
+    device->tree = ctx->tree;
+    /* the first device of a number wins, as the list was searched in order */
+    if(!usb_index_get(&ctx->tree->index,device->busnum,device->devnum))
+        usb_index_put(&ctx->tree->index,device->busnum,device->devnum,device);
+
     /* Set up the parent / child relationship */
     if(device->maxchild){
-        device->children = (usb_device_info**)malloc(device->maxchild*sizeof(usb_device_info*));
-        memset(device->children,0,device->maxchild*sizeof(usb_device_info*));
+        device->children = TREE_NEW_ARRAY(usb_device_info*,device->maxchild,ctx->tree);
     }
 
     if (device->level == 0) {
@@ -429,7 +801,7 @@ static void AddDevice (usb_device_info** proot,const char *line)
     } else {
         /* need to find this device's parent */
         /* parent must be found before children*/
-        device->parent = usb_find_device (parentNumber, device->busnum,*proot);
+        device->parent = usb_find_device (parentNumber, device->busnum,ctx->head);
         if (device->parent) {
             if(device->parent->maxchild){
                 int i;
@@ -447,21 +819,44 @@ static void AddDevice (usb_device_info** proot,const char *line)
         }
     }
 
-    if(*proot){
-        tmp = *proot;
-        while(tmp->next){
-            tmp = tmp->next;
-        }
-        tmp->next = device;
+    if(ctx->tail){
+        ctx->tail->next = device;
     }else{
         // root NULL, this device is root
-        *proot = device;
+        ctx->head = device;
+        ctx->tree->head = device;
     }
+    ctx->tail = device;
+    ctx->skip = !(ctx->flags & USB_ENUM_INTERFACES);
+    ctx->config = NULL;
+    ctx->interface = NULL;
+    ctx->nconfig = 0;
+    ctx->ninterface = 0;
+    ctx->nendpoint = 0;
+}
+
+static void AddDevice (usb_parse_context* ctx,char *line)
+{
+    TREE_NEW(device,usb_device_info,ctx->tree);
+    usb_topology topology;
+
+    /* parse the line */
+    memset(&topology,0,sizeof(topology));
+    usb_parse_fields(line,topology_fields,USB_FIELD_NUM(topology_fields),&topology);
+    device->busnum          = topology.busnum;
+    device->level           = topology.level;
+    device->portNumber      = topology.portNumber;
+    device->connectorNumber = topology.connectorNumber;
+    device->devnum          = topology.devnum;
+    device->speed           = topology.speed;
+    device->maxchild        = topology.maxchild;
+
+    usb_link_device(ctx,device,topology.parent);
 }
 
 
 
-static void AddDeviceInformation (usb_device_info* device,const char *data)
+static void AddDeviceInformation (usb_device_info* device,char *data)
 {
     if (device == NULL){
         USBVIEW_LOG_ERROR("device null!");
@@ -473,22 +868,12 @@ static void AddDeviceInformation (usb_device_info* device,const char *data)
         return;
     }
 
-    device->version             = GetString(data,DEVICE_VERSION_STRING,1);
-    device->bDeviceClass        = GetInt (data, DEVICE_CLASS_STRING,16);
-    device->bDeviceSubClass     = GetInt (data, DEVICE_SUBCLASS_STRING,16);
-    device->bDeviceProtocol     = GetInt (data, DEVICE_PROTOCOL_STRING,16);
-    device->bMaxPacketSize0     = GetInt (data, DEVICE_MAXPACKETSIZE_STRING, 10);
-    device->bNumConfigurations  = GetInt (data, DEVICE_NUMCONFIGS_STRING, 10);
-
-    if(device->bNumConfigurations){
-        device->config = (usb_device_config**)malloc(device->bNumConfigurations*sizeof(usb_device_config*));
-        memset(device->config,0,device->bNumConfigurations*sizeof(usb_device_config*));
-    }
+    usb_parse_fields(data,device_fields,USB_FIELD_NUM(device_fields),device);
 }
 
 
 
-static void AddMoreDeviceInformation (usb_device_info* device,const char *data)
+static void AddMoreDeviceInformation (usb_device_info* device,char *data)
 {
     if (device == NULL){
         USBVIEW_LOG_ERROR("device null!");
@@ -499,45 +884,48 @@ static void AddMoreDeviceInformation (usb_device_info* device,const char *data)
         return;
     }
 
-    device->idVendor        = GetInt (data, DEVICE_VENDOR_STRING, 16);
-    device->idProduct       = GetInt (data, DEVICE_PRODUCTID_STRING, 16);
-    device->bcdDevice       = GetString (data, DEVICE_REVISION_STRING,1);
+    usb_parse_fields(data,product_fields,USB_FIELD_NUM(product_fields),device);
 }
 
 
-static void AddDeviceString (usb_device_info* device,const char *data)
+static void AddDeviceString (usb_device_info* device,char *data)
 {
+    usb_strings strings;
+
     if (device == NULL){
         USBVIEW_LOG_ERROR("device null!");
         return;
     }
 
-    if (strstr (data, DEVICE_MANUFACTURER_STRING) != NULL) {
+    memset(&strings,0,sizeof(strings));
+    usb_parse_fields(data,string_fields,USB_FIELD_NUM(string_fields),&strings);
+
+    if (strings.manufacturer) {
         if(device->manufacturer){
             USBVIEW_LOG_ERROR("device(%02x:%02x) already had manufacturer!",
                       device->busnum,device->devnum);
         }else{
-            device->manufacturer = GetString(data,DEVICE_MANUFACTURER_STRING,0);
+            device->manufacturer = TREE_WORD(device->tree,strings.manufacturer);
         }
-    }else   if (strstr (data, DEVICE_PRODUCT_STRING) != NULL) {
+    }else   if (strings.product) {
         if(device->product){
             USBVIEW_LOG_ERROR("device(%02x:%02x) already had product!",
                       device->busnum,device->devnum);
         }else{
-            device->product = GetString(data,DEVICE_PRODUCT_STRING,0);
+            device->product = TREE_WORD(device->tree,strings.product);
         }
-    }else if (strstr (data, DEVICE_SERIALNUMBER_STRING) != NULL) {
+    }else if (strings.serial) {
         if(device->serial){
             USBVIEW_LOG_ERROR("device(%02x:%02x) already had serial number!",
                       device->busnum,device->devnum);
         }else{
-            device->serial = GetString(data,DEVICE_SERIALNUMBER_STRING,0);
+            device->serial = strings.serial;
         }
     }
 }
 
 
-static void AddBandwidth (usb_device_info *device,const char *data)
+static void AddBandwidth (usb_device_info *device,char *data)
 {
     usb_device_bandwidth *bandwidth;
 
@@ -551,14 +939,9 @@ static void AddBandwidth (usb_device_info *device,const char *data)
         return;
     }
 
-    bandwidth = (usb_device_bandwidth *)malloc (sizeof(usb_device_bandwidth));
-    memset(bandwidth,0,sizeof(usb_device_bandwidth));
+    bandwidth = TREE_NEW_ARRAY(usb_device_bandwidth,1,device->tree);
 
-    bandwidth->allocated            = GetInt (data, BANDWIDTH_ALOCATED, 10);
-    // not perfect,update me
-    bandwidth->total                = GetInt (data, BANDWIDTH_TOTAL, 10);
-    bandwidth->numInterruptRequests = GetInt (data, BANDWIDTH_INTERRUPT_TOTAL, 10);
-    bandwidth->numIsocRequests      = GetInt (data, BANDWIDTH_ISOC_TOTAL, 10);
+    usb_parse_fields(data,bandwidth_fields,USB_FIELD_NUM(bandwidth_fields),bandwidth);
 
     device->bandwidth = bandwidth;
 
@@ -566,10 +949,10 @@ static void AddBandwidth (usb_device_info *device,const char *data)
 }
 
 
-static void AddConfig (usb_device_info* device,const char *data)
+static void AddConfig (usb_parse_context* ctx,char *data)
 {
+    usb_device_info      *device = ctx->tail;
     usb_device_config    *config;
-    int             i;
 
     if (device == NULL){
         USBVIEW_LOG_ERROR("device null!");
@@ -583,39 +966,38 @@ static void AddConfig (usb_device_info* device,const char *data)
     }
 
     /* Find the next available config in this device */
-    for (i = 0; i < device->bNumConfigurations && device->config[i]; ++i);
-    if (i >= device->bNumConfigurations) {
+    if (ctx->nconfig >= device->bNumConfigurations) {
         /* ran out of room to hold this config */
         USBVIEW_LOG_ERROR("device(%02x:%02x) has too many configs!",
                    device->busnum,device->devnum);
         return;
     }
 
-    config = (usb_device_config *)malloc (sizeof(usb_device_config));
-    memset(config,0,sizeof(usb_device_config));
+    config = TREE_NEW_ARRAY(usb_device_config,1,ctx->tree);
 
-    config->bNumInterfaces          = GetInt (data, CONFIG_NUMINTERFACES_STRING, 10);
-    config->bConfigurationValue     = GetInt (data, CONFIG_CONFIGNUMBER_STRING, 10);
-    config->bmAttributes            = GetInt (data, CONFIG_ATTRIBUTES_STRING, 16);
-    config->bMaxPower               = GetInt (data,CONFIG_MAXPOWER_STRING,10);
+    usb_parse_fields(data,config_fields,USB_FIELD_NUM(config_fields),config);
 
     if(config->bNumInterfaces){
-        config->interfaces = (usb_device_interface**)malloc(config->bNumInterfaces*sizeof(usb_device_interface*));
-        memset(config->interfaces,0,config->bNumInterfaces*sizeof(usb_device_interface*));
+        config->interfaces = TREE_NEW_ARRAY(usb_device_interface*,config->bNumInterfaces,ctx->tree);
     }
 
-    /* have the device now point to this config */
-    device->config[i] = config;
+    /* have the device now point to this config, a device with none read keeps no array */
+    if(!device->config)
+        device->config = TREE_NEW_ARRAY(usb_device_config*,device->bNumConfigurations,ctx->tree);
+    device->config[ctx->nconfig++] = config;
+    ctx->config = config;
+    ctx->interface = NULL;
+    ctx->ninterface = 0;
+    ctx->nendpoint = 0;
 }
 
 
 
-static void AddInterface (usb_device_info* device,const char *data)
+static void AddInterface (usb_parse_context* ctx,char *data)
 {
+    usb_device_info      *device = ctx->tail;
     usb_device_config    *config;
     usb_device_interface *interface;
-    int             i;
-
 
     if (device == NULL){
         USBVIEW_LOG_ERROR("device null!");
@@ -628,18 +1010,13 @@ static void AddInterface (usb_device_info* device,const char *data)
         return;
     }
 
-    /* find the LAST config in the device */
-    for (i = 0; i < device->bNumConfigurations && device->config[i]; ++i);
-
-    if(i==0){
+    /* the LAST config in the device */
+    config = ctx->config;
+    if(config==NULL){
         USBVIEW_LOG_ERROR("none of device(%02x:%02x) configs init!",
                   device->busnum,device->devnum);
         return;
     }
-    // swich to last config
-    i--;
-
-    config = device->config[i];
 
     /* now find a place in this config to place the interface */
     if(config->bNumInterfaces == 0){
@@ -648,8 +1025,7 @@ static void AddInterface (usb_device_info* device,const char *data)
         return;
     }
 
-    for(i=0;i<config->bNumInterfaces && config->interfaces[i];++i);
-    if(i>=config->bNumInterfaces){
+    if(ctx->ninterface>=config->bNumInterfaces){
         // it often happens,shall we show log?
 #if 0
         USBVIEW_LOG_ERROR("config(%02x:%02x-%d) has too many interfaces!",
@@ -661,47 +1037,34 @@ static void AddInterface (usb_device_info* device,const char *data)
         return;
     }
 
-    interface = (usb_device_interface *)malloc (sizeof(usb_device_interface));
-    memset(interface,0,sizeof(usb_device_interface));
+    interface = TREE_NEW_ARRAY(usb_device_interface,1,ctx->tree);
 
-    interface->bInterfaceNumber     = GetInt (data, INTERFACE_NUMBER_STRING, 10);
-    interface->bAlternateSetting    = GetInt (data, INTERFACE_ALTERNATESETTING_STRING, 10);
-    interface->bNumEndpoints        = GetInt (data, INTERFACE_NUMENDPOINTS_STRING, 10);
-    interface->bInterfaceClass      = GetInt (data, INTERFACE_CLASS_STRING, 16);
-    interface->bInterfaceSubClass   = GetInt (data, INTERFACE_SUBCLASS_STRING, 16);
-    interface->bInterfaceProtocol   = GetInt (data, INTERFACE_PROTOCOL_STRING, 16);
-    interface->driver               = GetString(data,INTERFACE_DRIVERNAME_STRING,1);
-    if(interface->driver&&strcmp(interface->driver,INTERFACE_DRIVERNAME_NODRIVER_STRING)!=0){
+    usb_parse_fields(data,interface_fields,USB_FIELD_NUM(interface_fields),interface);
+    interface->driver = TREE_WORD(ctx->tree,interface->driver);
+    if(interface->driver && interface->driver != usb_no_driver){
         interface->attached = 1;
     }else{
         interface->attached = 0;
     }
 
-    if(interface->bNumEndpoints){
-        interface->endpoint = (usb_device_endpoint**)malloc(interface->bNumEndpoints*sizeof(usb_device_endpoint*));
-        memset(interface->endpoint,0,interface->bNumEndpoints*sizeof(usb_device_endpoint*));
-    }
-
-    // find path
-    if(interface->attached){
-        u_int8_t major = 0,minor = 0;
-        if(usb_get_device_number(device,config,interface,&major,&minor)==0){
-            interface->path = usb_find_path(major,minor);
-        }
-    }
+    // where the node is looked for, see usb_interface_path
+    if(interface->attached && (ctx->flags & USB_ENUM_DEVPATH) && usb_filter_interface(ctx->filter,interface))
+        interface->location = usb_get_interface_location(device,config,interface);
 
     /* now point the config to this interface */
-    config->interfaces[i] = interface;
+    config->interfaces[ctx->ninterface++] = interface;
+    ctx->interface = interface;
+    ctx->nendpoint = 0;
 }
 
 
 
-static void AddEndpoint (usb_device_info* device,const char *data)
+static void AddEndpoint (usb_parse_context* ctx,char *data)
 {
+    usb_device_info      *device = ctx->tail;
     usb_device_config    *config;
     usb_device_interface *interface;
     usb_device_endpoint  *endpoint;
-    int             i;
 
     if (device == NULL){
         USBVIEW_LOG_ERROR("device null!");
@@ -714,16 +1077,12 @@ static void AddEndpoint (usb_device_info* device,const char *data)
                   device->busnum,device->devnum);
         return;
     }
-    for (i = 0; i < device->bNumConfigurations && device->config[i]; ++i);
-
-    if(i==0){
+    config = ctx->config;
+    if(config==NULL){
         USBVIEW_LOG_ERROR("none of device(%02x:%02x) configs init!",
                   device->busnum,device->devnum);
         return;
     }
-    // swich to last config
-    i--;
-    config = device->config[i];
 
     /* find the LAST interface in the config */
     if(config->bNumInterfaces == 0){
@@ -732,15 +1091,12 @@ static void AddEndpoint (usb_device_info* device,const char *data)
         return;
     }
 
-    for(i=0;i<config->bNumInterfaces && config->interfaces[i];++i);
-    if(i==0){
+    interface = ctx->interface;
+    if(interface==NULL){
         USBVIEW_LOG_ERROR("none of config(%02x:%02x-%d) interfaces init!",
                   device->busnum,device->devnum,config->bConfigurationValue);
         return;
     }
-    // swich to last interface
-    i--;
-    interface = config->interfaces[i];
 
     /* now find a place in this interface to place the endpoint */
     if(interface->bNumEndpoints == 0){
@@ -748,8 +1104,7 @@ static void AddEndpoint (usb_device_info* device,const char *data)
                   device->busnum,device->devnum,config->bConfigurationValue,interface->bInterfaceNumber);
         return;
     }
-    for(i=0;i<interface->bNumEndpoints && interface->endpoint[i];++i);
-    if(i>=interface->bNumEndpoints){
+    if(ctx->nendpoint>=interface->bNumEndpoints){
         // it often happens,shall we show log?
 #if 0
         USBVIEW_LOG_ERROR("interface(%02x:%02x-%d.%d) too many endpoints!",
@@ -761,25 +1116,14 @@ static void AddEndpoint (usb_device_info* device,const char *data)
         return;
     }
 
-    endpoint = (usb_device_endpoint *)malloc (sizeof(usb_device_endpoint));
-    memset(endpoint,0,sizeof(usb_device_endpoint));
-
-    endpoint->bEndpointAddress      = GetInt (data, ENDPOINT_ADDRESS_STRING, 16);
-    endpoint->bmAttributes          = GetInt (data, ENDPOINT_ATTRIBUTES_STRING, 16);
-    endpoint->wMaxPacketSize        = GetInt (data, ENDPOINT_MAXPACKETSIZE_STRING, 10);
-    endpoint->bInterval             = GetInt (data, ENDPOINT_INTERVAL_STRING, 10);
+    endpoint = TREE_NEW_ARRAY(usb_device_endpoint,1,ctx->tree);
 
-    // not perfect
-    if(strstr(data,"(I)")){
-        endpoint->in = USB_ENDPOINT_IN;
-    }else if(strstr(data,"(O)")){
-        endpoint->in = USB_ENDPOINT_OUT;
-    }else{
-        USBVIEW_LOG_ERROR("we don't know which type of endpoint it is![%s]",data);
-    }
+    usb_parse_fields(data,endpoint_fields,USB_FIELD_NUM(endpoint_fields),endpoint);
 
     /* point the interface to the endpoint */
-    interface->endpoint[i] = endpoint;
+    if(!interface->endpoint)
+        interface->endpoint = TREE_NEW_ARRAY(usb_device_endpoint*,interface->bNumEndpoints,ctx->tree);
+    interface->endpoint[ctx->nendpoint++] = endpoint;
 }
 
 static const char sysfs_usb_devices_files[][40]={
@@ -790,7 +1134,7 @@ static const char sysfs_usb_devices_files[][40]={
 #define USB_DEVICES_FILES_NUM  (sizeof(sysfs_usb_devices_files)/sizeof(sysfs_usb_devices_files[0]))
 static int sysfs_has_usb_devices = -1;
 
-// if is_sysfs_has_usb_devices==0,shall we use usb-devices(linux version>=2.6.31)?
+// the text dump read first by get_usb_devices_filtered, 0 if there is none
 static int is_sysfs_has_usb_devices()
 {
     if(-1 == sysfs_has_usb_devices){
@@ -812,31 +1156,19 @@ static int is_sysfs_has_usb_devices()
     return sysfs_has_usb_devices;
 }
 
-static void usb_parse_line (char * line,usb_device_info** proot)
+static void usb_parse_line (char * line,usb_parse_context* ctx)
 {
-    usb_device_info* lastDevice = NULL;
-    usb_device_info* tmp = NULL;
-
-    if(*proot){
-        tmp = *proot;
-        while(tmp->next){
-            tmp = tmp->next;
-        }
-        lastDevice = tmp;
-    }
-
-    /* chop off the trailing \n */
-    if(line[strlen(line)-1]='\n')
-        line[strlen(line)-1] = 0x00;
+    usb_device_info* lastDevice = ctx->tail;
 
     /* look at the first character to see what kind of line this is */
     switch (line[0]) {
         case 'T': /* topology */
-            AddDevice (proot,line);
+            AddDevice (ctx,line);
             break;
 
         case 'B': /* bandwidth */
-            AddBandwidth (lastDevice, line);
+            if (ctx->flags & USB_ENUM_BANDWIDTH)
+                AddBandwidth (lastDevice, line);
             break;
 
         case 'D': /* device information */
@@ -845,22 +1177,27 @@ static void usb_parse_line (char * line,usb_device_info** proot)
 
         case 'P': /* more device information */
             AddMoreDeviceInformation (lastDevice, line);
+            ctx->skip = ctx->skip || (lastDevice && !usb_filter_device(ctx->filter,lastDevice));
             break;
 
         case 'S': /* device string information */
-            AddDeviceString (lastDevice, line);
+            if (ctx->flags & USB_ENUM_STRINGS)
+                AddDeviceString (lastDevice, line);
             break;
 
         case 'C': /* config descriptor info */
-            AddConfig (lastDevice, line);
+            if (!ctx->skip)
+                AddConfig (ctx, line);
             break;
 
         case 'I': /* interface descriptor info */
-            AddInterface (lastDevice, line);
+            if (!ctx->skip)
+                AddInterface (ctx, line);
             break;
 
         case 'E': /* endpoint descriptor info */
-            AddEndpoint (lastDevice, line);
+            if (!ctx->skip && (ctx->flags & USB_ENUM_ENDPOINTS))
+                AddEndpoint (ctx, line);
             break;
 
         default:
@@ -870,119 +1207,1966 @@ static void usb_parse_line (char * line,usb_device_info** proot)
     return;
 }
 
-# if 0 // android gcc has not getline
-static usb_device_info* sysfs_read_usb_devices(const char* file)
+#define READBUFSIZE     (64*1024)
+/*
+ * read fd to its end into *pbuf, growing it as needed, return the length;
+ * the data is followed by USB_SCAN_PADDING+1 zeros for the scan kernels
+ */
+static ssize_t usb_read_fd(int fd,char** pbuf,size_t* psize)
 {
-    FILE* f;
-    usb_device_info* device_info = NULL;
-
-    f = fopen(file,"r");
-    if(!f){
-        USBVIEW_LOG_ERROR("open %s failed!%s",file,strerror(errno));
-        return NULL;
-    }
+    size_t len = 0,size;
+    ssize_t readed;
+    char *tmp;
 
     for(;;){
-        ssize_t readed = -1;
-        char* line = NULL;
-        size_t len = 0;
-
-        if(feof(f))
-            break;
-
-        /* read one line */
-        readed = getline(&line,&len,f);
-        if(readed<=0||!line||!len)
+        if(len+USB_SCAN_PADDING+1 >= *psize){
+            size = *psize?*psize*2:READBUFSIZE;
+            tmp = realloc(*pbuf,size);
+            if(!tmp)
+                return -1;
+            *pbuf = tmp;
+            *psize = size;
+        }
+        readed = read(fd,*pbuf+len,*psize-len-USB_SCAN_PADDING-1);
+        if(readed > 0)
+            len += readed;
+        else if(readed == 0)
             break;
-        /* chop off the trailing \n */
-        line[strlen(line)-1] = 0x00;
-        USBVIEW_LOG("line=%s",line);
-        usb_parse_line(line,&device_info);
-
-        free(line);
+        else if(errno != EINTR)
+            return -1;
     }
 
-    fclose(f);
-    return device_info;
+    memset(*pbuf+len,0,USB_SCAN_PADDING+1);
+    return len;
 }
-#else
-#define READBUFSIZE     (2*1024)
-static usb_device_info* sysfs_read_usb_devices(const char* file)
-{
-    FILE* f;
-    usb_device_info* device_info = NULL;
-    char* line = NULL;
 
-    f = fopen(file,"r");
-    if(!f){
+/*
+ * Read the whole file with as few syscalls as possible. Files under /proc
+ * and debugfs report a size of 0 and cannot be mapped, so the size is only
+ * a hint and the buffer grows until read() returns 0.
+ */
+static char* usb_read_file(const char* file,size_t* plen)
+{
+    struct stat st;
+    size_t size = 0;
+    ssize_t len;
+    char *buf = NULL;
+    int fd;
+
+    fd = open(file,O_RDONLY|O_CLOEXEC);
+    if(fd < 0){
         USBVIEW_LOG_ERROR("open %s failed!%s",file,strerror(errno));
         return NULL;
     }
+    if(fstat(fd,&st) == 0 && st.st_size > 0){
+        size = st.st_size+1;
+        buf = malloc(size);
+        if(!buf)
+            size = 0;
+    }
 
-    line = malloc(READBUFSIZE);
-    if (line == NULL) {
-        fclose(f);
-        return NULL;
+    len = usb_read_fd(fd,&buf,&size);
+    if(len < 0){
+        USBVIEW_LOG_ERROR("read %s failed!%s",file,strerror(errno));
+        free(buf);
+        buf = NULL;
+    }else{
+        *plen = len;
     }
+    close(fd);
 
-    for(;;){
+    return buf;
+}
 
-        if(feof(f))
-            break;
+static usb_device_info* sysfs_read_usb_devices(const char* file,const usb_device_filter* filter,int flags)
+{
+    usb_parse_context ctx;
+    char *line,*end,*eol;
+    size_t len;
+
+    memset(&ctx,0,sizeof(ctx));
+    ctx.filter = filter;
+    ctx.flags = usb_enum_normalize(flags);
+    ctx.tree = usb_new_tree();
+    if(!ctx.tree)
+        return NULL;
+    ctx.tree->buffer = usb_read_file(file,&len);
+    if(!ctx.tree->buffer){
+        usb_free_tree(ctx.tree);
+        return NULL;
+    }
 
-        memset(line, 0 , READBUFSIZE);
-        if (fgets(line, READBUFSIZE - 1, f) == NULL)
-            break;
+    /* split the lines in place, the strings of the tree point into them */
+    line = ctx.tree->buffer;
+    end = line+len;
+    while(line < end){
+        /* the end is followed by zeros, so it can be written too */
+        eol = (char*)usb_scan_line(line,end);
+        *eol = 0x00;
 
         USBVIEW_LOG("line=%s",line);
-        usb_parse_line(line,&device_info);
+        usb_parse_line(line,&ctx);
+        line = eol+1;
     }
 
-    free(line);
+    if(!ctx.head)
+        usb_free_tree(ctx.tree);
+    else
+        ctx.tree->file = usb_arena_strdup(&ctx.tree->arena,file);
+    return ctx.head;
+}
 
-    fclose(f);
-    return device_info;
+
+/**********************Funs of descriptors****************************************/
+
+/* descriptor types and sizes, see chapter 9 of the usb spec */
+#define USB_DT_DEVICE           0x01
+#define USB_DT_CONFIG           0x02
+#define USB_DT_STRING           0x03
+#define USB_DT_INTERFACE        0x04
+#define USB_DT_ENDPOINT         0x05
+#define USB_DT_DEVICE_SIZE      18
+#define USB_DT_CONFIG_SIZE      9
+#define USB_DT_INTERFACE_SIZE   9
+#define USB_DT_ENDPOINT_SIZE    7
+
+/* descriptors are little endian and packed, load them a byte at a time */
+#define USB_LE16(p)             ((p)[0]|((p)[1]<<8))
+
+/* speeds are kept in Mbps, as the text dump prints them */
+#define USB_SPEED_HIGH_MBPS     480
+#define USB_SPEED_SUPER_MBPS    5000
+
+/*
+ * Where the descriptors after the device descriptor go. Interfaces go to
+ * the last config and endpoints to the last interface, the same way the
+ * lines of the text dump are attached.
+ */
+typedef struct usb_descriptor_walk usb_descriptor_walk;
+struct usb_descriptor_walk {
+    usb_arena               *arena;
+    usb_device_info         *device;
+    usb_device_config       *config;        /* last config */
+    usb_device_interface    *interface;     /* last interface of config */
+    usb_device_interface    *last;          /* the one before, alt settings share its directory */
+    int                     nconfig;        /* configs filled in device */
+    int                     ninterface;     /* interfaces filled in config */
+    int                     nendpoint;      /* endpoints filled in interface */
+    int                     flags;          /* USB_ENUM_* */
+    int                     active;         /* value of the config in use, 0 if it is not known */
+    /* driver and location of an interface of the active config, if there is a way to find them */
+    void                    (*attach)(usb_descriptor_walk* walk,usb_device_interface* interface);
+    void                    *data;          /* for attach */
+};
+
+typedef struct usb_descriptor_type {
+    int     size;                           /* shorter ones are skipped */
+    void    (*parse)(usb_descriptor_walk* walk,const unsigned char* p);
+} usb_descriptor_type;
+
+/* "2.00" from 0x0200, as the text dump prints versions */
+static int usb_format_bcd(char* buf,size_t size,int bcd)
+{
+    return snprintf(buf,size,"%x.%02x",(bcd>>8)&0xff,bcd&0xff);
 }
-#endif
 
+static char* usb_descriptor_bcd(struct usb_device_tree* tree,int bcd)
+{
+    char buf[8];
 
-extern usb_device_info *get_usb_devices()
+    return usb_tree_string_locked(tree,buf,usb_format_bcd(buf,sizeof(buf),bcd));
+}
+
+/*
+ * The fields of each descriptor, the same for the tree and for visitors.
+ * desc holds at least USB_DT_DEVICE_SIZE bytes, the versions are left to
+ * the caller and the configs are only counted.
+ */
+static void usb_decode_device(usb_device_info* device,const unsigned char* desc)
 {
-    usb_device_info* device_info = NULL;
+    device->bDeviceClass = desc[4];
+    device->bDeviceSubClass = desc[5];
+    device->bDeviceProtocol = desc[6];
+    device->bMaxPacketSize0 = desc[7];
+    device->idVendor = USB_LE16(desc+8);
+    device->idProduct = USB_LE16(desc+10);
+    device->bNumConfigurations = desc[17];
+}
 
-    if(is_sysfs_has_usb_devices()){
-        device_info = sysfs_read_usb_devices(sysfs_usb_devices_files[sysfs_has_usb_devices-1]);
-        if(device_info)
-            goto exit;
-    }
-exit:
-    return device_info;
+static void usb_decode_config(usb_device_config* config,const unsigned char* p,int speed)
+{
+    config->bNumInterfaces = p[4];
+    config->bConfigurationValue = p[5];
+    config->bmAttributes = p[7];
+    config->bMaxPower = p[8]*(speed >= USB_SPEED_SUPER_MBPS?8:2);
 }
 
-extern void free_usb_devices (usb_device_info* device)
+static void usb_decode_interface(usb_device_interface* interface,const unsigned char* p)
 {
-    usb_device_info *tmp;
-    while(device){
-        int i;
-        tmp = device->next;
-
-        free (device->name);
-        free (device->version);
-        free (device->bcdDevice);
-        free (device->manufacturer);
-        free (device->product);
-        free (device->serial);
-        for(i=0;i<device->bNumConfigurations;i++){
-            DestroyConfig(device->config[i]);
-        }
-        free(device->config);
-        free(device->children);
-        free(device->bandwidth);
+    interface->bInterfaceNumber = p[2];
+    interface->bAlternateSetting = p[3];
+    interface->bNumEndpoints = p[4];
+    interface->bInterfaceClass = p[5];
+    interface->bInterfaceSubClass = p[6];
+    interface->bInterfaceProtocol = p[7];
+}
+
+static void usb_decode_endpoint(usb_device_endpoint* endpoint,const unsigned char* p,int speed)
+{
+    int type,maxp,interval = 0;
+
+    endpoint->bEndpointAddress = p[2];
+    endpoint->bmAttributes = p[3];
+
+    /* control endpoints have no direction, the text parser leaves them out */
+    type = p[3]&0x03;
+    if(type != USB_TRANSFER_TYPE_CONTROL && (p[2]&USB_ENDPOINT_IN))
+        endpoint->in = USB_ENDPOINT_IN;
+    else
+        endpoint->in = USB_ENDPOINT_OUT;
 
-        free(device);
+    /* high bandwidth endpoints move up to three packets per microframe */
+    maxp = USB_LE16(p+4);
+    endpoint->wMaxPacketSize = maxp&0x7ff;
+    if(speed == USB_SPEED_HIGH_MBPS)
+        endpoint->wMaxPacketSize *= ((maxp>>11)&0x03)+1;
 
-        device = tmp;
+    /* the interval in us, then in ms when it is round, as the kernel dumps it */
+    switch(type){
+    case USB_TRANSFER_TYPE_CONTROL:
+        if(speed == USB_SPEED_HIGH_MBPS)
+            interval = p[6];
+        break;
+    case USB_TRANSFER_TYPE_ISOCHRONOUS:
+        interval = p[6]?1<<(p[6]-1):0;
+        break;
+    case USB_TRANSFER_TYPE_BULK:
+        if(speed == USB_SPEED_HIGH_MBPS && !(p[2]&USB_ENDPOINT_IN))
+            interval = p[6];
+        break;
+    case USB_TRANSFER_TYPE_INTERRUPT:
+        if(speed >= USB_SPEED_HIGH_MBPS)
+            interval = p[6]?1<<(p[6]-1):0;
+        else
+            interval = p[6];
+        break;
     }
+    interval *= speed >= USB_SPEED_HIGH_MBPS?125:1000;
+    endpoint->bInterval = interval%1000?interval:interval/1000;
+}
+
+static void usb_descriptor_device(struct usb_device_tree* tree,usb_device_info* device,const unsigned char* desc)
+{
+    usb_decode_device(device,desc);
+    device->version = usb_descriptor_bcd(tree,USB_LE16(desc+2));
+    device->bcdDevice = usb_descriptor_bcd(tree,USB_LE16(desc+12));
+}
+
+static void usb_descriptor_config(usb_descriptor_walk* walk,const unsigned char* p)
+{
+    usb_device_info *device = walk->device;
+    usb_device_config *config;
+
+    walk->config = NULL;
+    walk->interface = NULL;
+    if(walk->nconfig >= device->bNumConfigurations)
+        return;
+
+    config = ARENA_NEW_ARRAY(usb_device_config,1,walk->arena);
+    usb_decode_config(config,p,device->speed);
+    if(config->bNumInterfaces)
+        config->interfaces = ARENA_NEW_ARRAY(usb_device_interface*,config->bNumInterfaces,walk->arena);
+
+    if(!device->config)
+        device->config = ARENA_NEW_ARRAY(usb_device_config*,device->bNumConfigurations,walk->arena);
+    device->config[walk->nconfig++] = config;
+    walk->config = config;
+    walk->ninterface = 0;
+    walk->last = NULL;
+}
+
+static void usb_descriptor_interface(usb_descriptor_walk* walk,const unsigned char* p)
+{
+    usb_device_config *config = walk->config;
+    usb_device_interface *interface,*last = walk->last;
+
+    walk->interface = NULL;
+    if(!config || walk->ninterface >= config->bNumInterfaces)
+        return;
+
+    interface = ARENA_NEW_ARRAY(usb_device_interface,1,walk->arena);
+    usb_decode_interface(interface,p);
+
+    /* only the active config has interface directories, alt settings share them */
+    if(walk->active && config->bConfigurationValue == walk->active){
+        if(last && last->bInterfaceNumber == interface->bInterfaceNumber){
+            interface->driver = last->driver;
+            interface->location = last->location;
+            interface->attached = last->attached;
+        }else if(walk->attach){
+            walk->attach(walk,interface);
+        }
+    }
+
+    config->interfaces[walk->ninterface++] = interface;
+    walk->interface = interface;
+    walk->last = interface;
+    walk->nendpoint = 0;
+}
+
+static void usb_descriptor_endpoint(usb_descriptor_walk* walk,const unsigned char* p)
+{
+    usb_device_interface *interface = walk->interface;
+    usb_device_endpoint *endpoint;
+
+    if(!interface || walk->nendpoint >= interface->bNumEndpoints || !(walk->flags & USB_ENUM_ENDPOINTS))
+        return;
+    endpoint = ARENA_NEW_ARRAY(usb_device_endpoint,1,walk->arena);
+    if(!interface->endpoint)
+        interface->endpoint = ARENA_NEW_ARRAY(usb_device_endpoint*,interface->bNumEndpoints,walk->arena);
+    interface->endpoint[walk->nendpoint++] = endpoint;
+    usb_decode_endpoint(endpoint,p,walk->device->speed);
+}
+
+/* by bDescriptorType, class specific ones and those not listed are skipped */
+static const usb_descriptor_type descriptor_types[] = {
+    [USB_DT_CONFIG]     = {USB_DT_CONFIG_SIZE,      usb_descriptor_config},
+    [USB_DT_INTERFACE]  = {USB_DT_INTERFACE_SIZE,   usb_descriptor_interface},
+    [USB_DT_ENDPOINT]   = {USB_DT_ENDPOINT_SIZE,    usb_descriptor_endpoint},
+};
+
+/* the config descriptors that follow the device descriptor */
+static void usb_walk_descriptors(usb_descriptor_walk* walk,const unsigned char* p,size_t len)
+{
+    const usb_descriptor_type *type;
+
+    for(;len >= 2 && p[0] >= 2 && p[0] <= len;len -= p[0],p += p[0]){
+        if(p[1] >= USB_FIELD_NUM(descriptor_types))
+            continue;
+        type = &descriptor_types[p[1]];
+        if(type->parse && p[0] >= type->size)
+            type->parse(walk,p);
+    }
+}
+
+/*
+ * A string descriptor as UTF-8, cut at the last whole character that fits
+ * into out, which is always terminated. The length written, or -1.
+ */
+extern int usb_decode_string(const void* desc,size_t len,char* out,size_t size)
+{
+    const unsigned char *p = (const unsigned char*)desc;
+    unsigned int c,lo;
+    size_t i,n,k,o = 0;
+    char utf8[4];
+
+    if(!p || !out || !size || len < 2 || p[1] != USB_DT_STRING || p[0] < 2)
+        return -1;
+    n = ((p[0] < len?p[0]:len)-2)/2;
+    p += 2;
+
+    for(i=0;i<n;i++){
+        c = USB_LE16(p+2*i);
+        if(c >= 0xd800 && c < 0xdc00 && i+1 < n &&
+                (lo = USB_LE16(p+2*i+2)) >= 0xdc00 && lo < 0xe000){
+            c = 0x10000+((c-0xd800)<<10)+(lo-0xdc00);
+            i++;
+        }else if(c >= 0xd800 && c < 0xe000){
+            c = 0xfffd;     /* a lone surrogate */
+        }
+
+        if(c < 0x80){
+            utf8[0] = c;
+            k = 1;
+        }else if(c < 0x800){
+            utf8[0] = 0xc0|(c>>6);
+            utf8[1] = 0x80|(c&0x3f);
+            k = 2;
+        }else if(c < 0x10000){
+            utf8[0] = 0xe0|(c>>12);
+            utf8[1] = 0x80|((c>>6)&0x3f);
+            utf8[2] = 0x80|(c&0x3f);
+            k = 3;
+        }else{
+            utf8[0] = 0xf0|(c>>18);
+            utf8[1] = 0x80|((c>>12)&0x3f);
+            utf8[2] = 0x80|((c>>6)&0x3f);
+            utf8[3] = 0x80|(c&0x3f);
+            k = 4;
+        }
+        if(o+k >= size)
+            break;
+        memcpy(out+o,utf8,k);
+        o += k;
+    }
+    out[o] = 0x00;
+
+    return (int)o;
+}
+
+/*
+ * A device alone from its descriptors, as the descriptors attribute of
+ * sysfs holds them. speed is in Mbps, it changes how endpoints are read.
+ */
+extern usb_device_info* get_usb_device_descriptors(const void* data,size_t len,int speed)
+{
+    const unsigned char *desc = (const unsigned char*)data;
+    struct usb_device_tree *tree;
+    usb_descriptor_walk walk;
+    usb_device_info *device;
+
+    if(!desc || len < USB_DT_DEVICE_SIZE || desc[1] != USB_DT_DEVICE)
+        return NULL;
+    tree = usb_new_tree();
+    if(!tree)
+        return NULL;
+
+    device = TREE_NEW_ARRAY(usb_device_info,1,tree);
+    device->tree = tree;
+    device->speed = speed;
+    usb_descriptor_device(tree,device,desc);
+
+    memset(&walk,0,sizeof(walk));
+    walk.arena = &tree->arena;
+    walk.device = device;
+    walk.flags = USB_ENUM_ALL;
+    usb_walk_descriptors(&walk,desc+USB_DT_DEVICE_SIZE,len-USB_DT_DEVICE_SIZE);
+
+    tree->head = device;
+    return device;
+}
+
+
+/**********************Funs of sysfs****************************************/
+
+#define SYSFS_ATTR_SIZE         512
+
+/* a device directory of bus/usb/devices, "usb1" for a root hub or "1-1.2" */
+typedef struct usb_sysfs_entry {
+    char    name[32];
+    int     busnum;
+    int     level;
+    int     ports[USB_MAX_DEPTH];
+} usb_sysfs_entry;
+
+/* what one thread needs to read devices, see get_usb_devices_parallel */
+typedef struct usb_sysfs_worker {
+    struct usb_device_tree  *tree;
+    usb_arena               *arena;     /* where the devices read are allocated */
+    int                     dirfd;      /* bus/usb/devices */
+    char                    *buffer;    /* descriptors of the device being read */
+    size_t                  size;
+    const usb_device_filter *filter;
+    int                     flags;      /* USB_ENUM_* */
+} usb_sysfs_worker;
+
+/* links the devices read, in the order of their entries */
+typedef struct usb_sysfs_context {
+    usb_parse_context       parse;
+    const usb_sysfs_entry   *entries[USB_MAX_DEPTH+1];  /* last device linked at each level */
+    usb_device_info         *devices[USB_MAX_DEPTH+1];
+    int                     counts[USB_MAX_DEPTH+1];    /* children linked under the level above */
+} usb_sysfs_context;
+
+/* interfaces ("1-1:1.0") and anything else that is not a device fail */
+static int usb_sysfs_parse_name(const char* name,usb_sysfs_entry* entry)
+{
+    const char *p,*s;
+
+    memset(entry,0,sizeof(usb_sysfs_entry));
+    if(strlen(name) >= sizeof(entry->name))
+        return -1;
+
+    if(memcmp(name,"usb",3) == 0){
+        p = usb_parse_int(name+3,10,&entry->busnum);
+        if(p == name+3 || *p)
+            return -1;
+    }else{
+        p = usb_parse_int(name,10,&entry->busnum);
+        if(p == name || *p != '-')
+            return -1;
+        do{
+            s = p+1;
+            p = usb_parse_int(s,10,&entry->ports[entry->level]);
+            if(p == s)
+                return -1;
+            entry->level++;
+        }while(*p == '.' && entry->level < USB_MAX_DEPTH);
+        if(*p)
+            return -1;
+    }
+
+    strcpy(entry->name,name);
+    return 0;
+}
+
+/* the order of the text dump: by bus, then depth first by port */
+static int usb_sysfs_compare(const void* a,const void* b)
+{
+    const usb_sysfs_entry *x = (const usb_sysfs_entry*)a,*y = (const usb_sysfs_entry*)b;
+    int i;
+
+    if(x->busnum != y->busnum)
+        return x->busnum-y->busnum;
+    for(i=0;i<x->level&&i<y->level;i++){
+        if(x->ports[i] != y->ports[i])
+            return x->ports[i]-y->ports[i];
+    }
+    return x->level-y->level;
+}
+
+extern int usb_compare_device_names(const char* a,const char* b)
+{
+    usb_sysfs_entry x,y;
+
+    if(usb_sysfs_parse_name(a,&x) || usb_sysfs_parse_name(b,&y))
+        return strcmp(a,b);
+    return usb_sysfs_compare(&x,&y);
+}
+
+/* read a text attribute without its trailing newline, return the length */
+static int usb_sysfs_read_attr(int dirfd,const char* name,char* buf,size_t size)
+{
+    ssize_t len;
+    int fd;
+
+    fd = openat(dirfd,name,O_RDONLY|O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+    len = read(fd,buf,size-1);
+    close(fd);
+    if(len < 0)
+        return -1;
+
+    if(len && buf[len-1] == '\n')
+        len--;
+    buf[len] = 0x00;
+    return len;
+}
+
+static int usb_sysfs_read_int(int dirfd,const char* name,int* value)
+{
+    char buf[32];
+
+    if(usb_sysfs_read_attr(dirfd,name,buf,sizeof(buf)) <= 0)
+        return -1;
+    usb_parse_int(buf,10,value);
+    return 0;
+}
+
+static char* usb_sysfs_read_string(usb_arena* arena,int dirfd,const char* name)
+{
+    char buf[SYSFS_ATTR_SIZE];
+    int len;
+
+    len = usb_sysfs_read_attr(dirfd,name,buf,sizeof(buf));
+    if(len < 0)
+        return NULL;
+    return usb_arena_strndup(arena,buf,len);
+}
+
+/* the same for a string many devices have, kept once in the tree */
+static char* usb_sysfs_read_shared(usb_sysfs_worker* worker,int dirfd,const char* name)
+{
+    char buf[SYSFS_ATTR_SIZE];
+    int len;
+
+    len = usb_sysfs_read_attr(dirfd,name,buf,sizeof(buf));
+    if(len < 0)
+        return NULL;
+    return usb_tree_string_locked(worker->tree,buf,len);
+}
+
+/* driver and location of an interface of the active config, name is the device part of its directory */
+static void usb_sysfs_add_driver(usb_sysfs_worker* worker,int devfd,const char* name,
+                                 usb_device_config* config,usb_device_interface* interface)
+{
+    struct usb_device_tree *tree = worker->tree;
+    char path[PATH_MAX],link[PATH_MAX/2];
+    const char *driver;
+    ssize_t len;
+
+    snprintf(path,sizeof(path),"%s:%d.%d/driver",name,
+             config->bConfigurationValue,interface->bInterfaceNumber);
+    len = readlinkat(devfd,path,link,sizeof(link)-1);
+    if(len <= 0){
+        interface->driver = (char*)usb_no_driver;
+        return;
+    }
+    link[len] = 0x00;
+    driver = strrchr(link,'/');
+    driver = driver?driver+1:link;
+    interface->driver = usb_tree_string_locked(tree,driver,strlen(driver));
+    interface->attached = 1;
+    if(!(worker->flags & USB_ENUM_DEVPATH) || !usb_filter_interface(worker->filter,interface))
+        return;
+
+    snprintf(path,sizeof(path),"%s/%s/%s:%d.%d",tree->sysfs_root,SYSFS_DEVICE_PATH,name,
+             config->bConfigurationValue,interface->bInterfaceNumber);
+    interface->location = usb_arena_strdup(worker->arena,path);
+}
+
+/* the device directory an interface is looked up in, for usb_sysfs_attach */
+typedef struct usb_sysfs_device {
+    usb_sysfs_worker        *worker;
+    int                     devfd;
+    const char              *name;
+} usb_sysfs_device;
+
+static void usb_sysfs_attach(usb_descriptor_walk* walk,usb_device_interface* interface)
+{
+    usb_sysfs_device *dir = (usb_sysfs_device*)walk->data;
+
+    usb_sysfs_add_driver(dir->worker,dir->devfd,dir->name,walk->config,interface);
+}
+
+/* read everything about a device but where it sits in the tree */
+static usb_device_info* usb_sysfs_read_device(usb_sysfs_worker* worker,const usb_sysfs_entry* entry)
+{
+    usb_arena *arena = worker->arena;
+    usb_device_info *device;
+    usb_descriptor_walk walk;
+    usb_sysfs_device dir;
+    const unsigned char *desc;
+    char name[sizeof(entry->name)];
+    int devfd,fd,active = 0;
+    ssize_t len = -1;
+
+    devfd = openat(worker->dirfd,entry->name,O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(devfd < 0){
+        USBVIEW_LOG_ERROR("open %s failed!%s",entry->name,strerror(errno));
+        return NULL;
+    }
+    fd = openat(devfd,"descriptors",O_RDONLY|O_CLOEXEC);
+    if(fd >= 0){
+        len = usb_read_fd(fd,&worker->buffer,&worker->size);
+        close(fd);
+    }
+    desc = (const unsigned char*)worker->buffer;
+    if(len < USB_DT_DEVICE_SIZE || desc[1] != USB_DT_DEVICE){
+        USBVIEW_LOG_ERROR("%s has no device descriptor!",entry->name);
+        close(devfd);
+        return NULL;
+    }
+
+    device = ARENA_NEW_ARRAY(usb_device_info,1,arena);
+    device->busnum = entry->busnum;
+    device->level = entry->level;
+    if(entry->level)
+        device->portNumber = entry->ports[entry->level-1]-1;
+    usb_sysfs_read_int(devfd,"devnum",&device->devnum);
+    usb_sysfs_read_int(devfd,"speed",&device->speed);
+    if(desc[4] == USB_CLASS_HUB)
+        usb_sysfs_read_int(devfd,"maxchild",&device->maxchild);
+
+    usb_descriptor_device(worker->tree,device,desc);
+
+    /* the kernel only has the strings the descriptor has an index for */
+    if(desc[14] && (worker->flags & USB_ENUM_STRINGS))
+        device->manufacturer = usb_sysfs_read_shared(worker,devfd,"manufacturer");
+    if(desc[15] && (worker->flags & USB_ENUM_STRINGS))
+        device->product = usb_sysfs_read_shared(worker,devfd,"product");
+    if(desc[16] && (worker->flags & USB_ENUM_STRINGS))
+        device->serial = usb_sysfs_read_string(arena,devfd,"serial");
+
+    /* a device filtered out keeps no configs, as in the text dump */
+    if(device->bNumConfigurations && (worker->flags & USB_ENUM_INTERFACES) &&
+            usb_filter_device(worker->filter,device)){
+        usb_sysfs_read_int(devfd,"bConfigurationValue",&active);
+        /* interfaces of a root hub are named after port 0, 1-0:1.0 */
+        if(entry->level)
+            strcpy(name,entry->name);
+        else
+            snprintf(name,sizeof(name),"%d-0",entry->busnum);
+        memset(&walk,0,sizeof(walk));
+        walk.arena = arena;
+        walk.device = device;
+        walk.flags = worker->flags;
+        walk.active = active;
+        walk.attach = usb_sysfs_attach;
+        walk.data = &dir;
+        dir.worker = worker;
+        dir.devfd = devfd;
+        dir.name = name;
+        usb_walk_descriptors(&walk,desc+USB_DT_DEVICE_SIZE,len-USB_DT_DEVICE_SIZE);
+    }
+
+    close(devfd);
+    return device;
+}
+
+/* devices must be linked in the order of their entries */
+static void usb_sysfs_link_device(usb_sysfs_context* ctx,const usb_sysfs_entry* entry,usb_device_info* device)
+{
+    const usb_sysfs_entry *up;
+    usb_device_info *parent = NULL;
+
+    /* the parent was sorted right before its first child */
+    if(entry->level){
+        up = ctx->entries[entry->level-1];
+        if(up && up->busnum == entry->busnum &&
+                memcmp(up->ports,entry->ports,(entry->level-1)*sizeof(int)) == 0)
+            parent = ctx->devices[entry->level-1];
+        device->connectorNumber = ++ctx->counts[entry->level];
+    }
+
+    usb_link_device(&ctx->parse,device,parent?parent->devnum:-1);
+    ctx->entries[entry->level] = entry;
+    ctx->devices[entry->level] = device;
+    if(entry->level < USB_MAX_DEPTH)
+        ctx->counts[entry->level+1] = 0;
+}
+
+/* the device directories under path, sorted */
+static usb_sysfs_entry* usb_sysfs_list(const char* path,int* num)
+{
+    usb_sysfs_entry *entries = NULL,*tmp;
+    struct dirent *dir_ptr = NULL;
+    int max = 0;
+    DIR *dir;
+
+    *num = 0;
+    dir = opendir(path);
+    if(!dir){
+        USBVIEW_LOG("open %s failed!%s",path,strerror(errno));
+        return NULL;
+    }
+
+    while((dir_ptr = readdir(dir))){
+        if(*num == max){
+            max = max?max*2:64;
+            tmp = (usb_sysfs_entry*)realloc(entries,max*sizeof(usb_sysfs_entry));
+            if(!tmp)
+                break;
+            entries = tmp;
+        }
+        if(usb_sysfs_parse_name(dir_ptr->d_name,&entries[*num]) == 0)
+            (*num)++;
+    }
+    closedir(dir);
+
+    if(entries)
+        qsort(entries,*num,sizeof(usb_sysfs_entry),usb_sysfs_compare);
+    return entries;
+}
+
+static struct usb_device_tree* usb_sysfs_new_tree(const char* sysfs_root,const char* dev_root)
+{
+    struct usb_device_tree *tree = usb_new_tree();
+
+    if(!tree)
+        return NULL;
+    if(sysfs_root)
+        tree->sysfs_root = usb_arena_strdup(&tree->arena,sysfs_root);
+    if(dev_root)
+        tree->dev_root = usb_arena_strdup(&tree->arena,dev_root);
+    return tree;
+}
+
+static usb_device_info *usb_sysfs_read_devices(const char* sysfs_root,const char* dev_root,
+                                               const usb_device_filter* filter,int flags)
+{
+    usb_sysfs_context ctx;
+    usb_sysfs_worker worker;
+    usb_sysfs_entry *entries;
+    usb_device_info *device;
+    char path[PATH_MAX];
+    int num = 0,i;
+
+    memset(&ctx,0,sizeof(ctx));
+    memset(&worker,0,sizeof(worker));
+    ctx.parse.tree = usb_sysfs_new_tree(sysfs_root,dev_root);
+    if(!ctx.parse.tree)
+        return NULL;
+
+    snprintf(path,sizeof(path),"%s/%s",ctx.parse.tree->sysfs_root,SYSFS_DEVICE_PATH);
+    entries = usb_sysfs_list(path,&num);
+    worker.tree = ctx.parse.tree;
+    worker.arena = &ctx.parse.tree->arena;
+    worker.filter = filter;
+    worker.flags = usb_enum_normalize(flags);
+    worker.dirfd = open(path,O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+    for(i=0;i<num&&worker.dirfd>=0;i++){
+        device = usb_sysfs_read_device(&worker,&entries[i]);
+        if(device)
+            usb_sysfs_link_device(&ctx,&entries[i],device);
+    }
+
+    if(worker.dirfd >= 0)
+        close(worker.dirfd);
+    free(worker.buffer);
+    free(entries);
+
+    if(!ctx.parse.head)
+        usb_free_tree(ctx.parse.tree);
+    return ctx.parse.head;
+}
+
+extern usb_device_info *get_usb_devices_sysfs(const char* sysfs_root,const char* dev_root)
+{
+    return usb_sysfs_read_devices(sysfs_root,dev_root,NULL,USB_ENUM_ALL);
+}
+
+/**********************Funs of parallel sysfs****************************************/
+
+#define USB_MAX_WORKERS         16
+
+/* the devices of one enumeration, handed out one at a time */
+typedef struct usb_sysfs_jobs {
+    const usb_sysfs_entry   *entries;
+    usb_device_info         **devices;  /* what was read for each entry */
+    int                     num;
+    int                     next;       /* next entry to read, taken atomically */
+} usb_sysfs_jobs;
+
+typedef struct usb_sysfs_thread {
+    pthread_t               thread;
+    usb_sysfs_worker        worker;
+    usb_arena               arena;
+    usb_sysfs_jobs          *jobs;
+} usb_sysfs_thread;
+
+static void* usb_sysfs_work(void* arg)
+{
+    usb_sysfs_thread *thread = (usb_sysfs_thread*)arg;
+    usb_sysfs_jobs *jobs = thread->jobs;
+    int i;
+
+    while((i = __sync_fetch_and_add(&jobs->next,1)) < jobs->num)
+        jobs->devices[i] = usb_sysfs_read_device(&thread->worker,&jobs->entries[i]);
+
+    return NULL;
+}
+
+/*
+ * Like get_usb_devices_sysfs, but the devices are read by up to workers
+ * threads, the caller included; 0 means one per online cpu. The entries
+ * are sorted by bus, so every bus is spread over the pool, and each
+ * thread allocates from its own arena. Linking is done afterwards in
+ * entry order, so the tree is the same as the sequential one.
+ */
+extern usb_device_info *get_usb_devices_parallel(const char* sysfs_root,const char* dev_root,int workers)
+{
+    usb_sysfs_context ctx;
+    usb_sysfs_jobs jobs;
+    usb_sysfs_thread *threads = NULL;
+    usb_sysfs_entry *entries;
+    char path[PATH_MAX];
+    int num = 0,dirfd,i;
+
+    if(workers <= 0)
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(workers > USB_MAX_WORKERS)
+        workers = USB_MAX_WORKERS;
+
+    memset(&ctx,0,sizeof(ctx));
+    ctx.parse.tree = usb_sysfs_new_tree(sysfs_root,dev_root);
+    if(!ctx.parse.tree)
+        return NULL;
+
+    snprintf(path,sizeof(path),"%s/%s",ctx.parse.tree->sysfs_root,SYSFS_DEVICE_PATH);
+    entries = usb_sysfs_list(path,&num);
+    dirfd = open(path,O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(workers > num)
+        workers = num;
+
+    memset(&jobs,0,sizeof(jobs));
+    jobs.entries = entries;
+    jobs.num = num;
+    jobs.devices = (usb_device_info**)calloc(num?num:1,sizeof(usb_device_info*));
+    threads = (usb_sysfs_thread*)calloc(workers?workers:1,sizeof(usb_sysfs_thread));
+    if(dirfd < 0 || !jobs.devices || !threads)
+        workers = 0;
+
+    for(i=0;i<workers;i++){
+        usb_arena_init(&threads[i].arena);
+        threads[i].jobs = &jobs;
+        threads[i].worker.tree = ctx.parse.tree;
+        threads[i].worker.flags = USB_ENUM_ALL;
+        threads[i].worker.arena = &threads[i].arena;
+        threads[i].worker.dirfd = dirfd;
+    }
+    /* the caller is worker 0, a thread that fails to start leaves more to the others */
+    for(i=1;i<workers;i++){
+        if(pthread_create(&threads[i].thread,NULL,usb_sysfs_work,&threads[i]) != 0)
+            threads[i].jobs = NULL;
+    }
+    if(workers)
+        usb_sysfs_work(&threads[0]);
+
+    for(i=0;i<workers;i++){
+        if(i && threads[i].jobs)
+            pthread_join(threads[i].thread,NULL);
+        usb_arena_adopt(&ctx.parse.tree->arena,&threads[i].arena);
+        free(threads[i].worker.buffer);
+    }
+
+    for(i=0;i<num&&workers;i++){
+        if(jobs.devices[i])
+            usb_sysfs_link_device(&ctx,&entries[i],jobs.devices[i]);
+    }
+
+    if(dirfd >= 0)
+        close(dirfd);
+    free(threads);
+    free(jobs.devices);
+    free(entries);
+
+    if(!ctx.parse.head)
+        usb_free_tree(ctx.parse.tree);
+    return ctx.parse.head;
+}
+
+/**********************Funs of visitors****************************************/
+
+/* what is read at once, of descriptors, directory entries or dump lines */
+#define USB_VISIT_BUFSIZE       4096
+#define USB_VISIT_DRIVER_SIZE   64
+
+/* the record getdents64 fills, glibc only has a wrapper for it since 2.30 */
+typedef struct usb_visit_dirent {
+    uint64_t        d_ino;
+    int64_t         d_off;
+    unsigned short  d_reclen;
+    unsigned char   d_type;
+    char            d_name[];
+} usb_visit_dirent;
+
+/*
+ * One device at a time, on the stack of usb_enumerate_visit: what the
+ * callbacks are given is overwritten by what comes next.
+ */
+typedef struct usb_visit {
+    const usb_visitor       *visitor;
+    void                    *ctx;
+    int                     flags;          /* USB_ENUM_*, less what no callback looks at */
+    int                     action;         /* USB_VISIT_* for the device */
+    int                     devices;        /* devices seen */
+    usb_device_info         device;
+    usb_device_config       config;
+    usb_device_interface    interface;
+    usb_device_endpoint     endpoint;
+    usb_device_bandwidth    bandwidth;
+    int                     nconfig;        /* configs seen of device */
+    int                     ninterface;     /* interfaces seen of config, -1 without one */
+    int                     nendpoint;      /* endpoints seen of interface, -1 without one */
+    int                     pending;        /* device not handed to on_device yet, dumps only */
+    /* where drivers are found, sysfs only */
+    const char              *sysfs_root;
+    int                     devfd;
+    const char              *name;          /* device part of the interface directories */
+    int                     active;         /* value of the config in use */
+    int                     ports[USB_MAX_DEPTH+1];     /* port of the last device at each level, dumps only */
+    char                    sysname[32];    /* of the device under sysfs, "usb1" or "1-1.2" */
+    char                    version[8];
+    char                    bcd[8];
+    char                    manufacturer[SYSFS_ATTR_SIZE];
+    char                    product[SYSFS_ATTR_SIZE];
+    char                    serial[SYSFS_ATTR_SIZE];
+    char                    driver[USB_VISIT_DRIVER_SIZE];
+    char                    location[PATH_MAX];
+} usb_visit;
+
+/* there is nothing to read for a level no callback is there for */
+static int usb_visit_flags(const usb_visitor* visitor)
+{
+    int flags = usb_enum_normalize(visitor->flags);
+
+    if(!visitor->on_endpoint)
+        flags &= ~USB_ENUM_ENDPOINTS;
+    if(!visitor->on_interface)
+        flags &= ~USB_ENUM_DEVPATH;
+    if(!visitor->on_config && !visitor->on_interface && !visitor->on_endpoint)
+        flags &= ~USB_ENUM_INTERFACES;
+    return flags;
+}
+
+static void usb_visit_call_device(usb_visit* visit)
+{
+    visit->devices++;
+    if(visit->visitor->on_device)
+        visit->action = visit->visitor->on_device(visit->ctx,&visit->device);
+}
+
+static void usb_visit_call_config(usb_visit* visit)
+{
+    if(visit->visitor->on_config)
+        visit->action = visit->visitor->on_config(visit->ctx,&visit->device,&visit->config);
+}
+
+static void usb_visit_call_interface(usb_visit* visit)
+{
+    if(visit->visitor->on_interface)
+        visit->action = visit->visitor->on_interface(visit->ctx,&visit->device,&visit->config,&visit->interface);
+}
+
+static void usb_visit_call_endpoint(usb_visit* visit)
+{
+    if(visit->visitor->on_endpoint)
+        visit->action = visit->visitor->on_endpoint(visit->ctx,&visit->device,&visit->interface,&visit->endpoint);
+}
+
+/* a copy of what str points to, which is only good until the buffer moves, cut to size */
+static char* usb_visit_copy(char* buf,size_t size,const char* str)
+{
+    size_t len;
+
+    if(!str)
+        return NULL;
+    len = strnlen(str,size-1);
+    memcpy(buf,str,len);
+    buf[len] = 0x00;
+    return buf;
+}
+
+static void usb_visit_new_device(usb_visit* visit)
+{
+    memset(&visit->device,0,sizeof(visit->device));
+    visit->action = USB_VISIT_CONTINUE;
+    visit->nconfig = 0;
+    visit->ninterface = -1;
+    visit->nendpoint = -1;
+    visit->active = 0;
+}
+
+/* the same checks as the parsers that build trees, what they drop is not visited */
+static int usb_visit_new_config(usb_visit* visit)
+{
+    visit->ninterface = -1;
+    visit->nendpoint = -1;
+    if(visit->nconfig >= visit->device.bNumConfigurations)
+        return 0;
+    memset(&visit->config,0,sizeof(visit->config));
+    visit->nconfig++;
+    visit->ninterface = 0;
+    return 1;
+}
+
+static int usb_visit_new_interface(usb_visit* visit)
+{
+    visit->nendpoint = -1;
+    if(visit->ninterface < 0 || visit->ninterface >= visit->config.bNumInterfaces)
+        return 0;
+    memset(&visit->interface,0,sizeof(visit->interface));
+    visit->ninterface++;
+    visit->nendpoint = 0;
+    return 1;
+}
+
+static int usb_visit_new_endpoint(usb_visit* visit)
+{
+    if(visit->nendpoint < 0 || visit->nendpoint >= visit->interface.bNumEndpoints ||
+            !(visit->flags & USB_ENUM_ENDPOINTS))
+        return 0;
+    memset(&visit->endpoint,0,sizeof(visit->endpoint));
+    visit->nendpoint++;
+    return 1;
+}
+
+/* driver and location of an interface of the active config, as usb_sysfs_add_driver */
+static void usb_visit_driver(usb_visit* visit)
+{
+    usb_device_interface *interface = &visit->interface;
+    char path[PATH_MAX],link[PATH_MAX/2];
+    const char *driver;
+    ssize_t len;
+
+    snprintf(path,sizeof(path),"%s:%d.%d/driver",visit->name,
+             visit->config.bConfigurationValue,interface->bInterfaceNumber);
+    len = readlinkat(visit->devfd,path,link,sizeof(link)-1);
+    if(len <= 0){
+        interface->driver = (char*)usb_no_driver;
+        return;
+    }
+    link[len] = 0x00;
+    driver = strrchr(link,'/');
+    interface->driver = usb_visit_copy(visit->driver,sizeof(visit->driver),driver?driver+1:link);
+    interface->attached = 1;
+    if(!(visit->flags & USB_ENUM_DEVPATH))
+        return;
+
+    snprintf(visit->location,sizeof(visit->location),"%s/%s/%s:%d.%d",visit->sysfs_root,SYSFS_DEVICE_PATH,
+             visit->name,visit->config.bConfigurationValue,interface->bInterfaceNumber);
+    interface->location = visit->location;
+}
+
+static void usb_visit_descriptor(usb_visit* visit,const unsigned char* p)
+{
+    usb_device_interface last;
+
+    switch(p[1]){
+    case USB_DT_CONFIG:
+        if(p[0] < USB_DT_CONFIG_SIZE || !usb_visit_new_config(visit))
+            break;
+        usb_decode_config(&visit->config,p,visit->device.speed);
+        usb_visit_call_config(visit);
+        break;
+
+    case USB_DT_INTERFACE:
+        /* alt settings share the directory of the one before */
+        last = visit->interface;
+        if(p[0] < USB_DT_INTERFACE_SIZE || !usb_visit_new_interface(visit))
+            break;
+        usb_decode_interface(&visit->interface,p);
+        if(visit->active && visit->config.bConfigurationValue == visit->active){
+            if(visit->ninterface > 1 && last.bInterfaceNumber == visit->interface.bInterfaceNumber){
+                visit->interface.driver = last.driver;
+                visit->interface.location = last.location;
+                visit->interface.attached = last.attached;
+            }else{
+                usb_visit_driver(visit);
+            }
+        }
+        usb_visit_call_interface(visit);
+        break;
+
+    case USB_DT_ENDPOINT:
+        if(p[0] < USB_DT_ENDPOINT_SIZE || !usb_visit_new_endpoint(visit))
+            break;
+        usb_decode_endpoint(&visit->endpoint,p,visit->device.speed);
+        usb_visit_call_endpoint(visit);
+        break;
+    }
+}
+
+/* one read of fd after len bytes of buf, the new length */
+static ssize_t usb_visit_read(int fd,unsigned char* buf,size_t len,size_t size)
+{
+    ssize_t n;
+
+    do{
+        n = read(fd,buf+len,size-len);
+    }while(n < 0 && errno == EINTR);
+    return n>0?(ssize_t)len+n:(ssize_t)len;
+}
+
+/*
+ * The descriptors of fd that follow the device descriptor, which buf holds
+ * with len bytes in all. A descriptor is 255 bytes at most, so what is left
+ * of one at the end of buf always fits in front of the next read.
+ */
+static void usb_visit_descriptors(usb_visit* visit,int fd,unsigned char* buf,size_t len)
+{
+    size_t off = USB_DT_DEVICE_SIZE;
+    ssize_t more;
+
+    while(visit->action == USB_VISIT_CONTINUE){
+        for(;len-off >= 2 && buf[off] >= 2 && buf[off] <= len-off &&
+                visit->action == USB_VISIT_CONTINUE;off += buf[off])
+            usb_visit_descriptor(visit,buf+off);
+        if(visit->action != USB_VISIT_CONTINUE || (len-off >= 1 && buf[off] < 2))
+            break;
+
+        memmove(buf,buf+off,len-off);
+        len -= off;
+        off = 0;
+        more = usb_visit_read(fd,buf,len,USB_VISIT_BUFSIZE);
+        if(more <= (ssize_t)len)
+            break;
+        len = more;
+    }
+}
+
+static void usb_visit_sysfs_device(usb_visit* visit,int dirfd,const usb_sysfs_entry* entry)
+{
+    usb_device_info *device = &visit->device;
+    unsigned char buf[USB_VISIT_BUFSIZE];
+    char name[sizeof(entry->name)];
+    ssize_t len = 0,more;
+    int devfd,fd;
+
+    devfd = openat(dirfd,entry->name,O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(devfd < 0){
+        USBVIEW_LOG_ERROR("open %s failed!%s",entry->name,strerror(errno));
+        return;
+    }
+    fd = openat(devfd,"descriptors",O_RDONLY|O_CLOEXEC);
+    for(;fd >= 0 && len < USB_DT_DEVICE_SIZE;len = more){
+        more = usb_visit_read(fd,buf,len,sizeof(buf));
+        if(more <= len)
+            break;
+    }
+    if(len < USB_DT_DEVICE_SIZE || buf[1] != USB_DT_DEVICE){
+        USBVIEW_LOG_ERROR("%s has no device descriptor!",entry->name);
+        if(fd >= 0)
+            close(fd);
+        close(devfd);
+        return;
+    }
+
+    usb_visit_new_device(visit);
+    device->name = usb_visit_copy(visit->sysname,sizeof(visit->sysname),entry->name);
+    device->busnum = entry->busnum;
+    device->level = entry->level;
+    if(entry->level)
+        device->portNumber = entry->ports[entry->level-1]-1;
+    usb_sysfs_read_int(devfd,"devnum",&device->devnum);
+    usb_sysfs_read_int(devfd,"speed",&device->speed);
+    if(buf[4] == USB_CLASS_HUB)
+        usb_sysfs_read_int(devfd,"maxchild",&device->maxchild);
+
+    usb_decode_device(device,buf);
+    usb_format_bcd(visit->version,sizeof(visit->version),USB_LE16(buf+2));
+    usb_format_bcd(visit->bcd,sizeof(visit->bcd),USB_LE16(buf+12));
+    device->version = visit->version;
+    device->bcdDevice = visit->bcd;
+
+    if(buf[14] && (visit->flags & USB_ENUM_STRINGS) &&
+            usb_sysfs_read_attr(devfd,"manufacturer",visit->manufacturer,sizeof(visit->manufacturer)) >= 0)
+        device->manufacturer = visit->manufacturer;
+    if(buf[15] && (visit->flags & USB_ENUM_STRINGS) &&
+            usb_sysfs_read_attr(devfd,"product",visit->product,sizeof(visit->product)) >= 0)
+        device->product = visit->product;
+    if(buf[16] && (visit->flags & USB_ENUM_STRINGS) &&
+            usb_sysfs_read_attr(devfd,"serial",visit->serial,sizeof(visit->serial)) >= 0)
+        device->serial = visit->serial;
+
+    usb_visit_call_device(visit);
+    if(visit->action == USB_VISIT_CONTINUE && device->bNumConfigurations &&
+            (visit->flags & USB_ENUM_INTERFACES)){
+        usb_sysfs_read_int(devfd,"bConfigurationValue",&visit->active);
+        if(entry->level)
+            strcpy(name,entry->name);
+        else
+            snprintf(name,sizeof(name),"%d-0",entry->busnum);
+        visit->devfd = devfd;
+        visit->name = name;
+        usb_visit_descriptors(visit,fd,buf,len);
+    }
+
+    close(fd);
+    close(devfd);
+}
+
+/* the devices under sysfs_root in the order the directory lists them, -1 without one */
+static int usb_visit_sysfs(usb_visit* visit,const char* sysfs_root)
+{
+    char buf[USB_VISIT_BUFSIZE] __attribute__((aligned(8)));
+    char path[PATH_MAX];
+    usb_sysfs_entry entry;
+    usb_visit_dirent *dirent;
+    long len,off;
+    int dirfd;
+
+    snprintf(path,sizeof(path),"%s/%s",sysfs_root,SYSFS_DEVICE_PATH);
+    dirfd = open(path,O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(dirfd < 0){
+        USBVIEW_LOG("open %s failed!%s",path,strerror(errno));
+        return -1;
+    }
+    visit->sysfs_root = sysfs_root;
+
+    /* readdir() would allocate the DIR, the entries are read straight into buf */
+    while(visit->action != USB_VISIT_STOP &&
+            (len = syscall(SYS_getdents64,dirfd,buf,sizeof(buf))) > 0){
+        for(off=0;off<len && visit->action != USB_VISIT_STOP;off+=dirent->d_reclen){
+            dirent = (usb_visit_dirent*)(buf+off);
+            if(usb_sysfs_parse_name(dirent->d_name,&entry) == 0)
+                usb_visit_sysfs_device(visit,dirfd,&entry);
+        }
+    }
+    close(dirfd);
+
+    return visit->devices?0:-1;
+}
+
+/* a device of a dump is handed over once its S: lines are all there */
+static void usb_visit_flush(usb_visit* visit)
+{
+    if(!visit->pending)
+        return;
+    visit->pending = 0;
+    usb_visit_call_device(visit);
+}
+
+/* the ports of the devices above as sysfs names them, "1.2", or "0" for a root hub */
+static void usb_visit_ports(usb_visit* visit,char* buf,size_t size)
+{
+    int len = 0,level;
+
+    if(!visit->device.level)
+        snprintf(buf,size,"0");
+    for(level=1;level<=visit->device.level;level++)
+        len += snprintf(buf+len,size-len,len?".%d":"%d",visit->ports[level]);
+}
+
+/* the directory of an interface */
+static void usb_visit_location(usb_visit* visit)
+{
+    char ports[USB_MAX_DEPTH*4];
+
+    usb_visit_ports(visit,ports,sizeof(ports));
+    snprintf(visit->location,sizeof(visit->location),"%s/%s/%d-%s:%d.%d",
+             usb_default_sysfs_root,SYSFS_DEVICE_PATH,visit->device.busnum,ports,
+             visit->config.bConfigurationValue,visit->interface.bInterfaceNumber);
+    visit->interface.location = visit->location;
+}
+
+static void usb_visit_line(usb_visit* visit,char* line)
+{
+    usb_device_info *device = &visit->device;
+    usb_topology topology;
+    usb_strings strings;
+
+    /* the lines of a config only come after the device is handed over */
+    if(line[0] == 'C' || line[0] == 'I' || line[0] == 'E'){
+        usb_visit_flush(visit);
+        if(visit->action != USB_VISIT_CONTINUE || !visit->devices || !(visit->flags & USB_ENUM_INTERFACES))
+            return;
+    }
+
+    switch(line[0]){
+    case 'T':
+        usb_visit_flush(visit);
+        if(visit->action == USB_VISIT_STOP)
+            return;
+        usb_visit_new_device(visit);
+        memset(&topology,0,sizeof(topology));
+        usb_parse_fields(line,topology_fields,USB_FIELD_NUM(topology_fields),&topology);
+        device->busnum          = topology.busnum;
+        device->level           = topology.level;
+        device->portNumber      = topology.portNumber;
+        device->connectorNumber = topology.connectorNumber;
+        device->devnum          = topology.devnum==-1?0:topology.devnum;
+        device->speed           = topology.speed;
+        device->maxchild        = topology.maxchild;
+        if(device->level >= 0 && device->level <= USB_MAX_DEPTH){
+            char ports[USB_MAX_DEPTH*4];
+
+            visit->ports[device->level] = device->portNumber+1;
+            usb_visit_ports(visit,ports,sizeof(ports));
+            if(device->level)
+                snprintf(visit->sysname,sizeof(visit->sysname),"%d-%s",device->busnum,ports);
+            else
+                snprintf(visit->sysname,sizeof(visit->sysname),"usb%d",device->busnum);
+            device->name = visit->sysname;
+        }
+        visit->pending = 1;
+        break;
+
+    case 'B':
+        if(!visit->pending || !(visit->flags & USB_ENUM_BANDWIDTH))
+            break;
+        memset(&visit->bandwidth,0,sizeof(visit->bandwidth));
+        usb_parse_fields(line,bandwidth_fields,USB_FIELD_NUM(bandwidth_fields),&visit->bandwidth);
+        device->bandwidth = &visit->bandwidth;
+        break;
+
+    case 'D':
+        if(!visit->pending)
+            break;
+        usb_parse_fields(line,device_fields,USB_FIELD_NUM(device_fields),device);
+        device->version = usb_visit_copy(visit->version,sizeof(visit->version),device->version);
+        break;
+
+    case 'P':
+        if(!visit->pending)
+            break;
+        usb_parse_fields(line,product_fields,USB_FIELD_NUM(product_fields),device);
+        device->bcdDevice = usb_visit_copy(visit->bcd,sizeof(visit->bcd),device->bcdDevice);
+        break;
+
+    case 'S':
+        if(!visit->pending || !(visit->flags & USB_ENUM_STRINGS))
+            break;
+        memset(&strings,0,sizeof(strings));
+        usb_parse_fields(line,string_fields,USB_FIELD_NUM(string_fields),&strings);
+        if(strings.manufacturer && !device->manufacturer)
+            device->manufacturer = usb_visit_copy(visit->manufacturer,sizeof(visit->manufacturer),strings.manufacturer);
+        else if(strings.product && !device->product)
+            device->product = usb_visit_copy(visit->product,sizeof(visit->product),strings.product);
+        else if(strings.serial && !device->serial)
+            device->serial = usb_visit_copy(visit->serial,sizeof(visit->serial),strings.serial);
+        break;
+
+    case 'C':
+        if(!usb_visit_new_config(visit))
+            break;
+        usb_parse_fields(line,config_fields,USB_FIELD_NUM(config_fields),&visit->config);
+        usb_visit_call_config(visit);
+        break;
+
+    case 'I':
+        if(!usb_visit_new_interface(visit))
+            break;
+        usb_parse_fields(line,interface_fields,USB_FIELD_NUM(interface_fields),&visit->interface);
+        if(visit->interface.driver && strcmp(visit->interface.driver,usb_no_driver) == 0)
+            visit->interface.driver = (char*)usb_no_driver;
+        else
+            visit->interface.driver = usb_visit_copy(visit->driver,sizeof(visit->driver),visit->interface.driver);
+        visit->interface.attached = visit->interface.driver && visit->interface.driver != usb_no_driver;
+        if(visit->interface.attached && (visit->flags & USB_ENUM_DEVPATH))
+            usb_visit_location(visit);
+        usb_visit_call_interface(visit);
+        break;
+
+    case 'E':
+        if(!usb_visit_new_endpoint(visit))
+            break;
+        usb_parse_fields(line,endpoint_fields,USB_FIELD_NUM(endpoint_fields),&visit->endpoint);
+        usb_visit_call_endpoint(visit);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/*
+ * The lines of a dump, a buffer at a time. A line longer than the buffer,
+ * which the kernel never writes, is cut and the rest of it dropped.
+ */
+static int usb_visit_text(usb_visit* visit,const char* file)
+{
+    char buf[USB_VISIT_BUFSIZE+USB_SCAN_PADDING+1];
+    char *line,*end,*eol;
+    size_t len = 0;
+    ssize_t more;
+    int fd,drop = 0;
+
+    fd = open(file,O_RDONLY|O_CLOEXEC);
+    if(fd < 0){
+        USBVIEW_LOG_ERROR("open %s failed!%s",file,strerror(errno));
+        return -1;
+    }
+
+    while(visit->action != USB_VISIT_STOP){
+        more = usb_visit_read(fd,(unsigned char*)buf,len,USB_VISIT_BUFSIZE);
+        /* the last line may have no newline */
+        if(more <= (ssize_t)len && !len)
+            break;
+        if(more <= (ssize_t)len)
+            buf[len++] = '\n';
+        else
+            len = more;
+        /* the end is followed by zeros, so it can be written too */
+        memset(buf+len,0,USB_SCAN_PADDING+1);
+
+        line = buf;
+        end = buf+len;
+        while(visit->action != USB_VISIT_STOP && (eol = (char*)usb_scan_line(line,end)) < end){
+            *eol = 0x00;
+            if(!drop)
+                usb_visit_line(visit,line);
+            drop = 0;
+            line = eol+1;
+        }
+        if(line == buf && len == USB_VISIT_BUFSIZE){
+            usb_visit_line(visit,line);
+            drop = 1;
+            line = end;
+        }
+        len = end-line;
+        memmove(buf,line,len);
+    }
+    usb_visit_flush(visit);
+    close(fd);
+
+    return visit->devices?0:-1;
+}
+
+static void usb_visit_init(usb_visit* visit,const usb_visitor* visitor,void* ctx)
+{
+    memset(visit,0,sizeof(usb_visit));
+    visit->visitor = visitor;
+    visit->ctx = ctx;
+    visit->flags = usb_visit_flags(visitor);
+}
+
+/*
+ * Nothing is allocated: the devices are read one by one into the stack of
+ * the call and handed to the callbacks, in the order sysfs lists them.
+ */
+extern int usb_enumerate_visit(const usb_visitor* visitor,void* ctx)
+{
+    usb_visit visit;
+
+    if(!visitor)
+        return -1;
+    usb_visit_init(&visit,visitor,ctx);
+    if(usb_visit_sysfs(&visit,usb_default_sysfs_root) &&
+            (!is_sysfs_has_usb_devices() ||
+             usb_visit_text(&visit,sysfs_usb_devices_files[sysfs_has_usb_devices-1])))
+        return -1;
+    return visit.action==USB_VISIT_STOP?USB_VISIT_STOP:0;
+}
+
+extern int usb_enumerate_visit_file(const char* file,const usb_visitor* visitor,void* ctx)
+{
+    usb_visit visit;
+
+    if(!file || !visitor)
+        return -1;
+    usb_visit_init(&visit,visitor,ctx);
+    if(usb_visit_text(&visit,file))
+        return -1;
+    return visit.action==USB_VISIT_STOP?USB_VISIT_STOP:0;
+}
+
+/**********************Funs of hotplug****************************************/
+
+/*
+ * A tree can be kept up to date from hotplug events instead of being built
+ * again. Devices are read from sysfs one at a time, and the list, the index
+ * and the children of the hubs are patched so that the tree stays the one a
+ * new enumeration would give. What a patch replaces stays in the arena
+ * until the tree is freed.
+ */
+
+/* where a device of the tree sits, in the terms of usb_sysfs_compare */
+static void usb_tree_entry(const usb_device_info* device,usb_sysfs_entry* entry)
+{
+    const usb_device_info *up = device;
+    int i;
+
+    memset(entry,0,sizeof(usb_sysfs_entry));
+    entry->busnum = device->busnum;
+    entry->level = device->level<USB_MAX_DEPTH?device->level:USB_MAX_DEPTH;
+    for(i=entry->level;i>0&&up;i--,up=up->parent)
+        entry->ports[i-1] = up->portNumber+1;
+}
+
+static usb_device_info* usb_tree_find_entry(struct usb_device_tree* tree,const usb_sysfs_entry* entry)
+{
+    usb_sysfs_entry key;
+    usb_device_info *device;
+
+    for(device=tree->head;device;device=device->next){
+        if(device->busnum != entry->busnum || device->level != entry->level)
+            continue;
+        usb_tree_entry(device,&key);
+        if(usb_sysfs_compare(&key,entry) == 0)
+            return device;
+    }
+    return NULL;
+}
+
+/* children are kept packed and by port, counted from 1 as the kernel does */
+static void usb_tree_sort_children(usb_device_info* hub)
+{
+    usb_device_info *child;
+    int i,j,n = 0;
+
+    for(i=0;i<hub->maxchild;i++){
+        if(hub->children[i])
+            hub->children[n++] = hub->children[i];
+    }
+    for(i=n;i<hub->maxchild;i++)
+        hub->children[i] = NULL;
+    for(i=1;i<n;i++){
+        child = hub->children[i];
+        for(j=i;j>0&&hub->children[j-1]->portNumber>child->portNumber;j--)
+            hub->children[j] = hub->children[j-1];
+        hub->children[j] = child;
+    }
+    for(i=0;i<n;i++)
+        hub->children[i]->connectorNumber = i+1;
+}
+
+/* insert before the first device that sorts after it, the parent must be set */
+static void usb_tree_insert(struct usb_device_tree* tree,usb_device_info* device)
+{
+    usb_sysfs_entry key,entry;
+    usb_device_info **p;
+
+    usb_tree_entry(device,&key);
+    for(p=&tree->head;*p;p=&(*p)->next){
+        usb_tree_entry(*p,&entry);
+        if(usb_sysfs_compare(&key,&entry) < 0)
+            break;
+    }
+    device->next = *p;
+    *p = device;
+}
+
+/* take a device and everything below it out of the tree */
+static void usb_tree_unlink(struct usb_device_tree* tree,usb_device_info* device)
+{
+    usb_device_info *parent = device->parent,**p;
+    int i;
+
+    /* from the last child, unlinking one only moves the ones after it */
+    for(i=device->maxchild-1;i>=0;i--){
+        if(device->children[i])
+            usb_tree_unlink(tree,device->children[i]);
+    }
+
+    if(parent){
+        for(i=0;i<parent->maxchild;i++){
+            if(parent->children[i] == device)
+                parent->children[i] = NULL;
+        }
+        usb_tree_sort_children(parent);
+    }
+    for(p=&tree->head;*p&&*p!=device;p=&(*p)->next);
+    if(*p)
+        *p = device->next;
+    if(usb_index_get(&tree->index,device->busnum,device->devnum) == device)
+        usb_index_remove(&tree->index,device->busnum,device->devnum);
+    device->parent = NULL;
+    device->next = NULL;
+}
+
+/* read one device directory into the arena of the tree */
+static usb_device_info* usb_tree_read(struct usb_device_tree* tree,const usb_sysfs_entry* entry)
+{
+    usb_sysfs_worker worker;
+    usb_device_info *device = NULL;
+    char path[PATH_MAX];
+
+    memset(&worker,0,sizeof(worker));
+    worker.tree = tree;
+    worker.flags = USB_ENUM_ALL;
+    worker.arena = &tree->arena;
+    snprintf(path,sizeof(path),"%s/%s",tree->sysfs_root,SYSFS_DEVICE_PATH);
+    worker.dirfd = open(path,O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(worker.dirfd >= 0){
+        device = usb_sysfs_read_device(&worker,entry);
+        close(worker.dirfd);
+    }
+    free(worker.buffer);
+    if(device)
+        device->tree = tree;
+    return device;
+}
+
+/* "1-1.2:1.0" is an interface of 1-1.2, and "1-0:1.0" one of usb1 */
+static int usb_tree_parse_name(const char* sys_name,usb_sysfs_entry* entry)
+{
+    char name[sizeof(entry->name)];
+    const char *colon = strchr(sys_name,':');
+    int len;
+
+    if(!colon)
+        return usb_sysfs_parse_name(sys_name,entry);
+    len = (int)(colon-sys_name);
+    if(len < 3 || len >= (int)sizeof(name)-3)
+        return -1;
+    if(memcmp(colon-2,"-0",2) == 0)
+        snprintf(name,sizeof(name),"usb%.*s",len-2,sys_name);
+    else
+        snprintf(name,sizeof(name),"%.*s",len,sys_name);
+    return usb_sysfs_parse_name(name,entry);
+}
+
+/*
+ * Read the device sys_name, "1-1.2" or one of its interfaces, and put it in
+ * the tree of root. A device already in the tree is read again in place,
+ * which is what a driver being bound or unbound needs. A NULL root starts a
+ * new tree on /sys. Return the head of the tree, which may have changed.
+ */
+extern usb_device_info* usb_tree_add_device(usb_device_info* root,const char* sys_name)
+{
+    struct usb_device_tree *tree;
+    usb_sysfs_entry entry,up;
+    usb_device_info *device,*old,*parent = NULL;
+    int i;
+
+    if(!sys_name || usb_tree_parse_name(sys_name,&entry))
+        return root;
+    tree = root?root->tree:usb_new_tree();
+    if(!tree)
+        return root;
+    device = usb_tree_read(tree,&entry);
+    if(!device){
+        if(!root)
+            usb_free_tree(tree);
+        return root;
+    }
+
+    old = usb_tree_find_entry(tree,&entry);
+    if(old && old->devnum == device->devnum){
+        /* the links stay, a hub does not change its port count */
+        device->parent = old->parent;
+        device->children = old->children;
+        device->maxchild = old->maxchild;
+        device->connectorNumber = old->connectorNumber;
+        device->bandwidth = old->bandwidth;
+        device->next = old->next;
+        *old = *device;
+        return tree->head;
+    }
+    /* a remove that was missed, the port has a new device now */
+    if(old)
+        usb_tree_unlink(tree,old);
+
+    if(entry.level){
+        up = entry;
+        up.level--;
+        parent = usb_tree_find_entry(tree,&up);
+        if(!parent)
+            USBVIEW_LOG_ERROR("can't find parent of %s!",entry.name);
+    }
+    device->parent = parent;
+    if(device->maxchild)
+        device->children = TREE_NEW_ARRAY(usb_device_info*,device->maxchild,tree);
+    if(parent){
+        for(i=0;i<parent->maxchild&&parent->children[i]!=NULL;++i);
+        if(i<parent->maxchild){
+            parent->children[i] = device;
+            usb_tree_sort_children(parent);
+        }else{
+            USBVIEW_LOG_ERROR("parrent(%02x:%02x) has too much child!",parent->busnum,parent->devnum);
+        }
+    }
+
+    usb_index_put(&tree->index,device->busnum,device->devnum,device);
+    usb_tree_insert(tree,device);
+    return tree->head;
+}
+
+/*
+ * Take the device and everything below it out of the tree of root. Return
+ * the head of the tree, or NULL once the last device is gone and the tree
+ * is freed.
+ */
+extern usb_device_info* usb_tree_remove_device(usb_device_info* root,int busnum,int devnum)
+{
+    struct usb_device_tree *tree;
+    usb_device_info *device;
+
+    if(!root)
+        return NULL;
+    tree = root->tree;
+    device = usb_index_get(&tree->index,busnum,devnum);
+    if(!device)
+        return tree->head;
+
+    usb_tree_unlink(tree,device);
+    if(!tree->head){
+        usb_free_tree(tree);
+        return NULL;
+    }
+    return tree->head;
+}
+
+/*
+ * Bandwidth is only in the text dump, on the root hubs, and changes with
+ * every device added or removed. Read it again for a tree parsed from a
+ * dump, a tree from sysfs has none.
+ */
+extern void usb_tree_refresh_bandwidth(usb_device_info* root)
+{
+    usb_topology topology;
+    usb_device_info *hub = NULL;
+    char *buf,*line,*end,*eol;
+    size_t len;
+
+    if(!root || !root->tree->file)
+        return;
+    buf = usb_read_file(root->tree->file,&len);
+    if(!buf)
+        return;
+
+    line = buf;
+    end = buf+len;
+    while(line < end){
+        /* the end is followed by zeros, so it can be written too */
+        eol = (char*)usb_scan_line(line,end);
+        *eol = 0x00;
+
+        if(line[0] == 'T' && line[1] == ':'){
+            memset(&topology,0,sizeof(topology));
+            usb_parse_fields(line,topology_fields,USB_FIELD_NUM(topology_fields),&topology);
+            hub = topology.level?NULL:usb_index_get(&root->tree->index,topology.busnum,topology.devnum);
+        }else if(line[0] == 'B' && line[1] == ':' && hub){
+            if(!hub->bandwidth)
+                hub->bandwidth = TREE_NEW_ARRAY(usb_device_bandwidth,1,root->tree);
+            usb_parse_fields(line,bandwidth_fields,USB_FIELD_NUM(bandwidth_fields),hub->bandwidth);
+        }
+        line = eol+1;
+    }
+    free(buf);
+}
+
+extern int usb_tree_from_dump(const usb_device_info* root)
+{
+    return root && root->tree->file;
+}
+
+/* a deep copy of one device into tree, without its links */
+static usb_device_info* usb_clone_device(struct usb_device_tree* tree,const usb_device_info* from)
+{
+    usb_arena *arena = &tree->arena;
+    usb_device_info *device;
+    usb_device_config *config;
+    usb_device_interface *interface;
+    int i,j,k;
+
+    device = TREE_NEW_ARRAY(usb_device_info,1,tree);
+    *device = *from;
+    device->tree = tree;
+    device->parent = NULL;
+    device->next = NULL;
+    device->name = usb_arena_strdup(arena,from->name);
+    device->version = TREE_STRING(tree,from->version);
+    device->bcdDevice = TREE_STRING(tree,from->bcdDevice);
+    device->manufacturer = TREE_STRING(tree,from->manufacturer);
+    device->product = TREE_STRING(tree,from->product);
+    device->serial = usb_arena_strdup(arena,from->serial);
+    device->children = NULL;
+    if(from->maxchild)
+        device->children = TREE_NEW_ARRAY(usb_device_info*,from->maxchild,tree);
+    if(from->bandwidth){
+        device->bandwidth = TREE_NEW_ARRAY(usb_device_bandwidth,1,tree);
+        *device->bandwidth = *from->bandwidth;
+    }
+    if(!from->config)
+        return device;
+
+    device->config = TREE_NEW_ARRAY(usb_device_config*,from->bNumConfigurations,tree);
+    for(i=0;i<from->bNumConfigurations&&from->config[i];i++){
+        config = device->config[i] = TREE_NEW_ARRAY(usb_device_config,1,tree);
+        *config = *from->config[i];
+        if(!config->interfaces)
+            continue;
+        config->interfaces = TREE_NEW_ARRAY(usb_device_interface*,config->bNumInterfaces,tree);
+        for(j=0;j<config->bNumInterfaces&&from->config[i]->interfaces[j];j++){
+            interface = config->interfaces[j] = TREE_NEW_ARRAY(usb_device_interface,1,tree);
+            *interface = *from->config[i]->interfaces[j];
+            interface->driver = TREE_STRING(tree,interface->driver);
+            interface->path = usb_arena_strdup(arena,interface->path);
+            interface->location = usb_arena_strdup(arena,interface->location);
+            if(!interface->endpoint)
+                continue;
+            interface->endpoint = TREE_NEW_ARRAY(usb_device_endpoint*,interface->bNumEndpoints,tree);
+            for(k=0;k<interface->bNumEndpoints&&from->config[i]->interfaces[j]->endpoint[k];k++){
+                interface->endpoint[k] = TREE_NEW_ARRAY(usb_device_endpoint,1,tree);
+                *interface->endpoint[k] = *from->config[i]->interfaces[j]->endpoint[k];
+            }
+        }
+    }
+    return device;
+}
+
+/*
+ * Copy the whole tree root belongs to into a new one that shares nothing
+ * with it, so that it can be handed out while the original is patched.
+ */
+extern usb_device_info* usb_clone_devices(const usb_device_info* root)
+{
+    const struct usb_device_tree *from;
+    struct usb_device_tree *tree;
+    const usb_device_info *old,*olds[USB_MAX_DEPTH+1];
+    usb_device_info *device,*parent,*news[USB_MAX_DEPTH+1],**tail;
+    int i;
+
+    if(!root)
+        return NULL;
+    from = root->tree;
+    tree = usb_new_tree();
+    if(!tree)
+        return NULL;
+    tree->sysfs_root = usb_arena_strdup(&tree->arena,from->sysfs_root);
+    tree->dev_root = usb_arena_strdup(&tree->arena,from->dev_root);
+    tree->file = usb_arena_strdup(&tree->arena,from->file);
+
+    memset(olds,0,sizeof(olds));
+    tail = &tree->head;
+    for(old=from->head;old;old=old->next){
+        device = usb_clone_device(tree,old);
+        if(!usb_index_get(&tree->index,device->busnum,device->devnum))
+            usb_index_put(&tree->index,device->busnum,device->devnum,device);
+
+        /* parents come before their children, so the copy is on the stack */
+        parent = NULL;
+        if(old->parent){
+            if(old->level > 0 && old->level <= USB_MAX_DEPTH && olds[old->level-1] == old->parent)
+                parent = news[old->level-1];
+            else
+                parent = usb_index_get(&tree->index,old->parent->busnum,old->parent->devnum);
+        }
+        device->parent = parent;
+        for(i=0;parent&&i<old->parent->maxchild&&i<parent->maxchild;i++){
+            if(old->parent->children[i] == old)
+                parent->children[i] = device;
+        }
+        if(old->level >= 0 && old->level <= USB_MAX_DEPTH){
+            olds[old->level] = old;
+            news[old->level] = device;
+        }
+
+        *tail = device;
+        tail = &device->next;
+    }
+
+    if(!tree->head){
+        usb_free_tree(tree);
+        return NULL;
+    }
+    return tree->head;
+}
+
+extern usb_device_info *get_usb_devices()
+{
+    return get_usb_devices_filtered(NULL,USB_ENUM_ALL);
+}
+
+/*
+ * Read only what flags ask for beyond the topology, the ids and the
+ * classes of the devices. With no flag at all nothing but the device
+ * descriptor and a few attributes of each device is read.
+ */
+extern usb_device_info *get_usb_devices_ex(int flags)
+{
+    return get_usb_devices_filtered(NULL,flags);
+}
+
+/*
+ * Devices the filter does not match are still in the tree, so that the
+ * topology holds, but only down to their strings: no config is read and
+ * no device node is looked for. The nodes of interfaces of another class
+ * are not looked for either.
+ * The text dump comes first where there is one: it is one read, and the
+ * only source of bandwidth, where sysfs takes an open for every attribute.
+ * sysfs is read without it, or for a root usb_set_default_roots set.
+ */
+extern usb_device_info *get_usb_devices_filtered(const usb_device_filter* filter,int flags)
+{
+    usb_device_info* device_info = NULL;
+    int text = !strcmp(usb_default_sysfs_root,SYSFS_ROOT) && is_sysfs_has_usb_devices();
+
+    if(text){
+        device_info = sysfs_read_usb_devices(sysfs_usb_devices_files[sysfs_has_usb_devices-1],filter,flags);
+        if(device_info)
+            goto exit;
+    }
+
+    device_info = usb_sysfs_read_devices(NULL,NULL,filter,flags);
+exit:
+    return device_info;
+}
+
+extern usb_device_info *get_usb_devices_file(const char* file)
+{
+    if(!file)
+        return NULL;
+    return sysfs_read_usb_devices(file,NULL,USB_ENUM_ALL);
+}
+
+extern usb_device_info *usb_lookup_device(usb_device_info* root,int busnum,int devnum)
+{
+    return usb_find_device(devnum,busnum,root);
+}
+
+extern const char *usb_find_string(const usb_device_info* device,const char* str)
+{
+    const char *ret;
+
+    if(!device || !device->tree)
+        return NULL;
+    pthread_mutex_lock(&device->tree->lock);
+    ret = usb_intern_find(&device->tree->strings,str);
+    pthread_mutex_unlock(&device->tree->lock);
+    return ret;
+}
+
+extern void free_usb_devices (usb_device_info* device)
+{
+    /* everything was allocated from the arena of the tree */
+    if(device)
+        usb_free_tree(device->tree);
 }
 
 // not complete,update me
@@ -35,11 +35,11 @@ int main(int argc,char** argv)
             LOG("S:  Product=%s",info->product);
         if(info->serial)
             LOG("S:  SerialNumber=%s",info->serial);
-        for(i=0;i<info->bNumConfigurations;++i){
+        for(i=0;info->config&&i<info->bNumConfigurations&&info->config[i];++i){
             LOG("C:* #Ifs=%2d Cfg#=%2d Atr=%02x MxPwr=%3dmA",
                 info->config[i]->bNumInterfaces,info->config[i]->bConfigurationValue,
                 info->config[i]->bmAttributes,info->config[i]->bMaxPower);
-            for(j=0;j<info->config[i]->bNumInterfaces;++j){
+            for(j=0;j<info->config[i]->bNumInterfaces&&info->config[i]->interfaces[j];++j){
                 LOG("I:* If#=%2d Alt=%2d #EPs=%2d Cls=%02x(%-5s) Sub=%02x Prot=%02x Driver=%s",
                     info->config[i]->interfaces[j]->bInterfaceNumber,
                     info->config[i]->interfaces[j]->bAlternateSetting,
@@ -49,7 +49,8 @@ int main(int argc,char** argv)
                     info->config[i]->interfaces[j]->bInterfaceSubClass,
                     info->config[i]->interfaces[j]->bInterfaceProtocol,
                     info->config[i]->interfaces[j]->driver);
-                for(k=0;k<info->config[i]->interfaces[j]->bNumEndpoints;++k){
+                for(k=0;info->config[i]->interfaces[j]->endpoint&&k<info->config[i]->interfaces[j]->bNumEndpoints&&
+                        info->config[i]->interfaces[j]->endpoint[k];++k){
                     LOG("E:  Ad=%02x(%s) Atr=%02x(%s) MxPs=%4d Ivl=%dms",
                         info->config[i]->interfaces[j]->endpoint[k]->bEndpointAddress,
                         info->config[i]->interfaces[j]->endpoint[k]->in==USB_ENDPOINT_IN?"I":"O",